@@ -0,0 +1,161 @@
+#include "apic.h"
+#include "cpu.h"
+#include "pic.h"
+#include "pit.h"
+#include "paging.h"
+#include "scheduler.h"
+#include "profiler.h"
+
+// Local APIC register offsets
+// Intel SDM Vol. 3A, 10.4.1 Table 10-1
+enum lapic_registers {
+    lapic_id_register = 0x20,
+    lapic_task_priority = 0x80,
+    lapic_eoi_register = 0xb0,
+    lapic_spurious_register = 0xf0,
+    lapic_icr_low = 0x300,
+    lapic_icr_high = 0x310,
+    lapic_lvt_timer = 0x320,
+    lapic_lvt_perfmon = 0x340,
+    lapic_timer_initial_count = 0x380,
+    lapic_timer_current_count = 0x390,
+    lapic_timer_divide = 0x3e0
+};
+
+enum lapic_icr_bits {
+    icr_delivery_fixed = 0x000,
+    icr_delivery_init = 0x500,
+    icr_delivery_startup = 0x600,
+    icr_delivery_pending = 1 << 12,
+    icr_level_assert = 1 << 14,
+    icr_all_excluding_self = 3 << 18
+};
+
+enum lapic_flags {
+    lapic_software_enable = 1 << 8,
+    lapic_lvt_masked = 1 << 16,
+    lapic_timer_periodic = 1 << 17,
+    lapic_timer_divide_by_16 = 0x3
+};
+
+static const uint64_t calibration_ticks = 5;
+
+static volatile uint32_t *lapic;
+static uint32_t lapic_timer_count;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / sizeof(uint32_t)];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / sizeof(uint32_t)] = value;
+}
+
+static int lapic_timer_interrupt(struct interrupt_frame *frame, uintptr_t rbp) {
+    lapic_eoi();
+    profiler_tick(frame, rbp);
+    scheduler_tick();
+
+    return 0;
+}
+
+// Only there to bring a cpu out of hlt, the scheduler picks up the remote wakeups
+static int lapic_reschedule_interrupt(void) {
+    lapic_eoi();
+
+    return 0;
+}
+
+// Spurious interrupts must not be acknowledged
+static int lapic_spurious_interrupt(void) {
+    return 0;
+}
+
+void lapic_init(void) {
+    if(lapic == NULL) {
+        uintptr_t base = read_msr(msr_apic_base) & physical_addr_mask;
+
+        struct frame frame;
+        get_frame_for_addr(&frame, base);
+        identity_map_page(&frame, present_bit | writeable_bit | no_exec_bit, memory_type_uncached);
+
+        lapic = (volatile uint32_t*) base;
+
+        add_interrupt_handler(apic_timer_vector, (intptr_t) lapic_timer_interrupt);
+        add_interrupt_handler(apic_reschedule_vector, (intptr_t) lapic_reschedule_interrupt);
+        add_interrupt_handler(apic_spurious_vector, (intptr_t) lapic_spurious_interrupt);
+    }
+
+    lapic_write(lapic_task_priority, 0);
+    lapic_write(lapic_spurious_register, lapic_software_enable | apic_spurious_vector);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(lapic_id_register) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(lapic_eoi_register, 0);
+}
+
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    uint64_t flags = irq_save();
+
+    lapic_write(lapic_icr_high, apic_id << 24);
+    lapic_write(lapic_icr_low, command);
+
+    while(lapic_read(lapic_icr_low) & icr_delivery_pending) {
+        cpu_relax();
+    }
+
+    irq_restore(flags);
+}
+
+void lapic_send_init_all(void) {
+    lapic_send(0, icr_all_excluding_self | icr_level_assert | icr_delivery_init);
+}
+
+void lapic_send_startup_all(uint8_t page) {
+    lapic_send(0, icr_all_excluding_self | icr_level_assert | icr_delivery_startup | page);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, icr_level_assert | icr_delivery_fixed | vector);
+}
+
+void lapic_timer_calibrate(void) {
+    lapic_write(lapic_timer_divide, lapic_timer_divide_by_16);
+    lapic_write(lapic_lvt_timer, lapic_lvt_masked | apic_timer_vector);
+
+    // start on a tick edge
+    uint64_t tick = pit_get_ticks();
+    while(pit_get_ticks() == tick) {
+        cpu_relax();
+    }
+
+    lapic_write(lapic_timer_initial_count, UINT32_MAX);
+
+    tick = pit_get_ticks();
+    while(pit_get_ticks() - tick < calibration_ticks) {
+        cpu_relax();
+    }
+
+    uint32_t elapsed = UINT32_MAX - lapic_read(lapic_timer_current_count);
+    lapic_write(lapic_timer_initial_count, 0);
+
+    lapic_timer_count = elapsed / calibration_ticks;
+}
+
+void lapic_timer_start(void) {
+    lapic_write(lapic_timer_divide, lapic_timer_divide_by_16);
+    lapic_write(lapic_lvt_timer, lapic_timer_periodic | apic_timer_vector);
+    lapic_write(lapic_timer_initial_count, lapic_timer_count);
+}
+
+void lapic_perfmon_unmask(void) {
+    lapic_write(lapic_lvt_perfmon, apic_perfmon_vector);
+}
+
+void lapic_perfmon_mask(void) {
+    lapic_write(lapic_lvt_perfmon, lapic_lvt_masked | apic_perfmon_vector);
+}
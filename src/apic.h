@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum apic_vectors {
+    apic_timer_vector = 0x30,
+    apic_reschedule_vector = 0x31,
+    apic_perfmon_vector = 0x32,
+    apic_spurious_vector = 0xff
+};
+
+// Maps the local apic registers (first call only) and enables this cpu's local apic
+void lapic_init(void);
+
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+
+void lapic_send_init_all(void);
+void lapic_send_startup_all(uint8_t page);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Measures the timer rate against the PIT, must run on the BSP with interrupts enabled
+void lapic_timer_calibrate(void);
+
+// Periodic timer driving scheduler_tick at the PIT frequency
+void lapic_timer_start(void);
+
+/* Delivers this cpu's performance counter overflows on apic_perfmon_vector.
+ * The cpu masks the entry when it delivers one, so handlers unmask again.
+ */
+void lapic_perfmon_unmask(void);
+void lapic_perfmon_mask(void);
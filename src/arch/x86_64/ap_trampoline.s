@@ -0,0 +1,99 @@
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_trampoline_cr3
+
+extern gdt64
+extern interrupt_descriptor_table
+extern ap_boot_count
+extern ap_stack_count
+extern ap_stack_tops
+extern ap_main
+
+; selectors of gdt64 in boot.s
+%define KERNEL_CODE_SELECTOR 0x08
+%define KERNEL_DATA_SELECTOR 0x10
+
+section .text
+bits 16
+
+; Copied to a page below 1MiB by smp_init, application processors start
+; here in real mode after the startup IPI with cs = page << 8 and ip = 0.
+; Only offsets from ap_trampoline_start may be used for data in here.
+ap_trampoline_start:
+    cli
+    cld
+
+    mov ax, cs
+    mov ds, ax
+
+    ; PAE and SSE, the same as set_up_SSE and enable_paging in boot.s
+    mov eax, cr4
+    or eax, (1 << 5) | (3 << 9)
+    mov cr4, eax
+
+    ; page tables of the BSP, patched in by smp_init
+    mov eax, [ap_trampoline_cr3 - ap_trampoline_start]
+    mov cr3, eax
+
+    ; long mode and no execute enable bits in the EFER MSR
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, (1 << 8) | (1 << 11)
+    wrmsr
+
+    o32 lgdt [ap_trampoline_gdt_pointer - ap_trampoline_start]
+
+    ; setting protection and paging together goes straight to long mode,
+    ; coprocessor monitoring on and emulation off for SSE
+    mov eax, cr0
+    or eax, (1 << 31) | (1 << 1) | 1
+    and eax, ~(1 << 2)
+    mov cr0, eax
+
+    jmp dword KERNEL_CODE_SELECTOR:ap_long_mode_start
+
+align 4
+ap_trampoline_cr3:
+    dd 0
+
+ap_trampoline_gdt_pointer:
+    dw 3*8 - 1
+    dd gdt64
+ap_trampoline_end:
+
+bits 64
+
+ap_long_mode_start:
+    mov ax, KERNEL_DATA_SELECTOR
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; reload with the full 64 bit base
+    lgdt [ap_gdt64_pointer]
+    lidt [interrupt_descriptor_table]
+
+    ; every AP takes the next stack, the ones beyond the last stack park
+    mov eax, 1
+    lock xadd [ap_boot_count], eax
+    cmp eax, [ap_stack_count]
+    jae .park
+
+    mov rsp, [ap_stack_tops + rax*8]
+    xor ebp, ebp
+
+    ; rdi = index of the AP
+    mov edi, eax
+    call ap_main
+
+.park:
+    cli
+    hlt
+    jmp .park
+
+section .rodata
+ap_gdt64_pointer:
+    dw 3*8 - 1
+    dq gdt64
@@ -1,10 +1,17 @@
 global _start
+global gdt64
+global boot_start_tsc
 extern long_mode_start
 
 section .text
 bits 32
 
 _start:
+	;before anything else, for the boot timings
+	rdtsc
+	mov [boot_start_tsc], eax
+	mov [boot_start_tsc + 4], edx
+
 	mov esp, stack_top
 
 	; move multiboot info ptr into edi
@@ -207,4 +214,8 @@ p2_table:
 
 stack_bottom:
 	resb 16384 ; 16 KiB
-stack_top:
\ No newline at end of file
+stack_top:
+
+;TSC when the bootloader jumped to _start, see boot_time.h
+boot_start_tsc:
+    resq 1
@@ -1,5 +1,6 @@
 global long_mode_start
-global asm_add_interrupt_handler
+global interrupt_functions
+global interrupt_descriptor_table
 
 extern kernel_main
 
@@ -72,6 +73,8 @@ long_mode_start:
 
     call setup_interrupt_handlers
 
+    ;rbp = 0 ends backtraces
+    xor ebp, ebp
     call kernel_main
 
     mov dword [0xb8000], 0x4f204f20
@@ -147,30 +150,48 @@ interrupt_shim_%1:
     save_registers
     cld
 
+    ;PIC lines are acknowledged before the handler runs, the timer handler
+    ;may switch threads and not come back here until much later.
+    ;Interrupts stay disabled until iretq (or the next thread's sti).
+%if %1 >= 0x20 && %1 < 0x30
+    mov al, 0x20
+%if %1 >= 0x28
+    out 0xa0, al
+%endif
+    out 0x20, al
+%endif
+
     ;set rdi to the original stack pointer
     ;prior to saving registers on stack
     ;this is 9*8 bytes above current
     mov rdi, rsp
     add rdi, 0x48
 
+    ;rsi = the interrupted rbp, for backtraces
+    mov rsi, rbp
+
+    ;the cpu pushes an error code for some vectors and not others, so
+    ;align the stack to 16 bytes for the call as the ABI requires.
+    ;rbx is callee saved, it keeps the unaligned rsp across the call
+    push rbx
+    mov rbx, rsp
+    and rsp, -16
+
     mov eax, 0
     call [interrupt_functions + %1 * 8]
 
+    mov rsp, rbx
+    pop rbx
+
     ;eax set to 1 if an error code needs popping from the stack
     cmp eax, 0
     jne .restore_and_pop_stack
 
-    mov al, 0x20
-    out 0x20, al
-
     restore_registers
 
     iretq
 
 .restore_and_pop_stack:
-    mov al, 0x20
-    out 0x20, al
-
     restore_registers
     add rsp, 8
     iretq
@@ -182,12 +203,6 @@ interrupt_shim_%1:
 %assign interrupt_shim_counter interrupt_shim_counter+1
 %endrep
 
-;function prototype asm_add_interrupt_handler(uint16_t interrupt, void(*handler)(void))
-;x86_64 system V ABI has rsi = remapped interrupt number (e.g. timer = 0x20, keyboard = 0x21), rdi = handler
-asm_add_interrupt_handler:
-    mov qword [interrupt_functions + edi*8], rsi
-    ret
-
 ;interrupt address in rax
 ;interrupt vector in rbx
 create_interrupt:
@@ -241,7 +256,8 @@ i_ok:
 
 section .bss
 align 8
-;8byte ptrs to interrupt functions
+;8byte ptrs to interrupt functions, each loaded once by its shim
+;and updated from C with add_interrupt_handler (rcu protected)
 interrupt_functions:
     resb 256*8
 
@@ -0,0 +1,41 @@
+global context_switch
+global thread_entry_trampoline
+
+extern thread_start
+
+section .text
+bits 64
+
+;function prototype context_switch(uintptr_t *old_sp, uintptr_t new_sp)
+;rdi = where to store the outgoing thread's stack pointer, rsi = incoming thread's stack pointer
+;Only the callee saved registers are kept here. Everything else was saved by
+;the caller, or by the interrupt shim when the switch comes from the timer.
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+
+    mov [rdi], rsp
+    mov rsp, rsi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+
+    ret
+
+;first return target of a new thread, see thread_create
+;r12 = entry function, r13 = argument
+thread_entry_trampoline:
+    and rsp, -16
+    mov rdi, r12
+    mov rsi, r13
+    call thread_start
+
+    hlt
@@ -6,7 +6,15 @@ header_start:
     ; checksum
     dd 0x100000000 - (0xe85250d6 + 0 + (header_end - header_start))
 
-    ; insert optional multiboot tags here
+    ; framebuffer tag, optional so text mode stays usable. 0 leaves the
+    ; mode to grub's gfxpayload setting.
+    dw 5    ; type
+    dw 1    ; flags (optional)
+    dd 20   ; size
+    dd 0    ; width
+    dd 0    ; height
+    dd 32   ; depth
+    align 8, db 0
 
     ; required end tag
     dw 0    ; type
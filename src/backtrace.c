@@ -0,0 +1,79 @@
+#include "backtrace.h"
+#include <stdbool.h>
+#include "symbols.h"
+#include "terminal.h"
+
+// rbp points at the caller's rbp with the return address above it
+static int frame_pointer_unwind(struct unwind_registers *regs) {
+    uintptr_t rbp, rip;
+
+    if(regs->rbp == 0 || unwind_read_stack(regs->rbp, &rbp) != 0 || unwind_read_stack(regs->rbp + 8, &rip) != 0) {
+        return -1;
+    }
+
+    *regs = (struct unwind_registers) { rip, regs->rbp + 16, rbp };
+    return 0;
+}
+
+static size_t collect(struct unwind_registers frame, bool rip_is_return_address, bool use_eh_frame,
+    uintptr_t *addresses, size_t max) {
+    size_t count = 0;
+
+    while(count < max && frame.rip != 0) {
+        addresses[count++] = frame.rip;
+
+        uintptr_t rsp = frame.rsp;
+
+        if((!use_eh_frame || eh_frame_unwind(&frame, rip_is_return_address) != 0) && frame_pointer_unwind(&frame) != 0) {
+            break;
+        }
+
+        // callers are always further up the stack, anything else is garbage
+        if(frame.rsp <= rsp) {
+            break;
+        }
+
+        rip_is_return_address = true;
+    }
+
+    return count;
+}
+
+size_t backtrace_collect(const struct unwind_registers *regs, uintptr_t *addresses, size_t max) {
+    return collect(*regs, false, true, addresses, max);
+}
+
+size_t backtrace_collect_frame_pointers(const struct unwind_registers *regs, uintptr_t *addresses, size_t max) {
+    return collect(*regs, false, false, addresses, max);
+}
+
+static void print_addresses(const uintptr_t *addresses, size_t count) {
+    terminal_printf("Backtrace:\n");
+
+    for(size_t i=0; i<count; ++i) {
+        terminal_printf("  #%zu ", i);
+        symbols_print_address(addresses[i]);
+    }
+
+    if(count == BACKTRACE_MAX_DEPTH) {
+        terminal_printf("  ...\n");
+    }
+}
+
+void backtrace_print_from(const struct unwind_registers *regs) {
+    uintptr_t addresses[BACKTRACE_MAX_DEPTH];
+    print_addresses(addresses, backtrace_collect(regs, addresses, BACKTRACE_MAX_DEPTH));
+}
+
+// Never inlined, its own frame is how the caller's registers are found
+__attribute__ ((noinline)) void backtrace_print(void) {
+    uintptr_t *frame = __builtin_frame_address(0);
+    struct unwind_registers regs = {
+        .rip = (uintptr_t) __builtin_return_address(0),
+        .rsp = (uintptr_t) (frame + 2),
+        .rbp = frame[0]
+    };
+
+    uintptr_t addresses[BACKTRACE_MAX_DEPTH];
+    print_addresses(addresses, collect(regs, true, true, addresses, BACKTRACE_MAX_DEPTH));
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "eh_frame.h"
+
+/* Stack backtraces for fault reports and debugging. Each frame is unwound
+ * with .eh_frame when its code has frame information, otherwise along the
+ * rbp chain the kernel keeps with -fno-omit-frame-pointer. The chain ends
+ * at an rbp of 0, which the boot code and thread_create set up. Only
+ * mapped memory is read, nothing is locked or allocated.
+ */
+
+#define BACKTRACE_MAX_DEPTH 32
+
+/* Fills addresses with regs->rip, taken as the interrupted instruction,
+ * then the return address of each caller. Returns how many were written.
+ */
+size_t backtrace_collect(const struct unwind_registers *regs, uintptr_t *addresses, size_t max);
+
+/* As backtrace_collect but only along the rbp chain, cheap enough to run on
+ * every timer tick. Code interrupted before its prologue set up rbp loses
+ * its caller.
+ */
+size_t backtrace_collect_frame_pointers(const struct unwind_registers *regs, uintptr_t *addresses, size_t max);
+
+// Prints a symbolized backtrace starting at the interrupted instruction
+void backtrace_print_from(const struct unwind_registers *regs);
+
+// Prints a symbolized backtrace of the caller
+void backtrace_print(void);
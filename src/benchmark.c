@@ -0,0 +1,296 @@
+#include "benchmark.h"
+#include <stdbool.h>
+#include <stdarg.h>
+#include "cpu.h"
+#include "pic.h"
+#include "qemu.h"
+#include "thread.h"
+#include "serial.h"
+#include "format.h"
+#include "terminal.h"
+#include "boot_param.h"
+
+// Set by the linker script around the .benchmarks section
+extern const struct benchmark __benchmarks_start[];
+extern const struct benchmark __benchmarks_end[];
+
+// Not used by the pics, the local apics or the exceptions
+#define BENCHMARK_INTERRUPT_VECTOR 0x80
+
+static char bench[128];
+BOOT_PARAM_STRING("bench", bench);
+
+static int64_t bench_iterations = 1000;
+BOOT_PARAM_INT("bench_iterations", bench_iterations, 1, BENCHMARK_MAX_ITERATIONS);
+
+static int64_t bench_warmup = 100;
+BOOT_PARAM_INT("bench_warmup", bench_warmup, 0, 1000000);
+
+static bool bench_exit = false;
+BOOT_PARAM_BOOL("bench_exit", bench_exit);
+
+static const char *const event_keys[PMU_EVENT_COUNT] = {
+    [pmu_event_cycles] = "cycles",
+    [pmu_event_instructions] = "instructions",
+    [pmu_event_llc_misses] = "llc_misses",
+    [pmu_event_branch_misses] = "branch_misses"
+};
+
+// Only the runner thread uses it
+static uint64_t samples[BENCHMARK_MAX_ITERATIONS];
+
+static void sift_down(uint64_t *values, size_t root, size_t count) {
+    for(size_t child = 2 * root + 1; child < count; child = 2 * root + 1) {
+        if(child + 1 < count && values[child + 1] > values[child]) {
+            ++child;
+        }
+
+        if(values[root] >= values[child]) {
+            return;
+        }
+
+        uint64_t value = values[root];
+        values[root] = values[child];
+        values[child] = value;
+        root = child;
+    }
+}
+
+// Heapsort, no allocation and no deep recursion on a thread stack
+static void sort(uint64_t *values, size_t count) {
+    for(size_t i = count / 2; i-- > 0;) {
+        sift_down(values, i, count);
+    }
+
+    for(size_t end = count; end-- > 1;) {
+        uint64_t value = values[0];
+        values[0] = values[end];
+        values[end] = value;
+        sift_down(values, 0, end);
+    }
+}
+
+int benchmark_run(const struct benchmark *benchmark, size_t warmup, size_t iterations, struct benchmark_result *result) {
+    if(iterations == 0 || iterations > BENCHMARK_MAX_ITERATIONS) {
+        return -1;
+    }
+
+    void *context = NULL;
+    if(benchmark->setup != NULL && benchmark->setup(&context) != 0) {
+        return -1;
+    }
+
+    for(size_t i=0; i<warmup; ++i) {
+        benchmark->run(context);
+    }
+
+    struct pmu_region region;
+    pmu_region_begin(&region);
+
+    for(size_t i=0; i<iterations; ++i) {
+        uint64_t start = read_tsc();
+        benchmark->run(context);
+        samples[i] = read_tsc() - start;
+    }
+
+    pmu_region_end(&region, &result->counts);
+
+    if(benchmark->teardown != NULL) {
+        benchmark->teardown(context);
+    }
+
+    uint64_t total = 0;
+    for(size_t i=0; i<iterations; ++i) {
+        total += samples[i];
+    }
+
+    sort(samples, iterations);
+
+    result->iterations = iterations;
+    result->min = samples[0];
+    result->median = samples[iterations / 2];
+    result->p99 = samples[iterations * 99 / 100];
+    result->max = samples[iterations - 1];
+    result->mean = total / iterations;
+
+    return 0;
+}
+
+// Appends to a line, output past its end is dropped
+struct line {
+    char data[512];
+    size_t used;
+};
+
+static void line_append(struct line *line, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(line->data + line->used, sizeof(line->data) - line->used, fmt, args);
+    va_end(args);
+
+    line->used += length;
+    if(line->used >= sizeof(line->data)) {
+        line->used = sizeof(line->data) - 1;
+    }
+}
+
+// Names are C identifiers, nothing in them needs escaping
+static void print_json(const struct benchmark *benchmark, size_t warmup, const struct benchmark_result *result) {
+    struct line line = { .used = 0 };
+
+    line_append(&line, "{\"name\":\"%s\",\"iterations\":%zu,\"warmup\":%zu,", benchmark->name, result->iterations, warmup);
+    line_append(&line, "\"tsc\":{\"min\":%zu,\"median\":%zu,\"p99\":%zu,\"max\":%zu,\"mean\":%zu},",
+        result->min, result->median, result->p99, result->max, result->mean);
+    line_append(&line, "\"pmu\":{");
+
+    bool first = true;
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        if(result->counts.valid & (1U << i)) {
+            line_append(&line, "%s\"%s\":%zu", first ? "" : ",", event_keys[i], result->counts.events[i]);
+            first = false;
+        }
+    }
+
+    line_append(&line, "}}\n");
+
+    // a single write, so other serial output can't land inside the line
+    serial_write(line.data, line.used);
+}
+
+static void report(const struct benchmark *benchmark, size_t warmup, const struct benchmark_result *result) {
+    terminal_printf("%s: min %zu median %zu p99 %zu max %zu mean %zu tsc\n",
+        benchmark->name, result->min, result->median, result->p99, result->max, result->mean);
+    pmu_print_counts(benchmark->name, &result->counts, result->iterations);
+
+    print_json(benchmark, warmup, result);
+}
+
+// Returns 0 on success, non-zero if it failed
+static int run_and_report(const struct benchmark *benchmark) {
+    struct benchmark_result result;
+
+    if(benchmark_run(benchmark, bench_warmup, bench_iterations, &result) != 0) {
+        terminal_printf("Bench: %s failed to set up\n", benchmark->name);
+        return -1;
+    }
+
+    report(benchmark, bench_warmup, &result);
+    return 0;
+}
+
+// name is a slice of the list, it isn't terminated
+static bool name_equals(const char *name, size_t length, const char *string) {
+    size_t i = 0;
+    while(i < length && string[i] == name[i]) {
+        ++i;
+    }
+
+    return i == length && string[i] == '\0';
+}
+
+static const struct benchmark* find_benchmark(const char *name, size_t length) {
+    for(const struct benchmark *benchmark = __benchmarks_start; benchmark < __benchmarks_end; ++benchmark) {
+        if(name_equals(name, length, benchmark->name)) {
+            return benchmark;
+        }
+    }
+
+    return NULL;
+}
+
+size_t benchmark_run_named(const char *names) {
+    size_t failed = 0;
+
+    serial_write("# bench begin\n", 14);
+
+    for(const char *name = names; *name != '\0';) {
+        size_t length = 0;
+        while(name[length] != '\0' && name[length] != ',') {
+            ++length;
+        }
+
+        if(name_equals(name, length, "all")) {
+            for(const struct benchmark *benchmark = __benchmarks_start; benchmark < __benchmarks_end; ++benchmark) {
+                failed += run_and_report(benchmark) != 0;
+            }
+        } else if(length > 0) {
+            const struct benchmark *benchmark = find_benchmark(name, length);
+
+            if(benchmark == NULL) {
+                terminal_printf("Bench: no benchmark named %.*s\n", (int) length, name);
+                ++failed;
+            } else {
+                failed += run_and_report(benchmark) != 0;
+            }
+        }
+
+        name += length;
+        if(*name == ',') {
+            ++name;
+        }
+    }
+
+    serial_write("# bench end\n", 12);
+
+    return failed;
+}
+
+static void bench_main(void *arg) {
+    (void) arg;
+
+    if(!serial_present()) {
+        terminal_printf("Bench: no serial port for the JSON results\n");
+    }
+
+    size_t failed = benchmark_run_named(bench);
+    terminal_printf("Bench: done, %zu failed\n", failed);
+
+    if(bench_exit) {
+        qemu_exit(failed == 0 ? 0 : 1);
+    }
+}
+
+void benchmark_init(void) {
+    if(bench[0] == '\0') {
+        return;
+    }
+
+    if(thread_create_on(0, "bench", bench_main, NULL) == NULL) {
+        terminal_printf("Bench: no thread to run the benchmarks\n");
+    }
+}
+
+// The TSC reads around every sample, for comparing the others against
+static void empty_benchmark(void *context) {
+    (void) context;
+}
+BENCHMARK("empty", empty_benchmark);
+
+// What loop() in kernel.c used to burn, a million trips round an empty loop
+static void spin_benchmark(void *context) {
+    (void) context;
+
+    for(int k = 0; k < 1000000; ++k) {
+        asm volatile("");
+    }
+}
+BENCHMARK("spin_1m", spin_benchmark);
+
+static int benchmark_interrupt(struct interrupt_frame *frame, uintptr_t rbp) {
+    (void) frame;
+    (void) rbp;
+    return 0;
+}
+
+static int interrupt_setup(void **context) {
+    (void) context;
+    add_interrupt_handler(BENCHMARK_INTERRUPT_VECTOR, (intptr_t) benchmark_interrupt);
+    return 0;
+}
+
+// A software interrupt through the shims and back, the cost every interrupt pays before its handler
+static void interrupt_benchmark(void *context) {
+    (void) context;
+    asm volatile("int %0" : : "i"(BENCHMARK_INTERRUPT_VECTOR) : "memory");
+}
+BENCHMARK_WITH_SETUP("interrupt_roundtrip", interrupt_benchmark, interrupt_setup, NULL);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pmu.h"
+
+/* In-kernel microbenchmarks. A benchmark is a function doing one operation,
+ * registered with BENCHMARK next to the code it measures, which places a
+ * descriptor in the .benchmarks section the way BOOT_PARAM does.
+ *
+ * The runner calls it bench_warmup times, then times each of
+ * bench_iterations calls with the TSC and reports the min, median, p99,
+ * max and mean, and the PMU counts over the timed calls. Timer interrupts
+ * land in some samples, which is what the max and p99 show.
+ *
+ * The bench boot parameter names the benchmarks to run, comma separated, or
+ * all of them. Results go to the terminal, and over serial as one JSON object
+ * a line between "# bench begin" and "# bench end":
+ *   {"name":"kmalloc_free","iterations":1000,"warmup":100,
+ *    "tsc":{"min":..,"median":..,"p99":..,"max":..,"mean":..},
+ *    "pmu":{"cycles":..,"instructions":..,"llc_misses":..,"branch_misses":..}}
+ * PMU counts are totals over the iterations, events that can't be counted
+ * are left out. With bench_exit QEMU exits after the run, see make bench.
+ */
+
+// Samples are kept in a static array of this size
+#define BENCHMARK_MAX_ITERATIONS 16384
+
+struct benchmark {
+    const char *name;
+
+    // one operation, context is what setup set
+    void (*run)(void *context);
+
+    // optional, returns 0 on success or non-zero to skip the benchmark
+    int (*setup)(void **context);
+    void (*teardown)(void *context);
+};
+
+struct benchmark_result {
+    size_t iterations;
+
+    // TSC cycles per call
+    uint64_t min;
+    uint64_t median;
+    uint64_t p99;
+    uint64_t max;
+    uint64_t mean;
+
+    // over all the timed calls together
+    struct pmu_counts counts;
+};
+
+#define BENCHMARK_DEFINE(bench_name, run_function, ...) \
+    static const struct benchmark benchmark_##run_function \
+        __attribute__ ((section (".benchmarks"), used, aligned (8))) = \
+        { .name = bench_name, .run = run_function, __VA_ARGS__ }
+
+#define BENCHMARK(name, run_function) \
+    BENCHMARK_DEFINE(name, run_function)
+
+#define BENCHMARK_WITH_SETUP(name, run_function, setup_function, teardown_function) \
+    BENCHMARK_DEFINE(name, run_function, .setup = setup_function, .teardown = teardown_function)
+
+/* Runs a benchmark from a thread. Returns 0 on success.
+ * Non-zero if its setup fails or iterations is out of range.
+ */
+int benchmark_run(const struct benchmark *benchmark, size_t warmup, size_t iterations, struct benchmark_result *result);
+
+/* Runs and reports every benchmark in the comma separated list of names, or
+ * all of them for "all". Returns the number that failed or weren't found.
+ */
+size_t benchmark_run_named(const char *names);
+
+// Starts a thread running the bench boot parameter's benchmarks, if any. Must run after scheduler_init.
+void benchmark_init(void);
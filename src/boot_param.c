@@ -0,0 +1,267 @@
+#include "boot_param.h"
+#include "terminal.h"
+
+// Set by the linker script around the .boot_params section
+extern const struct boot_param __boot_params_start[];
+extern const struct boot_param __boot_params_end[];
+
+// A slice of the command line, it isn't copied or terminated
+struct token {
+    const char *text;
+    size_t length;
+};
+
+static bool token_equals(struct token token, const char *string) {
+    size_t i = 0;
+
+    for(; i<token.length; ++i) {
+        if(string[i] != token.text[i]) {
+            return false;
+        }
+    }
+
+    return string[i] == '\0';
+}
+
+static const struct boot_param* find_param(struct token name) {
+    for(const struct boot_param *param = __boot_params_start; param < __boot_params_end; ++param) {
+        if(token_equals(name, param->name)) {
+            return param;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns 0 on success. Non-zero if the token isn't a whole number or overflows.
+static int parse_int(struct token token, int64_t *value, size_t *used) {
+    size_t i = 0;
+    bool negative = false;
+    uint64_t base = 10;
+    uint64_t result = 0;
+
+    if(i < token.length && token.text[i] == '-') {
+        negative = true;
+        ++i;
+    }
+
+    if(i + 1 < token.length && token.text[i] == '0' && (token.text[i+1] == 'x' || token.text[i+1] == 'X')) {
+        base = 16;
+        i += 2;
+    }
+
+    size_t first_digit = i;
+
+    for(; i<token.length; ++i) {
+        char c = token.text[i];
+        uint64_t digit;
+
+        if(c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if(base == 16 && c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if(base == 16 && c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            break;
+        }
+
+        if(result > (INT64_MAX - digit) / base) {
+            return -1;
+        }
+        result = result * base + digit;
+    }
+
+    if(i == first_digit) {
+        return -1;
+    }
+
+    *value = negative ? -(int64_t) result : (int64_t) result;
+    *used = i;
+    return 0;
+}
+
+static int parse_size(struct token token, int64_t *value) {
+    size_t used;
+    if(parse_int(token, value, &used) != 0 || *value < 0) {
+        return -1;
+    }
+
+    if(used == token.length) {
+        return 0;
+    }
+
+    if(used + 1 != token.length) {
+        return -1;
+    }
+
+    int shift;
+    switch(token.text[used]) {
+        case 'k': case 'K':
+            shift = 10;
+            break;
+        case 'm': case 'M':
+            shift = 20;
+            break;
+        case 'g': case 'G':
+            shift = 30;
+            break;
+        default:
+            return -1;
+    }
+
+    if(*value > (INT64_MAX >> shift)) {
+        return -1;
+    }
+
+    *value <<= shift;
+    return 0;
+}
+
+static const char *const true_names[] = { "1", "true", "on", "yes", NULL };
+static const char *const false_names[] = { "0", "false", "off", "no", NULL };
+
+// Returns the index of the matching name, or -1 if none match
+static int find_choice(struct token token, const char *const *choices) {
+    for(int i=0; choices[i] != NULL; ++i) {
+        if(token_equals(token, choices[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Returns 0 on success. Non-zero if the value doesn't parse or is out of range.
+static int set_param(const struct boot_param *param, struct token value, bool has_value) {
+    int64_t number;
+    size_t used;
+    int choice;
+
+    if(!has_value && param->type != boot_param_bool) {
+        return -1;
+    }
+
+    switch(param->type) {
+        case boot_param_int:
+            if(parse_int(value, &number, &used) != 0 || used != value.length) {
+                return -1;
+            }
+            if(number < param->min || number > param->max) {
+                return -1;
+            }
+            *(int64_t*) param->value = number;
+            return 0;
+        case boot_param_size:
+            if(parse_size(value, &number) != 0 || number < param->min || number > param->max) {
+                return -1;
+            }
+            *(size_t*) param->value = number;
+            return 0;
+        case boot_param_bool:
+            if(!has_value || find_choice(value, true_names) >= 0) {
+                *(bool*) param->value = true;
+            } else if(find_choice(value, false_names) >= 0) {
+                *(bool*) param->value = false;
+            } else {
+                return -1;
+            }
+            return 0;
+        case boot_param_enum:
+            choice = find_choice(value, param->choices);
+            if(choice < 0) {
+                return -1;
+            }
+            *(int*) param->value = choice;
+            return 0;
+        case boot_param_string:
+            if(value.length >= (size_t) param->max) {
+                return -1;
+            }
+            for(size_t i=0; i<value.length; ++i) {
+                ((char*) param->value)[i] = value.text[i];
+            }
+            ((char*) param->value)[value.length] = '\0';
+            return 0;
+    }
+
+    return -1;
+}
+
+static void parse_argument(struct token argument) {
+    struct token name = { argument.text, 0 };
+    while(name.length < argument.length && argument.text[name.length] != '=') {
+        ++name.length;
+    }
+
+    bool has_value = name.length < argument.length;
+    struct token value = { argument.text, 0 };
+    if(has_value) {
+        value.text = argument.text + name.length + 1;
+        value.length = argument.length - name.length - 1;
+    }
+
+    const struct boot_param *param = find_param(name);
+    if(param == NULL) {
+        terminal_printf("boot: unknown parameter %.*s\n", (int) argument.length, argument.text);
+        return;
+    }
+
+    if(set_param(param, value, has_value) != 0) {
+        terminal_printf("boot: bad value for %s, kept the default: %.*s\n", param->name, (int) argument.length, argument.text);
+    }
+}
+
+void boot_params_parse(const char *command_line) {
+    if(command_line == NULL) {
+        return;
+    }
+
+    const char *p = command_line;
+
+    // grub passes the kernel's path first
+    if(*p == '/') {
+        while(*p != '\0' && *p != ' ') {
+            ++p;
+        }
+    }
+
+    while(*p != '\0') {
+        while(*p == ' ') {
+            ++p;
+        }
+
+        struct token argument = { p, 0 };
+        while(p[argument.length] != '\0' && p[argument.length] != ' ') {
+            ++argument.length;
+        }
+
+        if(argument.length > 0) {
+            parse_argument(argument);
+        }
+
+        p += argument.length;
+    }
+}
+
+void boot_params_print(void) {
+    for(const struct boot_param *param = __boot_params_start; param < __boot_params_end; ++param) {
+        switch(param->type) {
+            case boot_param_int:
+                terminal_printf("%s=%lld\n", param->name, (long long) *(int64_t*) param->value);
+                break;
+            case boot_param_size:
+                terminal_printf("%s=%#zx\n", param->name, *(size_t*) param->value);
+                break;
+            case boot_param_bool:
+                terminal_printf("%s=%s\n", param->name, *(bool*) param->value ? "on" : "off");
+                break;
+            case boot_param_enum:
+                terminal_printf("%s=%s\n", param->name, param->choices[*(int*) param->value]);
+                break;
+            case boot_param_string:
+                terminal_printf("%s=%s\n", param->name, (const char*) param->value);
+                break;
+        }
+    }
+}
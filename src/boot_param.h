@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Options set from the kernel command line. A subsystem declares a static
+ * variable holding the default and registers it with one of the BOOT_PARAM
+ * macros, which place a descriptor in the .boot_params section.
+ * boot_params_parse walks the section once at boot and fills the
+ * variables in, so nothing needs a central list.
+ *
+ * The command line is space separated name=value pairs:
+ *   int     decimal or 0x hex, optionally negative        timer_hz=250
+ *   size    an int with an optional K, M or G suffix      heap_size=4M
+ *   bool    1/0, true/false, on/off, yes/no, or no value  serial_console=off
+ *   enum    one of the names given at the declaration     log_level=warn
+ *   string  any text shorter than the variable's array    bench=all
+ * A value that doesn't parse or is out of range keeps the default and is
+ * reported, as are unknown names.
+ */
+
+enum boot_param_type {
+    boot_param_int,
+    boot_param_size,
+    boot_param_bool,
+    boot_param_enum,
+    boot_param_string
+};
+
+struct boot_param {
+    const char *name;
+    enum boot_param_type type;
+
+    // int64_t, size_t, bool, int for the index of an enum choice or a char array
+    void *value;
+
+    // inclusive range for ints and sizes, max is the array size for strings
+    int64_t min;
+    int64_t max;
+
+    // NULL terminated names of the enum values
+    const char *const *choices;
+};
+
+// The aligned attribute stops gcc padding the descriptors apart in the section
+#define BOOT_PARAM_DEFINE(param_name, variable, param_type, ...) \
+    static const struct boot_param boot_param_##variable \
+        __attribute__ ((section (".boot_params"), used, aligned (8))) = \
+        { .name = param_name, .type = param_type, .value = &variable, __VA_ARGS__ }
+
+#define BOOT_PARAM_INT(name, variable, min_value, max_value) \
+    BOOT_PARAM_DEFINE(name, variable, boot_param_int, .min = min_value, .max = max_value)
+
+#define BOOT_PARAM_SIZE(name, variable, min_value, max_value) \
+    BOOT_PARAM_DEFINE(name, variable, boot_param_size, .min = min_value, .max = max_value)
+
+#define BOOT_PARAM_BOOL(name, variable) \
+    BOOT_PARAM_DEFINE(name, variable, boot_param_bool)
+
+#define BOOT_PARAM_ENUM(name, variable, names) \
+    BOOT_PARAM_DEFINE(name, variable, boot_param_enum, .choices = names)
+
+// variable must be a char array, not a pointer
+#define BOOT_PARAM_STRING(name, variable) \
+    BOOT_PARAM_DEFINE(name, variable, boot_param_string, .max = sizeof(variable))
+
+/* Sets every registered parameter named on the command line. Runs once,
+ * before the subsystems that read them are initialised.
+ */
+void boot_params_parse(const char *command_line);
+
+// Prints every parameter with its current value
+void boot_params_print(void);
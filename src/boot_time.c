@@ -0,0 +1,78 @@
+#include "boot_time.h"
+#include "cpu.h"
+#include "pit.h"
+#include "ktest.h"
+#include "terminal.h"
+#include "boot_param.h"
+
+struct stage_time {
+    uint64_t begin;
+    uint64_t end;
+};
+
+static const char *const stage_names[BOOT_STAGE_COUNT] = {
+    [boot_stage_kernel_main] = "kernel_main",
+    [boot_stage_remap_kernel] = "remap_kernel",
+    [boot_stage_init_heap] = "init_heap"
+};
+
+// kernel_main's stage begins at reset, when the TSC was 0
+static struct stage_time stages[BOOT_STAGE_COUNT];
+
+// Microseconds, generous enough for QEMU without KVM
+static int64_t boot_budget_kernel_main_us = 5000000;
+BOOT_PARAM_INT("boot_budget_kernel_main_us", boot_budget_kernel_main_us, 1, 600000000);
+
+static int64_t boot_budget_remap_kernel_us = 500000;
+BOOT_PARAM_INT("boot_budget_remap_kernel_us", boot_budget_remap_kernel_us, 1, 600000000);
+
+static int64_t boot_budget_init_heap_us = 100000;
+BOOT_PARAM_INT("boot_budget_init_heap_us", boot_budget_init_heap_us, 1, 600000000);
+
+static const int64_t *const stage_budgets[BOOT_STAGE_COUNT] = {
+    [boot_stage_kernel_main] = &boot_budget_kernel_main_us,
+    [boot_stage_remap_kernel] = &boot_budget_remap_kernel_us,
+    [boot_stage_init_heap] = &boot_budget_init_heap_us
+};
+
+void boot_time_begin(enum boot_stage stage) {
+    stages[stage].begin = read_tsc();
+}
+
+void boot_time_end(enum boot_stage stage) {
+    stages[stage].end = read_tsc();
+}
+
+static uint64_t to_microseconds(uint64_t cycles, uint64_t tsc_frequency) {
+    uint64_t cycles_per_microsecond = tsc_frequency / 1000000;
+    return cycles_per_microsecond != 0 ? cycles / cycles_per_microsecond : 0;
+}
+
+static uint64_t stage_microseconds(enum boot_stage stage, uint64_t tsc_frequency) {
+    return to_microseconds(stages[stage].end - stages[stage].begin, tsc_frequency);
+}
+
+void boot_time_print(uint64_t tsc_frequency) {
+    terminal_printf("Boot: TSC at %zu MHz, _start at %zu us\n",
+        tsc_frequency / 1000000, to_microseconds(boot_start_tsc, tsc_frequency));
+
+    for(size_t i=0; i<BOOT_STAGE_COUNT; ++i) {
+        terminal_printf("Boot: %s took %zu us, budget %zu us\n",
+            stage_names[i], stage_microseconds(i, tsc_frequency), (size_t) *stage_budgets[i]);
+    }
+}
+
+static int boot_time_budget_test(void) {
+    uint64_t tsc_frequency = pit_tsc_frequency();
+    boot_time_print(tsc_frequency);
+
+    KTEST_EXPECT(tsc_frequency != 0);
+
+    for(size_t i=0; i<BOOT_STAGE_COUNT; ++i) {
+        KTEST_EXPECT(stages[i].end != 0);
+        KTEST_EXPECT(stage_microseconds(i, tsc_frequency) <= (uint64_t) *stage_budgets[i]);
+    }
+
+    return 0;
+}
+KTEST("boot_time_budget", boot_time_budget_test);
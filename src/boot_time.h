@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+/* TSC timestamps of the boot. Under QEMU and on most machines the TSC
+ * starts at 0 on reset, so the kernel_main stage runs from reset, through
+ * the firmware and the bootloader, to the first line of kernel_main. boot.s
+ * also keeps the TSC at _start in boot_start_tsc.
+ *
+ * The boot_time_budget test fails when a stage took longer than its
+ * boot_budget_<stage>_us boot parameter, which is how make test catches
+ * boot time regressions.
+ */
+
+enum boot_stage {
+    boot_stage_kernel_main,
+    boot_stage_remap_kernel,
+    boot_stage_init_heap,
+    BOOT_STAGE_COUNT
+};
+
+extern uint64_t boot_start_tsc;
+
+void boot_time_begin(enum boot_stage stage);
+void boot_time_end(enum boot_stage stage);
+
+// Prints how long each stage took, tsc_frequency is in cycles per second
+void boot_time_print(uint64_t tsc_frequency);
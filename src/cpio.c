@@ -0,0 +1,137 @@
+#include "cpio.h"
+#include <stdbool.h>
+#include "util.h"
+#include "terminal.h"
+
+// Every field is 8 ascii hex digits
+struct cpio_newc_header {
+    char magic[6];
+    char ino[8];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char nlink[8];
+    char mtime[8];
+    char filesize[8];
+    char devmajor[8];
+    char devminor[8];
+    char rdevmajor[8];
+    char rdevminor[8];
+    char namesize[8];
+    char check[8];
+} __attribute__ ((packed));
+
+static const char cpio_magic[] = "070701";
+static const char cpio_magic_crc[] = "070702";
+static const char cpio_trailer[] = "TRAILER!!!";
+
+// The header plus name, and the file data, are each padded to 4 bytes
+static inline size_t cpio_align(size_t offset) {
+    return (offset + 3) & ~(size_t) 3;
+}
+
+// Returns 0 on success. Non-zero if a character isn't a hex digit.
+static int parse_hex(const char field[8], uint32_t *value) {
+    uint32_t result = 0;
+
+    for(size_t i=0; i<8; ++i) {
+        char c = field[i];
+        uint32_t digit;
+
+        if(c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if(c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if(c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+
+        result = (result << 4) | digit;
+    }
+
+    *value = result;
+    return 0;
+}
+
+static bool strings_equal(const char *a, const char *b) {
+    while(*a != '\0' && *a == *b) {
+        ++a;
+        ++b;
+    }
+
+    return *a == *b;
+}
+
+int cpio_next(const uint8_t *archive, size_t size, size_t *offset, struct cpio_file *file) {
+    size_t header_offset = *offset;
+
+    if(header_offset > size || size - header_offset < sizeof(struct cpio_newc_header)) {
+        return -1;
+    }
+
+    const struct cpio_newc_header *header = (const struct cpio_newc_header*) (archive + header_offset);
+
+    if(memcmp(header->magic, cpio_magic, 6) != 0 && memcmp(header->magic, cpio_magic_crc, 6) != 0) {
+        return -1;
+    }
+
+    uint32_t mode, file_size, name_size;
+    if(parse_hex(header->mode, &mode) != 0 || parse_hex(header->filesize, &file_size) != 0
+        || parse_hex(header->namesize, &name_size) != 0) {
+        return -1;
+    }
+
+    size_t name_offset = header_offset + sizeof(struct cpio_newc_header);
+    if(name_size == 0 || size - name_offset < name_size) {
+        return -1;
+    }
+
+    const char *name = (const char*) (archive + name_offset);
+    if(name[name_size - 1] != '\0') {
+        return -1;
+    }
+
+    size_t data_offset = cpio_align(name_offset + name_size);
+    if(data_offset > size || size - data_offset < file_size) {
+        return -1;
+    }
+
+    if(strings_equal(name, cpio_trailer)) {
+        return -1;
+    }
+
+    while(name[0] == '.' && name[1] == '/') {
+        name += 2;
+    }
+
+    file->name = name;
+    file->data = archive + data_offset;
+    file->size = file_size;
+    file->mode = mode;
+
+    *offset = cpio_align(data_offset + file_size);
+    return 0;
+}
+
+int cpio_find(const uint8_t *archive, size_t size, const char *name, struct cpio_file *file) {
+    size_t offset = 0;
+
+    while(cpio_next(archive, size, &offset, file) == 0) {
+        if(strings_equal(file->name, name)) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void cpio_print(const uint8_t *archive, size_t size) {
+    size_t offset = 0;
+    struct cpio_file file;
+
+    while(cpio_next(archive, size, &offset, &file) == 0) {
+        terminal_printf("%s \t %#zx bytes\n", file.name, file.size);
+    }
+}
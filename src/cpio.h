@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Reader for "newc" cpio archives, what "cpio -o -H newc" writes. Files
+ * are returned in place, nothing is copied or allocated, so the archive
+ * must stay mapped while they are used.
+ */
+
+struct cpio_file {
+    // zero terminated, without any leading "./"
+    const char *name;
+    const uint8_t *data;
+    size_t size;
+    uint32_t mode;
+};
+
+/* Reads the entry at *offset and moves *offset on to the next one.
+ * Returns 0 on success. Non-zero at the end of the archive or if the
+ * header is malformed.
+ */
+int cpio_next(const uint8_t *archive, size_t size, size_t *offset, struct cpio_file *file);
+
+// Returns 0 on success. Non-zero if the archive has no entry with the name.
+int cpio_find(const uint8_t *archive, size_t size, const char *name, struct cpio_file *file);
+
+// Lists every entry with its size
+void cpio_print(const uint8_t *archive, size_t size);
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_CPUS 8
+
+enum rflags_bits {
+    rflags_interrupt_enable = 1 << 9
+};
+
+enum msr_addresses {
+    msr_apic_base = 0x1b,
+    msr_pmc0 = 0xc1,
+    msr_perfevtsel0 = 0x186,
+    msr_pat = 0x277,
+    msr_fixed_ctr0 = 0x309,
+    msr_fixed_ctr_ctrl = 0x38d,
+    msr_perf_global_status = 0x38e,
+    msr_perf_global_ctrl = 0x38f,
+    msr_perf_global_ovf_ctrl = 0x390,
+    msr_efer = 0xc0000080,
+    msr_gs_base = 0xc0000101
+};
+
+// Reached through the gs base, one per cpu
+struct per_cpu {
+    struct per_cpu *self;
+    size_t cpu_id;
+    uint32_t apic_id;
+
+    // Non-zero while the running thread must not be preempted, see rcu.h
+    size_t preempt_count;
+} __attribute__ ((aligned (64)));
+
+void per_cpu_init(size_t cpu_id);
+struct per_cpu* get_per_cpu(size_t cpu_id);
+
+static inline struct per_cpu* this_cpu(void) {
+    struct per_cpu *cpu;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r"(cpu)
+                 : "i"(offsetof(struct per_cpu, self)));
+    return cpu;
+}
+
+static inline size_t this_cpu_id(void) {
+    size_t id;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r"(id)
+                 : "i"(offsetof(struct per_cpu, cpu_id)));
+    return id;
+}
+
+// Plain gs relative increments, a cpu only ever changes its own count
+static inline void preempt_disable(void) {
+    asm volatile("incq %%gs:%c0"
+                 :
+                 : "i"(offsetof(struct per_cpu, preempt_count))
+                 : "memory");
+}
+
+static inline void preempt_enable(void) {
+    asm volatile("decq %%gs:%c0"
+                 :
+                 : "i"(offsetof(struct per_cpu, preempt_count))
+                 : "memory");
+}
+
+static inline size_t preempt_count(void) {
+    size_t count;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r"(count)
+                 : "i"(offsetof(struct per_cpu, preempt_count)));
+    return count;
+}
+
+static inline uint64_t read_msr(uint32_t msr) {
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void write_msr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr"
+                 :
+                 : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))
+                 : "memory");
+}
+
+// The address of the last page fault
+static inline uint64_t read_cr2(void) {
+    uint64_t value;
+    asm volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint64_t read_tsc(void) {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Disables interrupts on the current cpu.
+ * Returns the previous rflags to be handed back to irq_restore.
+ */
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq\n"
+                 "pop %0\n"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if(flags & rflags_interrupt_enable) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+    asm volatile("cpuid"
+                 : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                 : "a"(leaf), "c"(0));
+}
+
+// Drains write combining buffers so the stores reach the device
+static inline void store_fence(void) {
+    asm volatile("sfence" ::: "memory");
+}
+
+static inline void cpu_relax(void) {
+    asm volatile("pause" ::: "memory");
+}
@@ -0,0 +1,588 @@
+#include "eh_frame.h"
+#include "paging.h"
+
+// See linker.ld
+extern const uint8_t __eh_frame_start[];
+extern const uint8_t __eh_frame_end[];
+
+// DWARF numbering of the x86_64 registers the unwinder tracks
+enum dwarf_register {
+    dwarf_rbp = 6,
+    dwarf_rsp = 7,
+    dwarf_return_address = 16
+};
+
+#define DWARF_REGISTER_COUNT 17
+#define CFA_STATE_STACK_DEPTH 4
+
+enum pointer_encoding {
+    pe_absptr = 0x00,
+    pe_uleb128 = 0x01,
+    pe_udata2 = 0x02,
+    pe_udata4 = 0x03,
+    pe_udata8 = 0x04,
+    pe_sleb128 = 0x09,
+    pe_sdata2 = 0x0a,
+    pe_sdata4 = 0x0b,
+    pe_sdata8 = 0x0c,
+    pe_format_mask = 0x0f,
+    pe_pcrel = 0x10,
+    pe_application_mask = 0x70,
+    pe_indirect = 0x80,
+    pe_omit = 0xff
+};
+
+enum cfa_opcode {
+    cfa_advance_loc = 0x40,
+    cfa_offset = 0x80,
+    cfa_restore = 0xc0,
+    cfa_primary_mask = 0xc0,
+    cfa_operand_mask = 0x3f,
+
+    cfa_nop = 0x00,
+    cfa_set_loc = 0x01,
+    cfa_advance_loc1 = 0x02,
+    cfa_advance_loc2 = 0x03,
+    cfa_advance_loc4 = 0x04,
+    cfa_offset_extended = 0x05,
+    cfa_restore_extended = 0x06,
+    cfa_undefined = 0x07,
+    cfa_same_value = 0x08,
+    cfa_register = 0x09,
+    cfa_remember_state = 0x0a,
+    cfa_restore_state = 0x0b,
+    cfa_def_cfa = 0x0c,
+    cfa_def_cfa_register = 0x0d,
+    cfa_def_cfa_offset = 0x0e,
+    cfa_def_cfa_expression = 0x0f,
+    cfa_expression = 0x10,
+    cfa_offset_extended_sf = 0x11,
+    cfa_def_cfa_sf = 0x12,
+    cfa_def_cfa_offset_sf = 0x13,
+    cfa_val_offset = 0x14,
+    cfa_val_offset_sf = 0x15,
+    cfa_val_expression = 0x16,
+    cfa_gnu_args_size = 0x2e,
+    cfa_gnu_negative_offset_extended = 0x2f
+};
+
+enum register_rule_kind {
+    rule_same_value,
+    rule_undefined,
+    // saved at cfa + offset
+    rule_offset,
+    // the value is cfa + offset
+    rule_val_offset,
+    // an expression or another register, which isn't followed
+    rule_unsupported
+};
+
+struct register_rule {
+    enum register_rule_kind kind;
+    int64_t offset;
+};
+
+struct cfa_state {
+    uint64_t cfa_register;
+    int64_t cfa_offset;
+    bool cfa_supported;
+    struct register_rule rules[DWARF_REGISTER_COUNT];
+};
+
+struct cie {
+    const uint8_t *instructions;
+    const uint8_t *end;
+    uint64_t code_alignment;
+    int64_t data_alignment;
+    uint64_t return_register;
+    uint8_t fde_encoding;
+    bool has_augmentation_data;
+};
+
+struct fde {
+    uintptr_t pc_begin;
+    uintptr_t pc_end;
+    const uint8_t *instructions;
+    const uint8_t *end;
+};
+
+// Reads past end return 0 and set failed
+struct reader {
+    const uint8_t *pos;
+    const uint8_t *end;
+    bool failed;
+};
+
+static uint64_t read_bytes(struct reader *r, size_t count) {
+    if(r->failed || (size_t) (r->end - r->pos) < count) {
+        r->failed = true;
+        return 0;
+    }
+
+    uint64_t value = 0;
+    for(size_t i=0; i<count; ++i) {
+        value |= (uint64_t) r->pos[i] << (8 * i);
+    }
+
+    r->pos += count;
+    return value;
+}
+
+static void skip_bytes(struct reader *r, uint64_t count) {
+    if(r->failed || (uint64_t) (r->end - r->pos) < count) {
+        r->failed = true;
+        return;
+    }
+
+    r->pos += count;
+}
+
+static inline uint8_t read_u8(struct reader *r) {
+    return read_bytes(r, 1);
+}
+
+static uint64_t read_uleb128(struct reader *r) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = read_u8(r);
+        if(shift < 64) {
+            value |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while((byte & 0x80) && !r->failed);
+
+    return value;
+}
+
+static int64_t read_sleb128(struct reader *r) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = read_u8(r);
+        if(shift < 64) {
+            value |= (uint64_t) (byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while((byte & 0x80) && !r->failed);
+
+    if(shift < 64 && (byte & 0x40)) {
+        value |= ~(uint64_t) 0 << shift;
+    }
+
+    return (int64_t) value;
+}
+
+// Returns 0 on success. Non-zero for encodings gcc doesn't use in the kernel.
+static int read_encoded(struct reader *r, uint8_t encoding, uintptr_t *value) {
+    uintptr_t base = (uintptr_t) r->pos;
+    uint64_t result;
+
+    if(encoding == pe_omit || (encoding & pe_indirect)) {
+        return -1;
+    }
+
+    switch(encoding & pe_format_mask) {
+        case pe_absptr:
+        case pe_udata8:
+        case pe_sdata8:
+            result = read_bytes(r, 8);
+            break;
+        case pe_uleb128:
+            result = read_uleb128(r);
+            break;
+        case pe_udata2:
+            result = read_bytes(r, 2);
+            break;
+        case pe_sdata2:
+            result = (int16_t) read_bytes(r, 2);
+            break;
+        case pe_udata4:
+            result = read_bytes(r, 4);
+            break;
+        case pe_sdata4:
+            result = (int32_t) read_bytes(r, 4);
+            break;
+        case pe_sleb128:
+            result = read_sleb128(r);
+            break;
+        default:
+            return -1;
+    }
+
+    switch(encoding & pe_application_mask) {
+        case 0:
+            break;
+        case pe_pcrel:
+            result += base;
+            break;
+        default:
+            return -1;
+    }
+
+    *value = result;
+    return r->failed ? -1 : 0;
+}
+
+/* Sets r to cover the entry at pos, positioned after its length.
+ * Returns 0 on success. Non-zero at the terminator or a malformed length.
+ */
+static int read_entry(const uint8_t *pos, struct reader *r) {
+    *r = (struct reader) { pos, __eh_frame_end, false };
+
+    uint64_t length = read_bytes(r, 4);
+
+    // 64 bit lengths are never emitted for the kernel
+    if(r->failed || length == 0 || length == 0xffffffff || length > (size_t) (r->end - r->pos)) {
+        return -1;
+    }
+
+    r->end = r->pos + length;
+    return 0;
+}
+
+static int parse_cie(const uint8_t *pos, struct cie *cie) {
+    struct reader r;
+
+    if(pos < __eh_frame_start || read_entry(pos, &r) != 0 || read_bytes(&r, 4) != 0) {
+        return -1;
+    }
+
+    uint8_t version = read_u8(&r);
+    const char *augmentation = (const char*) r.pos;
+    while(read_u8(&r) != 0 && !r.failed);
+
+    if(r.failed) {
+        return -1;
+    }
+
+    if(augmentation[0] == 'e' && augmentation[1] == 'h') {
+        read_bytes(&r, 8);
+    }
+
+    cie->code_alignment = read_uleb128(&r);
+    cie->data_alignment = read_sleb128(&r);
+    cie->return_register = version == 1 ? read_u8(&r) : read_uleb128(&r);
+    cie->fde_encoding = pe_absptr;
+    cie->has_augmentation_data = augmentation[0] == 'z';
+
+    if(cie->has_augmentation_data) {
+        uint64_t length = read_uleb128(&r);
+        if(r.failed || length > (size_t) (r.end - r.pos)) {
+            return -1;
+        }
+
+        const uint8_t *data_end = r.pos + length;
+
+        for(const char *c = augmentation + 1; *c != '\0'; ++c) {
+            if(*c == 'R') {
+                cie->fde_encoding = read_u8(&r);
+            } else if(*c == 'P') {
+                // the personality routine isn't needed, only skipped
+                uintptr_t personality;
+                if(read_encoded(&r, read_u8(&r) & ~pe_indirect, &personality) != 0) {
+                    return -1;
+                }
+            } else if(*c == 'L') {
+                read_u8(&r);
+            } else if(*c != 'S') {
+                // the length lets the rest be skipped
+                break;
+            }
+        }
+
+        r.pos = data_end;
+    } else if(augmentation[0] != '\0') {
+        return -1;
+    }
+
+    cie->instructions = r.pos;
+    cie->end = r.end;
+
+    return r.failed ? -1 : 0;
+}
+
+static int parse_fde(struct reader *r, const struct cie *cie, struct fde *fde) {
+    uintptr_t begin, range;
+
+    if(read_encoded(r, cie->fde_encoding, &begin) != 0
+        || read_encoded(r, cie->fde_encoding & pe_format_mask, &range) != 0) {
+        return -1;
+    }
+
+    if(cie->has_augmentation_data) {
+        skip_bytes(r, read_uleb128(r));
+        if(r->failed) {
+            return -1;
+        }
+    }
+
+    fde->pc_begin = begin;
+    fde->pc_end = begin + range;
+    fde->instructions = r->pos;
+    fde->end = r->end;
+
+    return 0;
+}
+
+// Returns 0 on success. Non-zero if no FDE covers pc.
+static int find_fde(uintptr_t pc, struct cie *cie, struct fde *fde) {
+    const uint8_t *parsed_cie = NULL;
+    const uint8_t *pos = __eh_frame_start;
+    struct reader r;
+
+    while(read_entry(pos, &r) == 0) {
+        const uint8_t *next = r.end;
+        const uint8_t *id_pos = r.pos;
+        uint32_t id = read_bytes(&r, 4);
+
+        // FDEs point back at their CIE, most share the one before them
+        if(id != 0 && !r.failed) {
+            const uint8_t *cie_pos = id_pos - id;
+
+            if(cie_pos != parsed_cie) {
+                parsed_cie = parse_cie(cie_pos, cie) == 0 ? cie_pos : NULL;
+            }
+
+            if(parsed_cie != NULL && parse_fde(&r, cie, fde) == 0 && pc >= fde->pc_begin && pc < fde->pc_end) {
+                return 0;
+            }
+        }
+
+        pos = next;
+    }
+
+    return -1;
+}
+
+static void set_rule(struct cfa_state *state, uint64_t reg, enum register_rule_kind kind, int64_t offset) {
+    // the vector and flag registers don't matter for finding callers
+    if(reg < DWARF_REGISTER_COUNT) {
+        state->rules[reg] = (struct register_rule) { kind, offset };
+    }
+}
+
+static void restore_rule(struct cfa_state *state, uint64_t reg, const struct cfa_state *initial) {
+    if(reg < DWARF_REGISTER_COUNT && initial != NULL) {
+        state->rules[reg] = initial->rules[reg];
+    }
+}
+
+/* Runs the instructions in [pos, end) for code starting at loc, stopping
+ * before the row for an address past pc. initial is NULL for the CIE's own
+ * instructions. Returns 0 on success. Non-zero on malformed instructions.
+ */
+static int execute_cfa_program(const uint8_t *pos, const uint8_t *end, const struct cie *cie,
+    uintptr_t loc, uintptr_t pc, struct cfa_state *state, const struct cfa_state *initial) {
+    struct reader r = { pos, end, false };
+    struct cfa_state stack[CFA_STATE_STACK_DEPTH];
+    size_t depth = 0;
+
+    while(r.pos < r.end && !r.failed) {
+        uint8_t opcode = read_u8(&r);
+        uint8_t operand = opcode & cfa_operand_mask;
+        uint64_t advance = 0;
+        uint64_t reg;
+
+        switch(opcode & cfa_primary_mask) {
+            case cfa_advance_loc:
+                advance = operand;
+                goto advance;
+            case cfa_offset:
+                set_rule(state, operand, rule_offset, read_uleb128(&r) * cie->data_alignment);
+                continue;
+            case cfa_restore:
+                restore_rule(state, operand, initial);
+                continue;
+        }
+
+        switch(opcode) {
+            case cfa_nop:
+                break;
+            case cfa_set_loc: {
+                uintptr_t new_loc;
+                if(read_encoded(&r, cie->fde_encoding, &new_loc) != 0) {
+                    return -1;
+                }
+                if(new_loc > pc) {
+                    return 0;
+                }
+                loc = new_loc;
+                break;
+            }
+            case cfa_advance_loc1:
+                advance = read_bytes(&r, 1);
+                goto advance;
+            case cfa_advance_loc2:
+                advance = read_bytes(&r, 2);
+                goto advance;
+            case cfa_advance_loc4:
+                advance = read_bytes(&r, 4);
+                goto advance;
+            case cfa_offset_extended:
+                reg = read_uleb128(&r);
+                set_rule(state, reg, rule_offset, read_uleb128(&r) * cie->data_alignment);
+                break;
+            case cfa_offset_extended_sf:
+                reg = read_uleb128(&r);
+                set_rule(state, reg, rule_offset, read_sleb128(&r) * cie->data_alignment);
+                break;
+            case cfa_gnu_negative_offset_extended:
+                reg = read_uleb128(&r);
+                set_rule(state, reg, rule_offset, -(int64_t) read_uleb128(&r) * cie->data_alignment);
+                break;
+            case cfa_val_offset:
+                reg = read_uleb128(&r);
+                set_rule(state, reg, rule_val_offset, read_uleb128(&r) * cie->data_alignment);
+                break;
+            case cfa_val_offset_sf:
+                reg = read_uleb128(&r);
+                set_rule(state, reg, rule_val_offset, read_sleb128(&r) * cie->data_alignment);
+                break;
+            case cfa_restore_extended:
+                restore_rule(state, read_uleb128(&r), initial);
+                break;
+            case cfa_undefined:
+                set_rule(state, read_uleb128(&r), rule_undefined, 0);
+                break;
+            case cfa_same_value:
+                set_rule(state, read_uleb128(&r), rule_same_value, 0);
+                break;
+            case cfa_register:
+                set_rule(state, read_uleb128(&r), rule_unsupported, 0);
+                read_uleb128(&r);
+                break;
+            case cfa_remember_state:
+                if(depth == CFA_STATE_STACK_DEPTH) {
+                    return -1;
+                }
+                stack[depth++] = *state;
+                break;
+            case cfa_restore_state:
+                if(depth == 0) {
+                    return -1;
+                }
+                // gcc relies on the cfa rule coming back with the others after an epilogue
+                *state = stack[--depth];
+                break;
+            case cfa_def_cfa:
+                state->cfa_register = read_uleb128(&r);
+                state->cfa_offset = read_uleb128(&r);
+                state->cfa_supported = true;
+                break;
+            case cfa_def_cfa_sf:
+                state->cfa_register = read_uleb128(&r);
+                state->cfa_offset = read_sleb128(&r) * cie->data_alignment;
+                state->cfa_supported = true;
+                break;
+            case cfa_def_cfa_register:
+                state->cfa_register = read_uleb128(&r);
+                break;
+            case cfa_def_cfa_offset:
+                state->cfa_offset = read_uleb128(&r);
+                break;
+            case cfa_def_cfa_offset_sf:
+                state->cfa_offset = read_sleb128(&r) * cie->data_alignment;
+                break;
+            case cfa_def_cfa_expression:
+                state->cfa_supported = false;
+                skip_bytes(&r, read_uleb128(&r));
+                break;
+            case cfa_expression:
+            case cfa_val_expression:
+                set_rule(state, read_uleb128(&r), rule_unsupported, 0);
+                skip_bytes(&r, read_uleb128(&r));
+                break;
+            case cfa_gnu_args_size:
+                read_uleb128(&r);
+                break;
+            default:
+                return -1;
+        }
+        continue;
+
+    advance:
+        if(loc + advance * cie->code_alignment > pc) {
+            return 0;
+        }
+        loc += advance * cie->code_alignment;
+    }
+
+    return r.failed ? -1 : 0;
+}
+
+int unwind_read_stack(uintptr_t addr, uintptr_t *value) {
+    // aligned slots never straddle a page
+    if(addr % sizeof(uintptr_t) != 0 || !is_mapped(addr)) {
+        return -1;
+    }
+
+    *value = *(const uintptr_t*) addr;
+    return 0;
+}
+
+// Returns 0 on success. Non-zero if the saved value can't be read.
+static int apply_rule(const struct register_rule *rule, uintptr_t cfa, uintptr_t *value) {
+    switch(rule->kind) {
+        case rule_same_value:
+            return 0;
+        case rule_offset:
+            return unwind_read_stack(cfa + rule->offset, value);
+        case rule_val_offset:
+            *value = cfa + rule->offset;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+int eh_frame_unwind(struct unwind_registers *regs, bool rip_is_return_address) {
+    // a call at the very end of a function returns past it
+    uintptr_t pc = rip_is_return_address ? regs->rip - 1 : regs->rip;
+    struct cie cie;
+    struct fde fde;
+
+    if(find_fde(pc, &cie, &fde) != 0 || cie.return_register != dwarf_return_address) {
+        return -1;
+    }
+
+    struct cfa_state initial = { .cfa_supported = false };
+    if(execute_cfa_program(cie.instructions, cie.end, &cie, fde.pc_begin, UINTPTR_MAX, &initial, NULL) != 0) {
+        return -1;
+    }
+
+    struct cfa_state state = initial;
+    if(execute_cfa_program(fde.instructions, fde.end, &cie, fde.pc_begin, pc, &state, &initial) != 0) {
+        return -1;
+    }
+
+    if(!state.cfa_supported) {
+        return -1;
+    }
+
+    uintptr_t cfa;
+    if(state.cfa_register == dwarf_rsp) {
+        cfa = regs->rsp + state.cfa_offset;
+    } else if(state.cfa_register == dwarf_rbp) {
+        cfa = regs->rbp + state.cfa_offset;
+    } else {
+        return -1;
+    }
+
+    // an undefined return address marks the outermost frame
+    struct register_rule *return_rule = &state.rules[dwarf_return_address];
+    uintptr_t rip;
+    uintptr_t rbp = regs->rbp;
+
+    if(return_rule->kind == rule_same_value || apply_rule(return_rule, cfa, &rip) != 0
+        || apply_rule(&state.rules[dwarf_rbp], cfa, &rbp) != 0) {
+        return -1;
+    }
+
+    *regs = (struct unwind_registers) { rip, cfa, rbp };
+    return 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Unwinding with the call frame information gcc emits into .eh_frame for
+ * every function. Unlike the rbp chain it is right in prologues, epilogues
+ * and code built without frame pointers. Only what gcc uses for kernel code
+ * is understood: a canonical frame address of rsp or rbp plus an offset,
+ * and registers saved at offsets from it. Assembly without .cfi directives
+ * has no frame information.
+ *
+ * Lookups scan the section, they don't allocate or take locks.
+ */
+
+// The registers needed to find a caller
+struct unwind_registers {
+    uintptr_t rip;
+    uintptr_t rsp;
+    uintptr_t rbp;
+};
+
+/* Replaces regs with the caller's registers. rip is a return address in
+ * every frame but one interrupted by a fault, which is at the faulting
+ * instruction. Returns 0 on success, regs are left alone on failure.
+ * Non-zero if there is no frame information for rip, it can't be followed,
+ * or it is the outermost frame.
+ */
+int eh_frame_unwind(struct unwind_registers *regs, bool rip_is_return_address);
+
+/* Reads the 8 byte stack slot at addr.
+ * Returns 0 on success. Non-zero if addr is misaligned or not mapped.
+ */
+int unwind_read_stack(uintptr_t addr, uintptr_t *value);
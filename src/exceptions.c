@@ -1,4 +1,9 @@
 #include "exceptions.h"
+#include "terminal.h"
+#include "klog.h"
+#include "symbols.h"
+#include "backtrace.h"
+#include "cpu.h"
 
 struct exception_info {
     intptr_t instruction_ptr;
@@ -10,12 +15,8 @@ struct exception_info {
 
 struct exception_info_with_error {
     uintptr_t error_code;
-    intptr_t instruction_ptr;
-    intptr_t code_segement;
-    uintptr_t flags;
-    intptr_t stack_ptr;
-    intptr_t stack_segement;
-} __attribute__ ((packed));
+    struct exception_info info;
+};
 
 /*
 Divide-by-zero Error	0 (0x0)	Fault	#DE	No
@@ -70,152 +71,28 @@ enum exception_id {
 };
 
 const char* exception_id_strings[] = {
-    "divide_by_zero",
-    "debug",
-    "--pic--",
-    "breakpont",
-    "overflow",
-    "bound_range_exceeded",
-    "invalid_opcode",
-    "device_not_available",
-    "double_fault",
-    "coprocessor_segement_overrun",
-    "invalid_tss",
-    "segement_not_present",
-    "stack_segement_fault",
-    "general_protection_fault",
-    "page_fault",
-    "x87_fpu_exception",
-    "alignment_check",
-    "machine_check",
-    "simd_fp",
-    "vx"
+    [ex_divide_by_zero] = "divide_by_zero",
+    [ex_debug] = "debug",
+    [ex_breakpont] = "breakpont",
+    [ex_overflow] = "overflow",
+    [ex_bound_range_exceeded] = "bound_range_exceeded",
+    [ex_invalid_opcode] = "invalid_opcode",
+    [ex_device_not_available] = "device_not_available",
+    [ex_double_fault] = "double_fault",
+    [ex_coprocessor_segement_overrun] = "coprocessor_segement_overrun",
+    [ex_invalid_tss] = "invalid_tss",
+    [ex_segement_not_present] = "segement_not_present",
+    [ex_stack_segement_fault] = "stack_segement_fault",
+    [ex_general_protection_fault] = "general_protection_fault",
+    [ex_page_fault] = "page_fault",
+    [ex_x87_fpu_exception] = "x87_fpu_exception",
+    [ex_alignment_check] = "alignment_check",
+    [ex_machine_check] = "machine_check",
+    [ex_simd_fp] = "simd_fp",
+    [ex_vx] = "vx",
+    [ex_security] = "security"
 };
 
-static int divide_by_zero_handler(struct exception_info* info){
-    asm volatile("mov %0, %%eax"
-                 : 
-                 : ""(ex_divide_by_zero)
-                 : "%eax");
-
-    terminal_printf(exception_id_strings[ex_divide_by_zero]);
-    terminal_printf("iptr: %#zX \t code_seg: %#zX \t flags: %#zX\n", info->instruction_ptr, info->code_segement, info->flags);
-    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX\n", info->stack_ptr, info->stack_segement);
-
-    return 0;
-    asm volatile("hlt");
-}
-
-static int debug_handler(struct exception_info* info){
-    asm volatile("mov %0, %%eax"
-                 : 
-                 : ""(ex_debug)
-                 : "%eax");
-
-    terminal_printf(exception_id_strings[ex_debug]);
-    terminal_printf("iptr: %#zX \t code_seg: %#zX \t flags: %#zX\n", info->instruction_ptr, info->code_segement, info->flags);
-    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX\n", info->stack_ptr, info->stack_segement);
- asm volatile("hlt");
-    return 0;
-}
-
-static int breakpont_handler(struct exception_info* info){
-    asm volatile("mov %0, %%eax"
-                 : 
-                 : ""(ex_breakpont)
-                 : "%eax");
-
-    terminal_printf(exception_id_strings[ex_breakpont]);
-    terminal_printf("iptr: %#zX \t code_seg: %#zX \t flags: %#zX\n", info->instruction_ptr, info->code_segement, info->flags);
-    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX\n", info->stack_ptr, info->stack_segement);
- asm volatile("hlt");
-    return 0;
-}
-
-static void overflow_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void bound_range_exceeded_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void invalid_opcode_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void device_not_available_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void double_fault_handler(struct exception_info* info){
-    asm volatile("mov %0, %%eax"
-                 : 
-                 : ""(ex_double_fault)
-                 : "%eax");
-
-    terminal_printf(exception_id_strings[ex_double_fault]);
-    terminal_printf("iptr: %#zX \t code_seg: %#zX \t flags: %#zX\n", info->instruction_ptr, info->code_segement, info->flags);
-    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX\n", info->stack_ptr, info->stack_segement);
-
-    asm volatile("hlt");
-}
-
-static void coprocessor_segement_overrun_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void invalid_tss_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void segement_not_present_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void stack_segement_fault_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void general_protection_fault_handler(struct exception_info* info){
-    asm volatile("mov %0, %%eax\nhlt"
-                 : 
-                 : ""(ex_general_protection_fault)
-                 : "%eax");
-}
-
 enum page_fault_error_code {
     page_fault_present = 1,
     page_fault_write = 1 << 1,
@@ -224,88 +101,112 @@ enum page_fault_error_code {
     page_fault_instruction_fetch = 1 << 4
 };
 
-static int page_fault_handler(struct exception_info_with_error* info){
-    asm volatile("mov %0, %%eax\n"
-                 : 
-                 : ""(ex_page_fault)
-                 : "%eax");
-    
-    terminal_printf(exception_id_strings[ex_page_fault]);
+__attribute__ ((noreturn)) static void halt_forever(void) {
+    for(;;) {
+        asm volatile("cli\nhlt");
+    }
+}
+
+/* Prints the exception, the interrupted registers and a backtrace of the
+ * interrupted code. The shims hand over the interrupted rbp untouched.
+ * error_code is NULL for exceptions without one.
+ */
+static void exception_report(enum exception_id id, struct exception_info *info, const uintptr_t *error_code, uintptr_t rbp) {
+    // the fault may have hit with this cpu holding the terminal lock, the
+    // report goes around it and leaves the queued log if the lock was taken
+    bool locked = terminal_panic_begin();
+    if(locked) {
+        // whatever was logged up to the fault comes first
+        klog_flush();
+    }
+
+    terminal_printf("Exception: %s\n", exception_id_strings[id]);
     terminal_printf("iptr: %#zX \t code_seg: %#zX \t flags: %#zX\n", info->instruction_ptr, info->code_segement, info->flags);
-    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX\n", info->stack_ptr, info->stack_segement);
-    terminal_printf("Error code: %#zX\n", info->error_code);
-
-    asm volatile("hlt");
-    return 1;
-}
-
-static void x87_fpu_exception_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void alignment_check_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void machine_check_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void simd_fp_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
-}
-
-static void vx_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
+    terminal_printf("Stackptr: %#zX \t Stackseg: %#zX \t rbp: %#zX\n", info->stack_ptr, info->stack_segement, rbp);
+
+    if(error_code != NULL) {
+        terminal_printf("Error code: %#zX\n", *error_code);
+    }
+
+    if(id == ex_page_fault) {
+        terminal_printf("Address: %#zX \t %s %s%s\n", read_cr2(),
+            *error_code & page_fault_present ? "protection" : "not present",
+            *error_code & page_fault_instruction_fetch ? "fetch" : (*error_code & page_fault_write ? "write" : "read"),
+            *error_code & page_fault_reserved_write ? " reserved bit" : "");
+    }
+
+    terminal_printf("In: ");
+    symbols_print_address(info->instruction_ptr);
+
+    struct unwind_registers regs = { info->instruction_ptr, info->stack_ptr, rbp };
+    backtrace_print_from(&regs);
+
+    terminal_flush();
+    terminal_panic_end(locked);
+}
+
+#define FATAL_EXCEPTION(name) \
+    static int name##_handler(struct exception_info *info, uintptr_t rbp) { \
+        exception_report(ex_##name, info, NULL, rbp); \
+        halt_forever(); \
+    }
+
+// The shim pops the error code if the handler returns 1, these never return though
+#define FATAL_EXCEPTION_WITH_ERROR(name) \
+    static int name##_handler(struct exception_info_with_error *info, uintptr_t rbp) { \
+        exception_report(ex_##name, &info->info, &info->error_code, rbp); \
+        halt_forever(); \
+    }
+
+FATAL_EXCEPTION(divide_by_zero)
+FATAL_EXCEPTION(overflow)
+FATAL_EXCEPTION(bound_range_exceeded)
+FATAL_EXCEPTION(invalid_opcode)
+FATAL_EXCEPTION(device_not_available)
+FATAL_EXCEPTION_WITH_ERROR(double_fault)
+FATAL_EXCEPTION(coprocessor_segement_overrun)
+FATAL_EXCEPTION_WITH_ERROR(invalid_tss)
+FATAL_EXCEPTION_WITH_ERROR(segement_not_present)
+FATAL_EXCEPTION_WITH_ERROR(stack_segement_fault)
+FATAL_EXCEPTION_WITH_ERROR(general_protection_fault)
+FATAL_EXCEPTION_WITH_ERROR(page_fault)
+FATAL_EXCEPTION(x87_fpu_exception)
+FATAL_EXCEPTION_WITH_ERROR(alignment_check)
+FATAL_EXCEPTION(machine_check)
+FATAL_EXCEPTION(simd_fp)
+FATAL_EXCEPTION(vx)
+FATAL_EXCEPTION_WITH_ERROR(security)
+
+// Traps, the report doubles as a way to dump a backtrace with int3
+static int debug_handler(struct exception_info *info, uintptr_t rbp) {
+    exception_report(ex_debug, info, NULL, rbp);
+    return 0;
 }
 
-static void security_handler(struct exception_info* info){
-    asm volatile(""
-                 :
-                 :
-                 :);
-                  asm volatile("hlt");
+static int breakpont_handler(struct exception_info *info, uintptr_t rbp) {
+    exception_report(ex_breakpont, info, NULL, rbp);
+    return 0;
 }
 
 void init_exception_handlers(void) {
-    add_interrupt_handler(ex_divide_by_zero, divide_by_zero_handler);
-    add_interrupt_handler(ex_debug, debug_handler);
-    add_interrupt_handler(ex_breakpont, breakpont_handler);
-    add_interrupt_handler(ex_overflow, overflow_handler);
-    add_interrupt_handler(ex_bound_range_exceeded, bound_range_exceeded_handler);
-    add_interrupt_handler(ex_invalid_opcode, invalid_opcode_handler);
-    add_interrupt_handler(ex_device_not_available, device_not_available_handler);
-    add_interrupt_handler(ex_double_fault, double_fault_handler);
-    add_interrupt_handler(ex_coprocessor_segement_overrun, coprocessor_segement_overrun_handler);
-    add_interrupt_handler(ex_invalid_tss, invalid_tss_handler);
-    add_interrupt_handler(ex_segement_not_present, segement_not_present_handler);
-    add_interrupt_handler(ex_stack_segement_fault, stack_segement_fault_handler);
-    add_interrupt_handler(ex_general_protection_fault, general_protection_fault_handler);
-    add_interrupt_handler(ex_page_fault, page_fault_handler);
-    add_interrupt_handler(ex_x87_fpu_exception, x87_fpu_exception_handler);
-    add_interrupt_handler(ex_alignment_check, alignment_check_handler);
-    add_interrupt_handler(ex_machine_check, machine_check_handler);
-    add_interrupt_handler(ex_simd_fp, simd_fp_handler);
-    add_interrupt_handler(ex_vx, vx_handler);
-    add_interrupt_handler(ex_security, security_handler);
+    add_interrupt_handler(ex_divide_by_zero, (intptr_t) divide_by_zero_handler);
+    add_interrupt_handler(ex_debug, (intptr_t) debug_handler);
+    add_interrupt_handler(ex_breakpont, (intptr_t) breakpont_handler);
+    add_interrupt_handler(ex_overflow, (intptr_t) overflow_handler);
+    add_interrupt_handler(ex_bound_range_exceeded, (intptr_t) bound_range_exceeded_handler);
+    add_interrupt_handler(ex_invalid_opcode, (intptr_t) invalid_opcode_handler);
+    add_interrupt_handler(ex_device_not_available, (intptr_t) device_not_available_handler);
+    add_interrupt_handler(ex_double_fault, (intptr_t) double_fault_handler);
+    add_interrupt_handler(ex_coprocessor_segement_overrun, (intptr_t) coprocessor_segement_overrun_handler);
+    add_interrupt_handler(ex_invalid_tss, (intptr_t) invalid_tss_handler);
+    add_interrupt_handler(ex_segement_not_present, (intptr_t) segement_not_present_handler);
+    add_interrupt_handler(ex_stack_segement_fault, (intptr_t) stack_segement_fault_handler);
+    add_interrupt_handler(ex_general_protection_fault, (intptr_t) general_protection_fault_handler);
+    add_interrupt_handler(ex_page_fault, (intptr_t) page_fault_handler);
+    add_interrupt_handler(ex_x87_fpu_exception, (intptr_t) x87_fpu_exception_handler);
+    add_interrupt_handler(ex_alignment_check, (intptr_t) alignment_check_handler);
+    add_interrupt_handler(ex_machine_check, (intptr_t) machine_check_handler);
+    add_interrupt_handler(ex_simd_fp, (intptr_t) simd_fp_handler);
+    add_interrupt_handler(ex_vx, (intptr_t) vx_handler);
+    add_interrupt_handler(ex_security, (intptr_t) security_handler);
 }
\ No newline at end of file
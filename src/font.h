@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 8
+
+// Printable ASCII is filled in, everything else is blank
+#define FONT_GLYPH_COUNT 128
+
+extern const uint8_t font_glyphs[FONT_GLYPH_COUNT][FONT_HEIGHT];
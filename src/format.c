@@ -0,0 +1,741 @@
+#include "format.h"
+#include <stdbool.h>
+#include "util.h"
+#include "cpu.h"
+#include "assert.h"
+#include "terminal.h"
+#include "benchmark.h"
+#include "ktest.h"
+
+enum types {
+    INT,
+    S_CHAR,
+    CHAR,
+    SHORT_INT,
+    LONG_INT,
+    LONG_LONG_INT,
+    INTMAX_T,
+    SIZE_T,
+    PTRDIFF_T,
+    LONG_DOUBLE,
+    WINT_T,
+    WCHAR_T,
+    VOID,
+    DOUBLE,
+    NO_FORMAT
+};
+
+enum printf_flags {
+    NO_FLAGS = 0x0,
+    LEFT_JUSTIFY = 0x01,
+    ALWAYS_SHOW_SIGN = 0x02,
+    ALWAYS_SHOW_SPACE = 0x04,
+    ALWAYS_SHOW_0x_OR_DECIMAL_POINT = 0x08,
+    LEFT_PAD_WITH_ZEROS = 0x10
+};
+
+enum width_format {
+    NONE = -1, FORMAT_ARG_SPECIFIED = -2
+};
+
+struct printf_format {
+    enum printf_flags flags;
+    int width;
+    int precision;
+
+    enum types type;
+    int is_unsigned;
+    int is_pointer;
+    char specifier;
+};
+
+static inline void emit_char(struct format_buffer *out, char c) {
+    if(out->used == out->size && out->flush != NULL) {
+        out->flush(out);
+    }
+
+    if(out->used < out->size) {
+        out->data[out->used++] = c;
+    }
+
+    ++out->total;
+}
+
+// Copies as much as fits at once, flushing between chunks
+static void emit_text(struct format_buffer *out, const char *text, size_t length) {
+    out->total += length;
+
+    while(length > 0) {
+        if(out->used == out->size) {
+            if(out->flush == NULL) {
+                return;
+            }
+            out->flush(out);
+        }
+
+        size_t space = out->size - out->used;
+        size_t chunk = length < space ? length : space;
+
+        memcpy(&out->data[out->used], text, chunk);
+        out->used += chunk;
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+/* Returns:
+ * -1 for error
+ * 0 for nothing found
+ * Returns integer offset of the next character to be read
+ */
+static int get_flags(struct printf_format* format, const char* str) {
+    int i = 0;
+    format->flags = NO_FLAGS;
+
+    while(1) {
+        switch(str[i]) {
+            case '-':
+                format->flags |= LEFT_JUSTIFY;
+                break;
+            case '+':
+                format->flags |= ALWAYS_SHOW_SIGN;
+                break;
+            case ' ':
+                format->flags |= ALWAYS_SHOW_SPACE;
+                break;
+            case '#':
+                format->flags |= ALWAYS_SHOW_0x_OR_DECIMAL_POINT;
+                break;
+            case '0':
+                format->flags |= LEFT_PAD_WITH_ZEROS;
+                break;
+            default:
+                return i;
+        }
+
+        ++i;
+    }
+}
+
+static inline int read_decimal(const char* str, int* pos) {
+    int i = *pos;
+    int d = 0;
+
+    while(str[i] >= '0' && str[i] <= '9') {
+        d = d * 10 + (str[i] - '0');
+        ++i;
+    }
+
+    *pos = i;
+    return d;
+}
+
+static int get_width(struct printf_format* format, const char* str) {
+    if(str[0] == '*') {
+        format->width = FORMAT_ARG_SPECIFIED;
+        return 1;
+    }
+
+    int i=0;
+    format->width = read_decimal(str, &i);
+
+    return i;
+}
+
+static int get_precision(struct printf_format* format, const char* str) {
+    if(str[0] != '.') {
+        format->precision = NONE;
+        return 0;
+    }
+
+    if(str[1] == '*') {
+        format->precision = FORMAT_ARG_SPECIFIED;
+        return 2;
+    }
+
+    // a lone '.' means a precision of 0
+    int i=1;
+    format->precision = read_decimal(str, &i);
+
+    return i;
+}
+
+static int get_length_and_specifier(struct printf_format* format, const char* str) {
+    int i = 0;
+
+    switch(str[i]) {
+        case 'h':
+            ++i;
+            if(str[i] == 'h') {
+                format->type = S_CHAR;
+                ++i;
+            } else {
+                format->type = SHORT_INT;
+            }
+            break;
+        case 'l':
+            ++i;
+            if(str[i] == 'l') {
+                format->type = LONG_LONG_INT;
+                ++i;
+            } else {
+                format->type = LONG_INT;
+            }
+            break;
+        case 'j':
+            ++i;
+            format->type = INTMAX_T;
+            break;
+        case 'z':
+            ++i;
+            format->type = SIZE_T;
+            break;
+        case 't':
+            ++i;
+            format->type = PTRDIFF_T;
+            break;
+        case 'L':
+            ++i;
+            format->type = LONG_DOUBLE;
+            break;
+        default:
+            format->type = INT;
+            break;
+    }
+
+    format->is_unsigned = 0;
+    format->is_pointer = 0;
+    switch(str[i]) {
+        case 'd':
+        case 'i':
+            assert(format->type != LONG_DOUBLE);
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            format->is_unsigned = 1;
+            break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            assert(format->type == LONG_DOUBLE || format->type == INT);
+            if(format->type == INT) {
+                format->type = DOUBLE;
+            }
+            break;
+        case 'c':
+            assert(format->type == LONG_INT || format->type == INT);
+            if(format->type == LONG_INT) {
+                format->type = WINT_T;
+            } else {
+                format->type = CHAR;
+            }
+            break;
+        case 's':
+            format->is_pointer = 1;
+            assert(format->type == LONG_INT || format->type == INT);
+            if(format->type == INT) {
+                format->type = CHAR;
+            } else {
+                format->type = WCHAR_T;
+            }
+            break;
+        case 'p':
+            format->is_pointer = 1;
+            assert(format->type == INT);
+            format->type = VOID;
+            break;
+        default:
+            assert(0!=0);
+    }
+
+    format->specifier = str[i];
+
+    return i;
+}
+
+// Returns the offset of the conversion specifier
+static int get_format(struct printf_format* format, const char* str) {
+    int i = 0;
+    i += get_flags(format, &str[i]);
+
+    i += get_width(format, &str[i]);
+    i += get_precision(format, &str[i]);
+    i += get_length_and_specifier(format, &str[i]);
+
+    return i;
+}
+
+static const char decimal_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char lower_hex_digits[] = "0123456789abcdef";
+static const char upper_hex_digits[] = "0123456789ABCDEF";
+
+// Digits are written backwards from end, returns where they start
+static char* decimal_digits(char *end, uint64_t num) {
+    while(num >= 100) {
+        size_t pair = (num % 100) * 2;
+        num /= 100;
+        *--end = decimal_digit_pairs[pair + 1];
+        *--end = decimal_digit_pairs[pair];
+    }
+
+    if(num >= 10) {
+        *--end = decimal_digit_pairs[num * 2 + 1];
+        *--end = decimal_digit_pairs[num * 2];
+    } else {
+        *--end = '0' + num;
+    }
+
+    return end;
+}
+
+static char* hex_digits(char *end, uint64_t num, const char *digits) {
+    do {
+        *--end = digits[num & 0xf];
+        num >>= 4;
+    } while(num != 0);
+
+    return end;
+}
+
+static char* octal_digits(char *end, uint64_t num) {
+    do {
+        *--end = '0' + (num & 7);
+        num >>= 3;
+    } while(num != 0);
+
+    return end;
+}
+
+static void emit_repeat(struct format_buffer *out, char c, int count) {
+    static const char spaces[] = "                ";
+    static const char zeros[] = "0000000000000000";
+    const char *run = (c == '0') ? zeros : spaces;
+
+    while(count > 0) {
+        int chunk = count < 16 ? count : 16;
+        emit_text(out, run, chunk);
+        count -= chunk;
+    }
+}
+
+// Pads text out to the field width, text is already complete
+static void emit_padded(struct format_buffer *out, struct printf_format *format, const char *text, int length) {
+    int padding = format->width - length;
+
+    if(!(format->flags & LEFT_JUSTIFY)) {
+        emit_repeat(out, ' ', padding);
+    }
+
+    emit_text(out, text, length);
+
+    if(format->flags & LEFT_JUSTIFY) {
+        emit_repeat(out, ' ', padding);
+    }
+}
+
+static void format_integer(struct format_buffer *out, struct printf_format *format, uint64_t num) {
+    char buf[24];
+    char *end = &buf[sizeof(buf)];
+    char *digits;
+
+    char prefix[2];
+    int prefix_length = 0;
+
+    switch(format->specifier) {
+        case 'd':
+        case 'i':
+            if((int64_t) num < 0) {
+                prefix[prefix_length++] = '-';
+                num = -num;
+            } else if(format->flags & ALWAYS_SHOW_SIGN) {
+                prefix[prefix_length++] = '+';
+            } else if(format->flags & ALWAYS_SHOW_SPACE) {
+                prefix[prefix_length++] = ' ';
+            }
+            digits = decimal_digits(end, num);
+            break;
+        case 'o':
+            digits = octal_digits(end, num);
+            if((format->flags & ALWAYS_SHOW_0x_OR_DECIMAL_POINT) && num != 0) {
+                *--digits = '0';
+            }
+            break;
+        case 'x':
+        case 'p':
+            digits = hex_digits(end, num, lower_hex_digits);
+            break;
+        case 'X':
+            digits = hex_digits(end, num, upper_hex_digits);
+            break;
+        default:
+            digits = decimal_digits(end, num);
+            break;
+    }
+
+    int digit_count = end - digits;
+
+    // an explicit precision of 0 prints nothing for 0
+    if(format->precision == 0 && num == 0 && !(format->specifier == 'o' && (format->flags & ALWAYS_SHOW_0x_OR_DECIMAL_POINT))) {
+        digit_count = 0;
+    }
+
+    bool is_hex = format->specifier == 'x' || format->specifier == 'X' || format->specifier == 'p';
+    if(is_hex && (format->flags & ALWAYS_SHOW_0x_OR_DECIMAL_POINT) && (num != 0 || format->specifier == 'p')) {
+        prefix[prefix_length++] = '0';
+        prefix[prefix_length++] = format->specifier == 'X' ? 'X' : 'x';
+    }
+
+    int zeros = 0;
+    if(format->precision > digit_count) {
+        zeros = format->precision - digit_count;
+    } else if(format->precision == NONE && (format->flags & LEFT_PAD_WITH_ZEROS) && !(format->flags & LEFT_JUSTIFY)) {
+        int fill = format->width - prefix_length - digit_count;
+        zeros = fill > 0 ? fill : 0;
+    }
+
+    int padding = format->width - prefix_length - zeros - digit_count;
+
+    if(!(format->flags & LEFT_JUSTIFY)) {
+        emit_repeat(out, ' ', padding);
+    }
+
+    emit_text(out, prefix, prefix_length);
+    emit_repeat(out, '0', zeros);
+    emit_text(out, end - digit_count, digit_count);
+
+    if(format->flags & LEFT_JUSTIFY) {
+        emit_repeat(out, ' ', padding);
+    }
+}
+
+// The precision limits how much of the string is read
+static void format_string(struct format_buffer *out, struct printf_format *format, const char *data) {
+    int length = 0;
+    while(data[length] != 0 && (format->precision == NONE || length < format->precision)) {
+        ++length;
+    }
+
+    emit_padded(out, format, data, length);
+}
+
+// Arguments come from a va_list, or from words stored earlier by format_capture
+struct format_arguments {
+    va_list *list;
+    const uint64_t *array;
+    size_t count;
+    size_t next;
+};
+
+static int next_int_argument(struct format_arguments *args) {
+    if(args->list != NULL) {
+        return va_arg(*args->list, int);
+    }
+
+    return args->next < args->count ? (int) args->array[args->next++] : 0;
+}
+
+// Reads the argument as the type the format names and widens it to a word
+static uint64_t next_argument(struct format_arguments *args, struct printf_format *format) {
+    if(args->list == NULL) {
+        return args->next < args->count ? args->array[args->next++] : 0;
+    }
+
+    va_list *list = args->list;
+
+    switch(format->type) {
+        case NO_FORMAT:
+            return 0;
+        case INT:
+            if(format->is_unsigned) {
+                return va_arg(*list, unsigned int);
+            }
+            return (int64_t) va_arg(*list, int);
+        case S_CHAR:
+            if(format->is_unsigned) {
+                return (unsigned char) va_arg(*list, int);
+            }
+            return (int64_t) (signed char) va_arg(*list, int);
+        case CHAR:
+            if(format->is_pointer) {
+                return (uintptr_t) va_arg(*list, const char*);
+            }
+            return (char) va_arg(*list, int);
+        case SHORT_INT:
+            if(format->is_unsigned) {
+                return (unsigned short int) va_arg(*list, int);
+            }
+            return (int64_t) (short int) va_arg(*list, int);
+        case WINT_T:
+            return va_arg(*list, unsigned int);
+        case LONG_INT:
+            return va_arg(*list, long int);
+        case LONG_LONG_INT:
+            return va_arg(*list, long long int);
+        case INTMAX_T:
+            return va_arg(*list, intmax_t);
+        case SIZE_T:
+            return va_arg(*list, size_t);
+        case PTRDIFF_T:
+            return va_arg(*list, ptrdiff_t);
+        case VOID:
+            return (uintptr_t) va_arg(*list, void*);
+        case WCHAR_T:
+            return (uintptr_t) va_arg(*list, wchar_t*);
+        case LONG_DOUBLE:
+            (void) va_arg(*list, long double);
+            return 0;
+        case DOUBLE:
+            (void) va_arg(*list, double);
+            return 0;
+        default:
+            assert(0!=0);
+            return 0;
+    }
+}
+
+static void format_argument(struct format_buffer *out, struct printf_format *format, uint64_t value) {
+    switch(format->type) {
+        case NO_FORMAT:
+        case WINT_T:
+        case WCHAR_T:
+        case LONG_DOUBLE:
+        case DOUBLE:
+            break;
+        case CHAR:
+            if(format->is_pointer) {
+                const char *text = (const char*) (uintptr_t) value;
+                format_string(out, format, text != NULL ? text : "(null)");
+            } else {
+                char c = value;
+                emit_padded(out, format, &c, 1);
+            }
+            break;
+        case VOID:
+            format->flags |= ALWAYS_SHOW_0x_OR_DECIMAL_POINT;
+            format_integer(out, format, value);
+            break;
+        default:
+            format_integer(out, format, value);
+            break;
+    }
+}
+
+static size_t format_with(struct format_buffer *out, const char *fmt, struct format_arguments *args) {
+    size_t start = out->total;
+
+    const char *p = fmt;
+    while(*p != 0) {
+        // literal runs are copied in one go
+        const char *run = p;
+        while(*p != 0 && *p != '%' && *p != '\\') {
+            ++p;
+        }
+        emit_text(out, run, p - run);
+
+        if(*p == 0) {
+            break;
+        }
+
+        if(*p == '\\') {
+            // the next character is taken as it is
+            ++p;
+            if(*p != 0) {
+                emit_char(out, *p++);
+            }
+            continue;
+        }
+
+        ++p;
+        if(*p == '%') {
+            emit_char(out, *p++);
+            continue;
+        }
+
+        struct printf_format format;
+        p += get_format(&format, p) + 1;
+
+        if(format.width == FORMAT_ARG_SPECIFIED) {
+            format.width = next_int_argument(args);
+        }
+
+        if(format.precision == FORMAT_ARG_SPECIFIED) {
+            format.precision = next_int_argument(args);
+        }
+
+        format_argument(out, &format, next_argument(args, &format));
+    }
+
+    return out->total - start;
+}
+
+size_t kvformat(struct format_buffer *out, const char *fmt, va_list args) {
+    va_list ap;
+    va_copy(ap, args);
+
+    struct format_arguments arguments = { .list = &ap };
+    size_t length = format_with(out, fmt, &arguments);
+
+    va_end(ap);
+
+    return length;
+}
+
+size_t kformat_captured(struct format_buffer *out, const char *fmt, const uint64_t *args, size_t count) {
+    struct format_arguments arguments = {
+        .list = NULL,
+        .array = args,
+        .count = count,
+        .next = 0
+    };
+
+    return format_with(out, fmt, &arguments);
+}
+
+size_t format_capture(const char *fmt, va_list args, uint64_t *words, size_t max) {
+    va_list ap;
+    va_copy(ap, args);
+
+    struct format_arguments arguments = { .list = &ap };
+    size_t count = 0;
+
+    const char *p = fmt;
+    while(*p != 0) {
+        if(*p == '\\') {
+            p += p[1] != 0 ? 2 : 1;
+            continue;
+        }
+
+        if(*p++ != '%') {
+            continue;
+        }
+
+        if(*p == '%') {
+            ++p;
+            continue;
+        }
+
+        struct printf_format format;
+        p += get_format(&format, p) + 1;
+
+        if(format.width == FORMAT_ARG_SPECIFIED) {
+            uint64_t width = next_int_argument(&arguments);
+            if(count < max) {
+                words[count] = width;
+            }
+            ++count;
+        }
+
+        if(format.precision == FORMAT_ARG_SPECIFIED) {
+            uint64_t precision = next_int_argument(&arguments);
+            if(count < max) {
+                words[count] = precision;
+            }
+            ++count;
+        }
+
+        uint64_t value = next_argument(&arguments, &format);
+        if(count < max) {
+            words[count] = value;
+        }
+        ++count;
+    }
+
+    va_end(ap);
+
+    return count;
+}
+
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args) {
+    struct format_buffer out = {
+        .data = buf,
+        .size = size ? size - 1 : 0,
+        .used = 0,
+        .total = 0,
+        .flush = NULL,
+        .context = NULL
+    };
+
+    kvformat(&out, fmt, args);
+
+    if(size != 0) {
+        buf[out.used] = 0;
+    }
+
+    return out.total;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+
+    return length;
+}
+
+// One log line formatted into a buffer
+static void ksnprintf_benchmark(void *context) {
+    (void) context;
+    char data[256];
+
+    ksnprintf(data, sizeof(data), "cpu %zu frame %#zx addr %#zx name %s\n", (size_t) 3, (size_t) 0x1f3, (size_t) 0x1f3000, "alloc");
+}
+BENCHMARK("ksnprintf", ksnprintf_benchmark);
+
+#define BENCHMARK_LINES 100
+
+// The same lines through the terminal, the default 1000 iterations print 100k of them
+static void terminal_printf_benchmark(void *context) {
+    (void) context;
+
+    for(size_t i=0; i<BENCHMARK_LINES; ++i) {
+        terminal_printf("cpu %zu frame %#zx addr %#zx name %s\n", i & 7, i, i * 4096, "alloc");
+    }
+}
+BENCHMARK("terminal_printf_100", terminal_printf_benchmark);
+
+static int expect_format(const char *expected, const char *fmt, ...) {
+    char data[64];
+
+    va_list args;
+    va_start(args, fmt);
+    int length = kvsnprintf(data, sizeof(data), fmt, args);
+    va_end(args);
+
+    KTEST_EXPECT(length >= 0 && (size_t) length < sizeof(data));
+    KTEST_EXPECT(memcmp(data, expected, length + 1) == 0);
+
+    return 0;
+}
+
+static int ksnprintf_test(void) {
+    KTEST_EXPECT(expect_format("-12|42   |00042", "%d|%-5zu|%05u", -12, (size_t) 42, 42U) == 0);
+    KTEST_EXPECT(expect_format("0xff|0XFF|0755", "%#x|%#X|%#o", 255U, 255U, 0755U) == 0);
+    KTEST_EXPECT(expect_format("[  ok][ab]", "[%4s][%.2s]", "ok", "abc") == 0);
+
+    // truncated output is still terminated and the length is the full one
+    char data[4];
+    KTEST_EXPECT(ksnprintf(data, sizeof(data), "%s", "abcdef") == 6);
+    KTEST_EXPECT(memcmp(data, "abc", 4) == 0);
+
+    return 0;
+}
+KTEST("ksnprintf", ksnprintf_test);
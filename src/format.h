@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+/* Output of the format engine. Characters are appended to data until it
+ * holds size of them, then flush is called to empty it. Without a flush
+ * callback the rest of the output is counted but dropped.
+ */
+struct format_buffer {
+    char *data;
+    size_t size;
+    size_t used;
+
+    // characters produced, including any that were dropped
+    size_t total;
+
+    void (*flush)(struct format_buffer *buffer);
+    void *context;
+};
+
+// Formats in a single pass over fmt. Returns the number of characters produced.
+size_t kvformat(struct format_buffer *out, const char *fmt, va_list args);
+
+/* Stores the arguments fmt consumes as words, in order, so they can be
+ * formatted later without the va_list. Pointers are kept as they are, so a
+ * %s string must outlive the words. Returns the number of arguments, of
+ * which at most max are stored.
+ */
+size_t format_capture(const char *fmt, va_list args, uint64_t *words, size_t max);
+
+// Formats with words stored by format_capture, missing arguments read as 0
+size_t kformat_captured(struct format_buffer *out, const char *fmt, const uint64_t *args, size_t count);
+
+/* printf style formatting into buf, always nul terminated when size is not 0.
+ * Returns the length the full output would have had.
+ */
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+int ksnprintf(char *buf, size_t size, const char *fmt, ...);
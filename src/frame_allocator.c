@@ -1,43 +1,16 @@
 #include "frame_allocator.h"
+#include "spinlock.h"
+#include "klog.h"
+#include "memory_map.h"
+#include "benchmark.h"
 
-void init_allocator(struct multiboot_data *data) {
-    allocator.next_free_frame.number = 0;
-
-    allocator.mem_map = data->memory_map;
-
-    allocator.num_entries = ((uintptr_t)(allocator.mem_map->size) - 4*sizeof(uint32_t))/allocator.mem_map->entry_size;
-
-    allocator.entry_index = 0;
-    uint64_t min_addr = UINT64_MAX;
-    for(int i=0; i<allocator.num_entries; ++i) {
-        if(min_addr > allocator.mem_map->memory_maps[i].base_addr
-            && allocator.mem_map->memory_maps[i].length >= PAGE_SIZE) {
-            min_addr = allocator.mem_map->memory_maps[i].base_addr;
-            allocator.entry_index = i;
-        }
-    }
-
-    uintptr_t kernel_start_addr = UINTPTR_MAX;
-    uintptr_t kernel_end_addr = 0;
-
-    for(int i=0; i<data->elf_symbols->num; ++i) {
-        struct multiboot_elf_section_header header = data->elf_symbols->sectionheaders[i];
-        if(header.sh_size>0 && header.sh_addr<kernel_start_addr) {
-            kernel_start_addr = header.sh_addr;
-        }
-
-        uintptr_t end = header.sh_size + header.sh_addr;
-        if(end > kernel_end_addr) {
-            kernel_end_addr = end;
-        }
-    }
-
-    get_frame_for_addr(&allocator.kernel_start, kernel_start_addr);
-    get_frame_for_addr(&allocator.kernel_end, kernel_end_addr);
+static struct ticket_lock allocator_lock = TICKET_LOCK_INIT;
 
+void init_allocator(struct multiboot_data *data) {
+    (void) data;
 
-    get_frame_for_addr(&allocator.multiboot_start, start);
-    get_frame_for_addr(&allocator.multiboot_end, (uintptr_t)start + start->total_size);
+    allocator.next_free_frame.number = 0;
+    allocator.region = memory_map_next_usable(0);
 }
 
 void get_frame_for_addr(struct frame *frame, uintptr_t addr) {
@@ -48,55 +21,53 @@ uintptr_t get_frame_start_addr(struct frame *frame) {
     return frame->number * PAGE_SIZE;
 }
 
-static void switch_area() {
-    uint64_t min_addr = allocator.mem_map->memory_maps[allocator.entry_index].base_addr + allocator.mem_map->memory_maps[allocator.entry_index].length - 1;
+// Frames are handed out in address order, skipping everything the memory map doesn't mark usable
+static int allocate_frame_locked(struct frame *frame) {
+    const struct memory_region *region = allocator.region;
+    uint64_t addr = get_frame_start_addr(&allocator.next_free_frame);
 
-    uint64_t next_min_addr = UINT64_MAX;
+    while(region != NULL && addr >= region->end) {
+        region = memory_map_usable_after(region);
+    }
 
-    allocator.entry_index = allocator.num_entries;
+    allocator.region = region;
+    if(region == NULL) {
+        return -1;
+    }
 
-    for(int i=0; i<allocator.num_entries; ++i) {
-        if(min_addr <= allocator.mem_map->memory_maps[i].base_addr
-            && allocator.mem_map->memory_maps[i].length >= PAGE_SIZE
-            && next_min_addr > allocator.mem_map->memory_maps[i].base_addr) {
-            next_min_addr = allocator.mem_map->memory_maps[i].base_addr;
-            allocator.entry_index = i;
-        }
+    if(addr < region->start) {
+        addr = region->start;
     }
+
+    get_frame_for_addr(frame, addr);
+    allocator.next_free_frame.number = frame->number + 1;
+
+    klog_debug("alloc frame %#zx\n", frame->number);
+    return 0;
 }
 
 /* Returns 0 on success. Non-zero on failure.
  *
  */
 int allocate_frame(struct frame *frame) {
-    frame->number = 0;
-
-    do {        
-        if(allocator.entry_index == allocator.num_entries) {
-            return -1;
-        }
-
-        size_t index = allocator.next_free_frame.number;
-
-        struct frame last_frame_of_area;
-        struct multiboot_memory_map_entry* entry = &allocator.mem_map->memory_maps[allocator.entry_index];
-        get_frame_for_addr(&last_frame_of_area, entry->base_addr + entry->length - 1);
-
-        if(index > last_frame_of_area.number) {
-            //need to switch to the next allowed area
-            switch_area();
-        } else if(index >= allocator.kernel_start.number && index <= allocator.kernel_end.number) {
-            ++allocator.next_free_frame.number;
-        } else if(index >= allocator.multiboot_start.number && index <= allocator.multiboot_end.number) {
-            ++allocator.next_free_frame.number;
-        } else {
-            terminal_printf("alloc\n");
-            frame->number = allocator.next_free_frame.number++;
-            return 0;
-        }
-    } while(1);
+    uint64_t flags = ticket_lock_irqsave(&allocator_lock);
+    int result = allocate_frame_locked(frame);
+    ticket_unlock_irqrestore(&allocator_lock, flags);
+
+    return result;
 }
 
 void deallocate_frame(struct frame *frame) {
 
 }
+
+// Frames are never handed back, so each call uses up another one
+static void allocate_benchmark(void *context) {
+    (void) context;
+
+    struct frame frame;
+    if(allocate_frame(&frame) == 0) {
+        deallocate_frame(&frame);
+    }
+}
+BENCHMARK("frame_allocate", allocate_benchmark);
@@ -12,22 +12,19 @@ struct frame {
 
 // Chunk frames into 4096 byte areas and indexed linearly
 
+struct memory_region;
+
 struct frame_allocator {
     struct frame next_free_frame;
-    struct multiboot_memory_map *mem_map;
-    size_t entry_index;
-    size_t num_entries;
-
-    struct frame kernel_start;
-    struct frame kernel_end;
 
-    struct frame multiboot_start;
-    struct frame multiboot_end;
+    // the usable region of the memory map next_free_frame is in or before
+    const struct memory_region *region;
 };
 
 struct frame_allocator allocator;
 
 
+// Allocates from the usable regions of the memory map, memory_map_init must have run
 void init_allocator(struct multiboot_data *data);
 
 void get_frame_for_addr(struct frame *frame, uintptr_t addr);
@@ -0,0 +1,225 @@
+#include "framebuffer.h"
+#include "font.h"
+#include "paging.h"
+#include "util.h"
+#include "cpu.h"
+#include "benchmark.h"
+
+// Four 32 bit pixels, gcc emits sse2 for the operations on these
+typedef uint32_t pixel_vector __attribute__ ((vector_size (16)));
+
+#define PIXEL_LANES 4
+
+struct framebuffer {
+    uint8_t *base;
+    uint32_t pitch;
+    uint32_t width;
+    uint32_t height;
+
+    // pixel values of the 16 text mode colours
+    uint32_t palette[16];
+
+    bool present;
+};
+
+static struct framebuffer fb;
+
+// The default text mode palette
+static const uint8_t vga_rgb[16][3] = {
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xAA }, { 0x00, 0xAA, 0x00 }, { 0x00, 0xAA, 0xAA },
+    { 0xAA, 0x00, 0x00 }, { 0xAA, 0x00, 0xAA }, { 0xAA, 0x55, 0x00 }, { 0xAA, 0xAA, 0xAA },
+    { 0x55, 0x55, 0x55 }, { 0x55, 0x55, 0xFF }, { 0x55, 0xFF, 0x55 }, { 0x55, 0xFF, 0xFF },
+    { 0xFF, 0x55, 0x55 }, { 0xFF, 0x55, 0xFF }, { 0xFF, 0xFF, 0x55 }, { 0xFF, 0xFF, 0xFF }
+};
+
+// A lane is all ones where the nibble has a bit set, the top bit is the leftmost pixel
+#define NIBBLE_MASK(n) { ((n) & 8) ? ~0u : 0, ((n) & 4) ? ~0u : 0, ((n) & 2) ? ~0u : 0, ((n) & 1) ? ~0u : 0 }
+
+static const pixel_vector nibble_masks[16] = {
+    NIBBLE_MASK(0x0), NIBBLE_MASK(0x1), NIBBLE_MASK(0x2), NIBBLE_MASK(0x3),
+    NIBBLE_MASK(0x4), NIBBLE_MASK(0x5), NIBBLE_MASK(0x6), NIBBLE_MASK(0x7),
+    NIBBLE_MASK(0x8), NIBBLE_MASK(0x9), NIBBLE_MASK(0xA), NIBBLE_MASK(0xB),
+    NIBBLE_MASK(0xC), NIBBLE_MASK(0xD), NIBBLE_MASK(0xE), NIBBLE_MASK(0xF)
+};
+
+static inline pixel_vector splat(uint32_t pixel) {
+    return (pixel_vector) { pixel, pixel, pixel, pixel };
+}
+
+// The pitch need not keep rows 16 byte aligned
+static inline void store_pixels(uint8_t *dest, pixel_vector pixels) {
+    __builtin_memcpy(dest, &pixels, sizeof(pixels));
+}
+
+static uint32_t component(uint8_t value, uint8_t position, uint8_t size) {
+    return (uint32_t) (value >> (8 - size)) << position;
+}
+
+static void fill_rows(size_t first, size_t count, uint32_t pixel) {
+    pixel_vector pixels = splat(pixel);
+
+    for(size_t y=first; y<first+count; ++y) {
+        uint8_t *row = fb.base + y * fb.pitch;
+        size_t x = 0;
+
+        for(; x + PIXEL_LANES <= fb.width; x += PIXEL_LANES) {
+            store_pixels(row + x * sizeof(uint32_t), pixels);
+        }
+
+        for(; x < fb.width; ++x) {
+            ((uint32_t*) row)[x] = pixel;
+        }
+    }
+}
+
+int framebuffer_init(struct multiboot_framebuffer_info *info) {
+    if(info == NULL || info->framebuffer_type != multiboot_framebuffer_direct_rgb || info->framebuffer_bpp != 32) {
+        return -1;
+    }
+
+    if(info->framebuffer_width < TERMINAL_WIDTH * FRAMEBUFFER_CELL_WIDTH
+        || info->framebuffer_height < TERMINAL_HEIGHT * FRAMEBUFFER_CELL_HEIGHT) {
+        return -1;
+    }
+
+    struct multiboot_color_type_direct_rgb *rgb = (struct multiboot_color_type_direct_rgb*) info->color_info;
+
+    for(size_t i=0; i<16; ++i) {
+        fb.palette[i] = component(vga_rgb[i][0], rgb->red_field_position, rgb->red_mask_size)
+                      | component(vga_rgb[i][1], rgb->green_field_position, rgb->green_mask_size)
+                      | component(vga_rgb[i][2], rgb->blue_field_position, rgb->blue_mask_size);
+    }
+
+    uintptr_t start = info->framebuffer_addr;
+    uintptr_t end = start + (uintptr_t) info->framebuffer_pitch * info->framebuffer_height;
+
+    for(uintptr_t addr = start & ~(uintptr_t) (PAGE_SIZE - 1); addr < end; addr += PAGE_SIZE) {
+        struct frame frame;
+        get_frame_for_addr(&frame, addr);
+        identity_map_page(&frame, present_bit | writeable_bit | no_exec_bit, memory_type_write_combining);
+    }
+
+    fb.base = (uint8_t*) start;
+    fb.pitch = info->framebuffer_pitch;
+    fb.width = info->framebuffer_width;
+    fb.height = info->framebuffer_height;
+
+    fill_rows(0, fb.height, fb.palette[VGA_COLOR_BLACK]);
+    fb.present = true;
+
+    return 0;
+}
+
+bool framebuffer_present(void) {
+    return fb.present;
+}
+
+/* Rows go out top to bottom and left to right across the whole line so
+ * the stores stay sequential, each glyph row is two vector stores.
+ */
+void framebuffer_draw_line(size_t y, const vga_char *text, size_t length) {
+    uint8_t *line = fb.base + y * FRAMEBUFFER_CELL_HEIGHT * fb.pitch;
+
+    for(size_t row=0; row<FRAMEBUFFER_CELL_HEIGHT; ++row) {
+        uint8_t *dest = line + row * fb.pitch;
+        size_t glyph_row = row * FONT_HEIGHT / FRAMEBUFFER_CELL_HEIGHT;
+
+        for(size_t x=0; x<length; ++x) {
+            uint8_t c = text[x] & 0xff;
+            uint8_t attribute = text[x] >> 8;
+
+            uint8_t bits = font_glyphs[c < FONT_GLYPH_COUNT ? c : '?'][glyph_row];
+            pixel_vector fg = splat(fb.palette[attribute & 0xf]);
+            pixel_vector bg = splat(fb.palette[attribute >> 4]);
+
+            pixel_vector left = nibble_masks[bits >> 4];
+            pixel_vector right = nibble_masks[bits & 0xf];
+
+            store_pixels(dest, (left & fg) | (~left & bg));
+            store_pixels(dest + sizeof(pixel_vector), (right & fg) | (~right & bg));
+            dest += FRAMEBUFFER_CELL_WIDTH * sizeof(uint32_t);
+        }
+    }
+}
+
+/* Store bandwidth to display memory by memory type, on the framebuffer
+ * below the terminal or on the text mode pages after the visible one.
+ * Those areas are black or hidden, so nothing shows. Each iteration zeroes
+ * up to DISPLAY_BENCHMARK_BYTES of it.
+ */
+#define DISPLAY_BENCHMARK_BYTES (64 * 1024)
+
+static void display_benchmark_range(virtual_addr_t *addr, size_t *size) {
+    if(fb.present) {
+        size_t text_rows = TERMINAL_HEIGHT * FRAMEBUFFER_CELL_HEIGHT;
+        *addr = (virtual_addr_t) (fb.base + text_rows * fb.pitch);
+        *size = (fb.height - text_rows) * fb.pitch;
+    } else {
+        *addr = VGA_TEXT_START + PAGE_SIZE;
+        *size = VGA_TEXT_END - VGA_TEXT_START - PAGE_SIZE;
+    }
+
+    if(*size > DISPLAY_BENCHMARK_BYTES) {
+        *size = DISPLAY_BENCHMARK_BYTES;
+    }
+}
+
+static int display_benchmark_setup(enum memory_type type) {
+    virtual_addr_t addr;
+    size_t size;
+    display_benchmark_range(&addr, &size);
+
+    return set_memory_type(addr, size, type);
+}
+
+static int uncached_setup(void **context) {
+    (void) context;
+    return display_benchmark_setup(memory_type_uncached);
+}
+
+static int write_through_setup(void **context) {
+    (void) context;
+    return display_benchmark_setup(memory_type_write_through);
+}
+
+static int write_combining_setup(void **context) {
+    (void) context;
+    return display_benchmark_setup(memory_type_write_combining);
+}
+
+// Display memory is write combining the rest of the time
+static void display_benchmark_teardown(void *context) {
+    (void) context;
+    display_benchmark_setup(memory_type_write_combining);
+}
+
+static void display_benchmark_stores(void) {
+    virtual_addr_t addr;
+    size_t size;
+    display_benchmark_range(&addr, &size);
+
+    volatile uint64_t *dest = (volatile uint64_t*) addr;
+    for(size_t i=0; i<size / sizeof(uint64_t); ++i) {
+        dest[i] = 0;
+    }
+
+    store_fence();
+}
+
+static void uncached_benchmark(void *context) {
+    (void) context;
+    display_benchmark_stores();
+}
+BENCHMARK_WITH_SETUP("display_uncached", uncached_benchmark, uncached_setup, display_benchmark_teardown);
+
+static void write_through_benchmark(void *context) {
+    (void) context;
+    display_benchmark_stores();
+}
+BENCHMARK_WITH_SETUP("display_write_through", write_through_benchmark, write_through_setup, display_benchmark_teardown);
+
+static void write_combining_benchmark(void *context) {
+    (void) context;
+    display_benchmark_stores();
+}
+BENCHMARK_WITH_SETUP("display_write_combining", write_combining_benchmark, write_combining_setup, display_benchmark_teardown);
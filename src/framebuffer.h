@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "multiboot.h"
+#include "terminal.h"
+
+/* Text console on a linear framebuffer. Each terminal cell is an 8x8 font
+ * glyph with its rows doubled, so the terminal takes the top left
+ * TERMINAL_WIDTH*8 by TERMINAL_HEIGHT*16 pixels. Only 32 bit direct colour
+ * modes are supported.
+ */
+
+#define FRAMEBUFFER_CELL_WIDTH 8
+#define FRAMEBUFFER_CELL_HEIGHT 16
+
+/* Maps the framebuffer grub set up and clears it.
+ * Returns 0 on success. Non-zero if there is no usable framebuffer.
+ * Must run after remap_kernel.
+ */
+int framebuffer_init(struct multiboot_framebuffer_info *info);
+
+bool framebuffer_present(void);
+
+// Draws length cells of text at text line y, colours come from the vga attributes
+void framebuffer_draw_line(size_t y, const vga_char *text, size_t length);
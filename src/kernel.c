@@ -3,57 +3,109 @@
 #include "pic.h"
 #include "keyboard.h"
 #include "frame_allocator.h"
+#include "memory_map.h"
 #include "paging.h"
 #include "kmalloc.h"
+#include "pit.h"
+#include "scheduler.h"
+#include "workqueue.h"
+#include "klog.h"
+#include "serial.h"
+#include "framebuffer.h"
+#include "smp.h"
+#include "cpu.h"
+#include "boot_param.h"
+#include "module.h"
+#include "cpio.h"
+#include "symbols.h"
+#include "pmu.h"
+#include "profiler.h"
+#include "benchmark.h"
+#include "ktest.h"
+#include "boot_time.h"
 
 #include "exceptions.h"
 
 #include "assert.h"
 
 
-//Calling convention on x86-64 System V ABI
-//rdi, rsi, rdx, rcx for ints
+enum console_choice {
+	console_all,
+	console_screen,
+	console_serial
+};
 
-static void loop(void) {
-	for(int k = 0; k < 100000000; ++k) {}
-}
+// Where terminal output goes, serial only takes effect if a uart answers
+static int console = console_all;
+static const char *const console_names[] = { "all", "screen", "serial", NULL };
+BOOT_PARAM_ENUM("console", console, console_names);
 
-static void loop_small(void) {
-	for(int k = 0; k < 50000000; ++k) {}
-}
+//Calling convention on x86-64 System V ABI
+//rdi, rsi, rdx, rcx for ints
 
 static void pf_test(int i) {
 	pf_test(++i);
 }
 
-int timer_print(void) {
-	terminal_printf("T");
+void kernel_main(uintptr_t pmultiboot) {
+	boot_time_end(boot_stage_kernel_main);
 
-	return 0;
-}
+	per_cpu_init(0);
+	pat_init();
 
-void kernel_main(uintptr_t pmultiboot) {
 	init_terminal();
 
+	struct multiboot_boot_command_line *command_line =
+		(struct multiboot_boot_command_line*) multiboot_find_tag(pmultiboot, multiboot_boot_command_line_tag);
+	if(command_line != NULL) {
+		boot_params_parse((const char*) command_line->string);
+	}
+	boot_params_print();
+
 	pic_init(0x20, 0x28);
 	init_exception_handlers();
 
 	pic_enable_interrupts();
 
-	add_interrupt_handler(0x20, timer_print);
-
-	
+	pit_init();
+	add_interrupt_handler(0x20, pit_timer_interrupt);
 
 	keyboard_init();
 	add_interrupt_handler(0x21, keyboard_interrupt);
 
+	add_interrupt_handler(0x20 + SERIAL_COM1_IRQ, (intptr_t) serial_interrupt);
+	if(console != console_screen && serial_init(SERIAL_COM1, SERIAL_COM1_IRQ, SERIAL_DEFAULT_BAUD) == 0) {
+		terminal_set_backends((console == console_serial ? 0 : TERMINAL_BACKEND_VGA) | TERMINAL_BACKEND_SERIAL);
+	}
+
 	init_multiboot_data(pmultiboot);
 
+	memory_map_init(&data);
+	memory_map_print();
 	init_allocator(&data);
 
+	boot_time_begin(boot_stage_remap_kernel);
 	remap_kernel();
+	boot_time_end(boot_stage_remap_kernel);
 
+	boot_time_begin(boot_stage_init_heap);
 	init_heap();
+	boot_time_end(boot_stage_init_heap);
+
+	modules_init(&data);
+	symbols_init(&data);
+	pmu_init();
+	pmu_cpu_init();
+	pmu_print_info();
+	const struct module *initrd = module_find("initrd");
+	if(initrd != NULL) {
+		cpio_print(initrd->data, initrd->size);
+	}
+
+	// in a graphics mode text mode memory isn't shown
+	if((terminal_get_backends() & TERMINAL_BACKEND_VGA) && framebuffer_init(data.framebuffer) == 0) {
+		terminal_set_backends((terminal_get_backends() & ~TERMINAL_BACKEND_VGA) | TERMINAL_BACKEND_FRAMEBUFFER);
+	}
 
 	//int b = 0/0;
 	//*(int*)(0xdeadb00) = 20;
@@ -63,52 +115,15 @@ void kernel_main(uintptr_t pmultiboot) {
 
 	//test();
 
-	// intptr_t addr1 = kmalloc(0x100);
-	// terminal_printf("Addr1 %#zX\n", addr1);
-	// loop_small();
-	// intptr_t addr2 = kmalloc(0x200);
-	// terminal_printf("Addr2 %#zX\n", addr2);
-	// loop_small();
-	// intptr_t addr3 = kmalloc(0x100);
-	// terminal_printf("Addr3 %#zX\n", addr3);
-	// kfree(addr2);
-	// intptr_t addr = kmalloc(0x20);
-	// terminal_printf("Addr4 %#zX\n", addr);
-	// loop_small();
-	// addr = kmalloc(0x40);
-	// terminal_printf("Addr5 %#zX\n", addr);
-	// loop_small();
-	// addr = kmalloc(0x50);
-	// terminal_printf("Addr6 %#zX\n", addr);
-	// loop_small();
-
-
-	int ptr_cnt = 0;
-	intptr_t ptrs[10];
-	
-	while(1) {
-		// struct frame f;
-		// allocate_frame(&f);
-
-		// print_text("Alloc frame num: ");
-		// print_hex_number(f.number);
-		// print_newline();
-		int foo = 10;
-		int bar = 0xdeadbeef;
-		size_t baz = 0xcafebabecafebabe;
-		//terminal_printf("\ntest\ntest2\ntest3\n%x\n%3X\n%#x\n%X\n%zx", foo, foo, bar, bar, baz);
-
-		loop();
-
-		// intptr_t addr = kmalloc(0x10*(1+ptr_cnt));
-		// terminal_printf("Addr %#zX\n", addr);
-		// if(ptr_cnt < 10) {
-		// 	ptrs[ptr_cnt++] = addr;
-		// } else {
-		// 	for(int i=0; i < 10; ++i) {
-		// 		kfree(ptrs[i]);
-		// 	}
-		// 	ptr_cnt = 0;
-		// }
-	}
+	scheduler_init(thread_create_from_current("idle"));
+	workqueue_init();
+	klog_init();
+	keyboard_console_init();
+	profiler_init();
+	benchmark_init();
+	ktest_init();
+
+	smp_init();
+
+	scheduler_idle_loop();
 }
\ No newline at end of file
@@ -1,107 +1,499 @@
 #include "keyboard.h"
-
-char ascii_key[0x90] = {0};
+#include "cpu.h"
+#include "ring.h"
+#include "thread.h"
+#include "softirq.h"
+#include "benchmark.h"
 
 enum keyboard_port {
     keyboard_controller_port = 0x64,
     keyboard_encoder_port = 0x60
 };
 
+enum keyboard_controller_status {
+    keyboard_input_buffer_full = 0x02
+};
+
+enum keyboard_command {
+    keyboard_set_leds = 0xED
+};
+
+// Bytes from the keyboard that aren't scan codes
+enum keyboard_response {
+    keyboard_error = 0x00,
+    keyboard_self_test_passed = 0xAA,
+    keyboard_echo = 0xEE,
+    keyboard_ack = 0xFA,
+    keyboard_resend = 0xFE,
+    keyboard_overrun = 0xFF
+};
+
+enum keyboard_prefix {
+    key_released_code = 0xF0,
+    key_extended_code = 0xE0,
+    // pause sends e1 14 77 e1 f0 14 f0 77 and no break code
+    key_pause_code = 0xE1
+};
+
+static const uint8_t key_pause_length = 8;
+
+static const uint8_t keyboard_vector = 0x21;
+
+// Set 2 make codes
+static const uint8_t set2_keys[0x84] = {
+    [0x01] = key_f9, [0x03] = key_f5, [0x04] = key_f3, [0x05] = key_f1,
+    [0x06] = key_f2, [0x07] = key_f12, [0x09] = key_f10, [0x0A] = key_f8,
+    [0x0B] = key_f6, [0x0C] = key_f4, [0x0D] = key_tab, [0x0E] = '`',
+    [0x11] = key_left_alt, [0x12] = key_left_shift, [0x14] = key_left_ctrl, [0x15] = 'q',
+    [0x16] = '1', [0x1A] = 'z', [0x1B] = 's', [0x1C] = 'a',
+    [0x1D] = 'w', [0x1E] = '2', [0x21] = 'c', [0x22] = 'x',
+    [0x23] = 'd', [0x24] = 'e', [0x25] = '4', [0x26] = '3',
+    [0x29] = ' ', [0x2A] = 'v', [0x2B] = 'f', [0x2C] = 't',
+    [0x2D] = 'r', [0x2E] = '5', [0x31] = 'n', [0x32] = 'b',
+    [0x33] = 'h', [0x34] = 'g', [0x35] = 'y', [0x36] = '6',
+    [0x3A] = 'm', [0x3B] = 'j', [0x3C] = 'u', [0x3D] = '7',
+    [0x3E] = '8', [0x41] = ',', [0x42] = 'k', [0x43] = 'i',
+    [0x44] = 'o', [0x45] = '0', [0x46] = '9', [0x49] = '.',
+    [0x4A] = '/', [0x4B] = 'l', [0x4C] = ';', [0x4D] = 'p',
+    [0x4E] = '-', [0x52] = '\'', [0x54] = '[', [0x55] = '=',
+    [0x58] = key_caps_lock, [0x59] = key_right_shift, [0x5A] = key_enter, [0x5B] = ']',
+    [0x5D] = '\\', [0x66] = key_backspace, [0x69] = key_keypad_1, [0x6B] = key_keypad_4,
+    [0x6C] = key_keypad_7, [0x70] = key_keypad_0, [0x71] = key_keypad_period, [0x72] = key_keypad_2,
+    [0x73] = key_keypad_5, [0x74] = key_keypad_6, [0x75] = key_keypad_8, [0x76] = key_escape,
+    [0x77] = key_num_lock, [0x78] = key_f11, [0x79] = key_keypad_plus, [0x7A] = key_keypad_3,
+    [0x7B] = key_keypad_minus, [0x7C] = key_keypad_star, [0x7D] = key_keypad_9, [0x7E] = key_scroll_lock,
+    [0x83] = key_f7
+};
+
+/* Set 2 codes that follow the 0xe0 prefix. The e0 12 and e0 59 fake shifts
+ * around print screen and the navigation keys are left out so they're ignored.
+ */
+static const uint8_t set2_extended_keys[0x80] = {
+    [0x11] = key_right_alt, [0x14] = key_right_ctrl, [0x1F] = key_left_gui, [0x27] = key_right_gui,
+    [0x2F] = key_menu, [0x4A] = key_keypad_slash, [0x5A] = key_keypad_enter, [0x69] = key_end,
+    [0x6B] = key_left, [0x6C] = key_home, [0x70] = key_insert, [0x71] = key_delete,
+    [0x72] = key_down, [0x74] = key_right, [0x75] = key_up, [0x7A] = key_page_down,
+    [0x7C] = key_print_screen, [0x7D] = key_page_up
+};
+
+// Shifted characters for the keys that aren't letters
+static const char shifted_ascii[0x80] = {
+    ['`'] = '~', ['1'] = '!', ['2'] = '@', ['3'] = '#', ['4'] = '$', ['5'] = '%',
+    ['6'] = '^', ['7'] = '&', ['8'] = '*', ['9'] = '(', ['0'] = ')', ['-'] = '_',
+    ['='] = '+', ['['] = '{', [']'] = '}', ['\\'] = '|', [';'] = ':', ['\''] = '"',
+    [','] = '<', ['.'] = '>', ['/'] = '?'
+};
+
+struct keypad_key {
+    char ascii;
+    // the key when num lock is off, or shift is held with it on
+    uint8_t navigation;
+};
+
+static const struct keypad_key keypad_keys[] = {
+    [key_keypad_0 - key_keypad_0] = { '0', key_insert },
+    [key_keypad_1 - key_keypad_0] = { '1', key_end },
+    [key_keypad_2 - key_keypad_0] = { '2', key_down },
+    [key_keypad_3 - key_keypad_0] = { '3', key_page_down },
+    [key_keypad_4 - key_keypad_0] = { '4', key_left },
+    [key_keypad_5 - key_keypad_0] = { '5', key_none },
+    [key_keypad_6 - key_keypad_0] = { '6', key_right },
+    [key_keypad_7 - key_keypad_0] = { '7', key_home },
+    [key_keypad_8 - key_keypad_0] = { '8', key_up },
+    [key_keypad_9 - key_keypad_0] = { '9', key_page_up },
+    [key_keypad_period - key_keypad_0] = { '.', key_delete },
+    [key_keypad_plus - key_keypad_0] = { '+', key_none },
+    [key_keypad_minus - key_keypad_0] = { '-', key_none },
+    [key_keypad_star - key_keypad_0] = { '*', key_none },
+    [key_keypad_slash - key_keypad_0] = { '/', key_none },
+    [key_keypad_enter - key_keypad_0] = { '\n', key_none }
+};
+
+/* Scan code decoder state and where its events go. The keyboard's decoder
+ * is only touched by its softirq bottom half. That can run on any cpu, but
+ * the scheduled flag in softirq.c keeps its work item queued at most once,
+ * so a single worker runs it at a time.
+ */
+struct keyboard_decoder {
+    bool released;
+    bool extended;
+    uint8_t pause_left;
+
+    // toggled by the lock keys, the held modifiers come from keys_down
+    uint8_t locks;
+
+    // the led byte is sent once the keyboard acks the set leds command
+    bool leds_pending;
+
+    uint64_t keys_down[4];
+
+    struct spsc_ring *events;
+    struct keyboard_stats *stats;
+};
+
+static struct spsc_ring event_ring;
+static struct keyboard_event event_storage[KEYBOARD_EVENT_RING_SIZE];
+
+static struct thread *volatile reader;
+static volatile bool reader_sleeping;
+
+static struct keyboard_stats stats;
+
+static struct keyboard_decoder decoder = { .events = &event_ring, .stats = &stats };
+
+static inline bool key_is_down(const struct keyboard_decoder *decoder, uint8_t key) {
+    return decoder->keys_down[key / 64] & (1ull << (key % 64));
+}
+
+static inline void set_key_down(struct keyboard_decoder *decoder, uint8_t key, bool down) {
+    if(down) {
+        decoder->keys_down[key / 64] |= 1ull << (key % 64);
+    } else {
+        decoder->keys_down[key / 64] &= ~(1ull << (key % 64));
+    }
+}
+
+static uint8_t current_modifiers(const struct keyboard_decoder *decoder) {
+    uint8_t modifiers = decoder->locks;
+
+    if(key_is_down(decoder, key_left_shift) || key_is_down(decoder, key_right_shift)) {
+        modifiers |= keyboard_modifier_shift;
+    }
+    if(key_is_down(decoder, key_left_ctrl) || key_is_down(decoder, key_right_ctrl)) {
+        modifiers |= keyboard_modifier_ctrl;
+    }
+    if(key_is_down(decoder, key_left_alt) || key_is_down(decoder, key_right_alt)) {
+        modifiers |= keyboard_modifier_alt;
+    }
+
+    return modifiers;
+}
+
+static void keyboard_send(uint8_t byte) {
+    while(inb(keyboard_controller_port) & keyboard_input_buffer_full) {
+        cpu_relax();
+    }
+
+    outb(keyboard_encoder_port, byte);
+}
+
+// Scroll lock, num lock and caps lock are bits 0 to 2 of the led byte
+static uint8_t led_byte(const struct keyboard_decoder *decoder) {
+    return ((decoder->locks & keyboard_modifier_scroll_lock) ? 1 : 0)
+         | ((decoder->locks & keyboard_modifier_num_lock) ? 2 : 0)
+         | ((decoder->locks & keyboard_modifier_caps_lock) ? 4 : 0);
+}
+
+static void toggle_lock(struct keyboard_decoder *decoder, uint8_t modifier) {
+    decoder->locks ^= modifier;
+    decoder->leds_pending = true;
+    keyboard_send(keyboard_set_leds);
+}
+
+static char translate_ascii(uint8_t key, uint8_t modifiers) {
+    if(key >= 0x80) {
+        return 0;
+    }
+
+    char ascii = key;
+
+    if(ascii >= 'a' && ascii <= 'z') {
+        if(modifiers & keyboard_modifier_ctrl) {
+            return ascii & 0x1f;
+        }
+
+        bool upper = !(modifiers & keyboard_modifier_shift) != !(modifiers & keyboard_modifier_caps_lock);
+        return upper ? ascii - 'a' + 'A' : ascii;
+    }
+
+    if((modifiers & keyboard_modifier_shift) && shifted_ascii[key] != 0) {
+        return shifted_ascii[key];
+    }
+
+    return ascii;
+}
+
+static void queue_event(struct keyboard_decoder *decoder, struct keyboard_event *event) {
+    if(spsc_ring_push(decoder->events, event) == 0) {
+        ++decoder->stats->events;
+    } else {
+        ++decoder->stats->dropped;
+    }
+}
+
+static void wake_reader(void) {
+    struct thread *thread = reader;
+
+    if(thread != NULL && reader_sleeping) {
+        thread_wake(thread);
+    }
+}
+
+static void process_key(struct keyboard_decoder *decoder, uint8_t key, bool released, uint64_t tsc) {
+    if(key == key_none) {
+        return;
+    }
+
+    bool repeat = !released && key_is_down(decoder, key);
+    set_key_down(decoder, key, !released);
+
+    if(!released && !repeat) {
+        switch(key) {
+            case key_caps_lock:
+                toggle_lock(decoder, keyboard_modifier_caps_lock);
+                break;
+            case key_num_lock:
+                toggle_lock(decoder, keyboard_modifier_num_lock);
+                break;
+            case key_scroll_lock:
+                toggle_lock(decoder, keyboard_modifier_scroll_lock);
+                break;
+            default:
+                break;
+        }
+    }
+
+    uint8_t modifiers = current_modifiers(decoder);
+
+    struct keyboard_event event;
+    event.tsc = tsc;
+    event.key = key;
+    event.modifiers = modifiers;
+    event.flags = (released ? keyboard_event_released : 0) | (repeat ? keyboard_event_repeat : 0);
+    event.ascii = 0;
+
+    if(key >= key_keypad_0 && key <= key_keypad_enter) {
+        const struct keypad_key *keypad = &keypad_keys[key - key_keypad_0];
+        bool digits = (modifiers & keyboard_modifier_num_lock) && !(modifiers & keyboard_modifier_shift);
+
+        if(keypad->navigation != key_none && !digits) {
+            event.key = keypad->navigation;
+        } else if(!released) {
+            event.ascii = keypad->ascii;
+        }
+    } else if(!released) {
+        event.ascii = translate_ascii(key, modifiers);
+    }
+
+    queue_event(decoder, &event);
+}
+
+static void process_scancode(struct keyboard_decoder *decoder, uint8_t code, uint64_t tsc) {
+    if(decoder->pause_left > 0) {
+        if(--decoder->pause_left == 0) {
+            process_key(decoder, key_pause, false, tsc);
+            process_key(decoder, key_pause, true, tsc);
+        }
+        return;
+    }
+
+    switch(code) {
+        case key_pause_code:
+            decoder->pause_left = key_pause_length - 1;
+            return;
+        case key_extended_code:
+            decoder->extended = true;
+            return;
+        case key_released_code:
+            decoder->released = true;
+            return;
+        case keyboard_ack:
+            if(decoder->leds_pending) {
+                decoder->leds_pending = false;
+                keyboard_send(led_byte(decoder));
+            }
+            return;
+        case keyboard_error:
+        case keyboard_self_test_passed:
+        case keyboard_echo:
+        case keyboard_resend:
+        case keyboard_overrun:
+            return;
+        default:
+            break;
+    }
+
+    uint8_t key = key_none;
+    if(decoder->extended) {
+        key = code < sizeof(set2_extended_keys) ? set2_extended_keys[code] : key_none;
+    } else {
+        key = code < sizeof(set2_keys) ? set2_keys[code] : key_none;
+    }
+
+    bool released = decoder->released;
+    decoder->released = false;
+    decoder->extended = false;
+
+    process_key(decoder, key, released, tsc);
+}
+
+// Bottom half, data is the TSC at the interrupt shifted up past the scan code
+static void keyboard_softirq(uint8_t vector, uint64_t data) {
+    (void) vector;
+    size_t queued = stats.events;
+
+    process_scancode(&decoder, data & 0xff, data >> 8);
+
+    if(stats.events != queued) {
+        wake_reader();
+    }
+}
+
 void keyboard_init(void) {
-ascii_key[0x15] = 'Q';
-ascii_key[0x16] = '1'; 
-ascii_key[0x21] = 'C'; 
-ascii_key[0x22] = 'X'; 
-ascii_key[0x23] = 'D'; 
-ascii_key[0x24] = 'E'; 
-ascii_key[0x25] = '4'; 
-ascii_key[0x26] = '3'; 
-ascii_key[0x29] = ' ';
-ascii_key[0x31] = 'N';
-ascii_key[0x32] = 'B';
-ascii_key[0x33] = 'H';
-ascii_key[0x34] = 'G';
-ascii_key[0x35] = 'Y';
-ascii_key[0x36] = '6';
-ascii_key[0x41] = ',';
-ascii_key[0x42] = 'K';
-ascii_key[0x43] = 'I';
-ascii_key[0x44] = 'O';
-ascii_key[0x45] = '0';
-ascii_key[0x46] = '9';
-ascii_key[0x49] = '.';
-ascii_key[0x52] = '\'';
-ascii_key[0x54] = '[';
-ascii_key[0x55] = '=';
-ascii_key[0x69] = '1'; 
-ascii_key[0x70] = '0'; 
-ascii_key[0x71] = '.'; 
-ascii_key[0x72] = '2'; 
-ascii_key[0x73] = '5'; 
-ascii_key[0x74] = '6'; 
-ascii_key[0x75] = '8'; 
-ascii_key[0x79] = '\n';
-ascii_key[0x0D] = '\t';
-ascii_key[0x0E] = '`'; 
-ascii_key[0x1A] = 'Z'; 
-ascii_key[0x1B] = 'S'; 
-ascii_key[0x1C] = 'A'; 
-ascii_key[0x1D] = 'W'; 
-ascii_key[0x1E] = '2'; 
-ascii_key[0x2A] = 'V'; 
-ascii_key[0x2B] = 'F'; 
-ascii_key[0x2C] = 'T'; 
-ascii_key[0x2D] = 'R'; 
-ascii_key[0x2E] = '5'; 
-ascii_key[0x3A] = 'M'; 
-ascii_key[0x3B] = 'J'; 
-ascii_key[0x3C] = 'U'; 
-ascii_key[0x3D] = '7'; 
-ascii_key[0x3E] = '8'; 
-ascii_key[0x4A] = '/';
-ascii_key[0x4A] = '/';
-ascii_key[0x4B] = 'L';
-ascii_key[0x4C] = ';';
-ascii_key[0x4D] = 'P';
-ascii_key[0x4E] = '-';
-ascii_key[0x4E] = '-';
-ascii_key[0x5A] = '\n';
-ascii_key[0x5B] = ']';
-ascii_key[0x5C] = '\\';
-ascii_key[0x6B] = '4';
-ascii_key[0x6C] = '7';
-ascii_key[0x7A] = '3';
-ascii_key[0x7C] = '+';
-ascii_key[0x7D] = '9';
-ascii_key[0x7E] = '*';
-}
-
-const uint8_t key_relased_code = 0xf0;
-
-bool keyboard_capslock = false;
-bool keyboard_shift = false;
-bool alt = false;
-bool scroll_lock = false;
-bool num_lock = false;
-
-bool keyboard_key_released = false;
+    spsc_ring_init(&event_ring, event_storage, KEYBOARD_EVENT_RING_SIZE, sizeof(struct keyboard_event));
+    softirq_register(keyboard_vector, keyboard_softirq);
+}
 
+/* Only the raw scan code is read here. Decoding, the LED writes and waking
+ * the reader happen in the bottom half with interrupts enabled, which
+ * softirq_irq_exit switches to as the interrupt returns.
+ */
 int keyboard_interrupt(void) {
+    uint64_t start = read_tsc();
     uint8_t code = inb(keyboard_encoder_port);
 
-    if(code == key_relased_code) {
-        //key released
-        keyboard_key_released = true;
-        return 0;
-    } else if(keyboard_key_released) {
-        keyboard_key_released = false;
-        return 0;
+    // the top 8 bits of the TSC are lost, that's years of uptime
+    softirq_raise(keyboard_vector, (start << 8) | code);
+
+    uint64_t cycles = read_tsc() - start;
+    if(cycles > stats.max_irq_cycles) {
+        stats.max_irq_cycles = cycles;
+    }
+
+    softirq_irq_exit(keyboard_vector, start);
+    return 0;
+}
+
+static void account_read(const struct keyboard_event *event) {
+    uint64_t latency = read_tsc() - event->tsc;
+
+    if(latency > stats.max_read_latency) {
+        stats.max_read_latency = latency;
     }
+}
 
-    char ascii = ascii_key[code];
-    if(ascii != 0) {
-        terminal_print_char(ascii);
+int keyboard_poll(struct keyboard_event *event) {
+    if(spsc_ring_pop(&event_ring, event) != 0) {
+        return -1;
     }
 
+    account_read(event);
     return 0;
-}
\ No newline at end of file
+}
+
+void keyboard_read(struct keyboard_event *event) {
+    reader = thread_current();
+
+    while(keyboard_poll(event) != 0) {
+        uint64_t flags = irq_save();
+        if(spsc_ring_count(&event_ring) == 0) {
+            reader_sleeping = true;
+            thread_block();
+            reader_sleeping = false;
+        }
+        irq_restore(flags);
+    }
+}
+
+void keyboard_tick(void) {
+    if(spsc_ring_count(&event_ring) != 0) {
+        wake_reader();
+    }
+}
+
+static void console_main(void *arg) {
+    (void) arg;
+    int page = COL_MAX - 1;
+
+    while(1) {
+        struct keyboard_event event;
+        keyboard_read(&event);
+
+        if(event.flags & keyboard_event_released) {
+            continue;
+        }
+
+        switch(event.key) {
+            case key_page_up:
+                terminal_view_scroll(page);
+                break;
+            case key_page_down:
+                terminal_view_scroll(-page);
+                break;
+            case key_home:
+                terminal_view_scroll(TERMINAL_SCROLLBACK_LINES);
+                break;
+            case key_end:
+                terminal_view_reset();
+                break;
+            case key_f12:
+                softirq_print_stats();
+                keyboard_print_stats();
+                break;
+            default:
+                if(event.ascii != 0) {
+                    terminal_view_reset();
+                    terminal_print_char(event.ascii);
+                }
+                break;
+        }
+    }
+}
+
+void keyboard_console_init(void) {
+    thread_create("console", console_main, NULL);
+}
+
+void keyboard_print_stats(void) {
+    terminal_printf("keyboard events: %#zx dropped: %#zx irq max: %#zx read latency max: %#zx\n",
+        stats.events, stats.dropped, stats.max_irq_cycles, stats.max_read_latency);
+
+    // 0 until the keyboard_decode benchmark has run
+    terminal_printf("  max cycles with IF=0: %#zx, decoding in the handler took %#zx\n",
+        stats.max_irq_cycles, stats.max_decode_cycles);
+}
+
+/* What the interrupt handler did with IF=0 before the bottom half took it
+ * over, for a left shift press and release. It decodes into its own decoder
+ * and ring, the keyboard's belong to the bottom half. The longest decode is
+ * kept for keyboard_print_stats.
+ */
+static struct keyboard_decoder benchmark_decoder;
+static struct spsc_ring benchmark_ring;
+static struct keyboard_event benchmark_storage[4];
+static struct keyboard_stats benchmark_stats;
+
+static int decode_benchmark_setup(void **context) {
+    (void) context;
+
+    benchmark_stats = (struct keyboard_stats) { 0 };
+    benchmark_decoder = (struct keyboard_decoder) { .events = &benchmark_ring, .stats = &benchmark_stats };
+    stats.max_decode_cycles = 0;
+
+    return spsc_ring_init(&benchmark_ring, benchmark_storage, 4, sizeof(struct keyboard_event));
+}
+
+static void decode_benchmark(void *context) {
+    (void) context;
+    static const uint8_t codes[] = { 0x12, key_released_code, 0x12 };
+
+    uint64_t flags = irq_save();
+    uint64_t start = read_tsc();
+
+    for(size_t i=0; i<sizeof(codes); ++i) {
+        process_scancode(&benchmark_decoder, codes[i], start);
+    }
+
+    uint64_t cycles = read_tsc() - start;
+    irq_restore(flags);
+
+    if(cycles > stats.max_decode_cycles) {
+        stats.max_decode_cycles = cycles;
+    }
+
+    // the reader's part, so the ring never fills
+    struct keyboard_event event;
+    while(spsc_ring_pop(&benchmark_ring, &event) == 0) {
+    }
+}
+BENCHMARK_WITH_SETUP("keyboard_decode", decode_benchmark, decode_benchmark_setup, NULL);
@@ -3,5 +3,138 @@
 #include "terminal.h"
 #include "util.h"
 
+/* PS/2 keyboard using scan code set 2. The interrupt handler only raises
+ * the raw scan code as a softirq, the bottom half decodes each key into a
+ * keyboard_event and queues it, readers block in keyboard_read.
+ */
+
+// Events queued for readers, must be a power of two
+#define KEYBOARD_EVENT_RING_SIZE 128
+
+/* Keys that print something are named by the character they give
+ * unshifted on a US keyboard, the rest are numbered from 0x80.
+ */
+enum keyboard_key {
+    key_none = 0,
+    key_backspace = '\b',
+    key_tab = '\t',
+    key_enter = '\n',
+    key_escape = 0x1b,
+
+    key_f1 = 0x80,
+    key_f2,
+    key_f3,
+    key_f4,
+    key_f5,
+    key_f6,
+    key_f7,
+    key_f8,
+    key_f9,
+    key_f10,
+    key_f11,
+    key_f12,
+
+    key_left_shift,
+    key_right_shift,
+    key_left_ctrl,
+    key_right_ctrl,
+    key_left_alt,
+    key_right_alt,
+    key_left_gui,
+    key_right_gui,
+    key_menu,
+
+    key_caps_lock,
+    key_num_lock,
+    key_scroll_lock,
+
+    key_insert,
+    key_delete,
+    key_home,
+    key_end,
+    key_page_up,
+    key_page_down,
+    key_up,
+    key_down,
+    key_left,
+    key_right,
+
+    key_print_screen,
+    key_pause,
+
+    // with num lock off the digits and period are reported as the navigation keys
+    key_keypad_0,
+    key_keypad_1,
+    key_keypad_2,
+    key_keypad_3,
+    key_keypad_4,
+    key_keypad_5,
+    key_keypad_6,
+    key_keypad_7,
+    key_keypad_8,
+    key_keypad_9,
+    key_keypad_period,
+    key_keypad_plus,
+    key_keypad_minus,
+    key_keypad_star,
+    key_keypad_slash,
+    key_keypad_enter
+};
+
+enum keyboard_modifiers {
+    keyboard_modifier_shift = 0x01,
+    keyboard_modifier_ctrl = 0x02,
+    keyboard_modifier_alt = 0x04,
+    keyboard_modifier_caps_lock = 0x08,
+    keyboard_modifier_num_lock = 0x10,
+    keyboard_modifier_scroll_lock = 0x20
+};
+
+enum keyboard_event_flags {
+    keyboard_event_released = 0x01,
+    // the key was already down, the keyboard's typematic repeat
+    keyboard_event_repeat = 0x02
+};
+
+struct keyboard_event {
+    // TSC when the last scan code of the key arrived
+    uint64_t tsc;
+
+    uint8_t key;
+    // modifiers after this event
+    uint8_t modifiers;
+    uint8_t flags;
+    // what the key types with the modifiers applied, 0 for none or on release
+    char ascii;
+};
+
+struct keyboard_stats {
+    uint64_t events;
+    uint64_t dropped;
+
+    // in TSC cycles, the handler itself and from the interrupt to keyboard_read returning
+    uint64_t max_irq_cycles;
+    uint64_t max_read_latency;
+
+    // the keyboard_decode benchmark's longest decode with IF=0, as the handler did before the bottom half
+    uint64_t max_decode_cycles;
+};
+
 void keyboard_init(void);
 int keyboard_interrupt(void);
+
+/* Waits for the next event. Only one thread may read, the bottom half
+ * wakes it, and the bottom half runs as the keyboard interrupt returns.
+ */
+void keyboard_read(struct keyboard_event *event);
+
+// Returns 0 on success. Non-zero if no event is queued.
+int keyboard_poll(struct keyboard_event *event);
+
+// Called from the timer interrupt, wakes a reader that missed its wakeup
+void keyboard_tick(void);
+
+// Starts the thread that echoes typed characters and scrolls the terminal, F12 prints the interrupt stats
+void keyboard_console_init(void);
+
+void keyboard_print_stats(void);
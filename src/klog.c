@@ -0,0 +1,220 @@
+#include "klog.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include "ring.h"
+#include "format.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "thread.h"
+#include "terminal.h"
+#include "boot_param.h"
+
+struct klog_stats {
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t drained;
+    uint64_t latency_max;
+};
+
+// Only the owning cpu pushes, with interrupts disabled. The drainer pops.
+struct klog_cpu {
+    struct spsc_ring ring;
+    struct klog_entry entries[KLOG_RING_SIZE];
+
+    // dropped count already reported by the drainer
+    uint64_t dropped_reported;
+
+    struct klog_stats stats;
+} __attribute__ ((aligned (64)));
+
+static struct klog_cpu klog_cpus[MAX_CPUS];
+
+// Held by whoever drains, the klog thread or klog_flush
+static struct ticket_lock drain_lock = TICKET_LOCK_INIT;
+
+static struct thread *klog_thread;
+static volatile bool klog_sleeping;
+
+// Messages compiled in but above this are dropped when written
+static int klog_level = KLOG_LEVEL;
+
+static const char *const level_names[] = { "error", "warn", "info", "debug", NULL };
+BOOT_PARAM_ENUM("log_level", klog_level, level_names);
+
+static const char *const level_prefixes[] = {
+    [KLOG_ERROR] = "error: ",
+    [KLOG_WARN] = "warning: ",
+    [KLOG_INFO] = "",
+    [KLOG_DEBUG] = ""
+};
+
+void klog_write(int level, const char *fmt, ...) {
+    if(level > klog_level) {
+        return;
+    }
+
+    struct klog_entry entry;
+    entry.tsc = read_tsc();
+    entry.fmt = fmt;
+    entry.level = level;
+
+    va_list args;
+    va_start(args, fmt);
+    size_t count = format_capture(fmt, args, entry.args, KLOG_MAX_ARGS);
+    va_end(args);
+
+    entry.arg_count = count < KLOG_MAX_ARGS ? count : KLOG_MAX_ARGS;
+
+    uint64_t flags = irq_save();
+    size_t id = this_cpu_id();
+    struct klog_cpu *kc = &klog_cpus[id];
+
+    // the drainer only looks at the ring once head moves, so setting it up here is safe
+    if(kc->ring.buffer == NULL) {
+        spsc_ring_init(&kc->ring, kc->entries, KLOG_RING_SIZE, sizeof(struct klog_entry));
+    }
+
+    entry.cpu = id;
+    if(spsc_ring_push(&kc->ring, &entry) == 0) {
+        ++kc->stats.written;
+    } else {
+        ++kc->stats.dropped;
+    }
+
+    irq_restore(flags);
+}
+
+static char line_buffer[128];
+
+static void write_to_console(struct format_buffer *out) {
+    terminal_write(out->data, out->used);
+    out->used = 0;
+}
+
+static void print_entry(const struct klog_entry *entry) {
+    struct format_buffer out = {
+        .data = line_buffer,
+        .size = sizeof(line_buffer),
+        .used = 0,
+        .total = 0,
+        .flush = write_to_console,
+        .context = NULL
+    };
+
+    const char *prefix = entry->level <= KLOG_DEBUG ? level_prefixes[entry->level] : "";
+    kformat_captured(&out, prefix, NULL, 0);
+    kformat_captured(&out, entry->fmt, entry->args, entry->arg_count);
+
+    write_to_console(&out);
+}
+
+static void report_dropped(struct klog_cpu *kc, size_t id) {
+    uint64_t dropped = __atomic_load_n(&kc->stats.dropped, __ATOMIC_RELAXED);
+
+    if(dropped != kc->dropped_reported) {
+        terminal_printf("klog: cpu %zu dropped %zu messages\n", id, (size_t) (dropped - kc->dropped_reported));
+        kc->dropped_reported = dropped;
+    }
+}
+
+// Entries from all cpus come out in timestamp order
+static size_t drain_locked(void) {
+    size_t drained = 0;
+
+    while(1) {
+        const struct klog_entry *oldest = NULL;
+        struct klog_cpu *from = NULL;
+
+        for(size_t i=0; i<MAX_CPUS; ++i) {
+            const struct klog_entry *entry = spsc_ring_peek(&klog_cpus[i].ring);
+            if(entry != NULL && (oldest == NULL || entry->tsc < oldest->tsc)) {
+                oldest = entry;
+                from = &klog_cpus[i];
+            }
+        }
+
+        if(oldest == NULL) {
+            break;
+        }
+
+        uint64_t latency = read_tsc() - oldest->tsc;
+        if(latency > from->stats.latency_max) {
+            from->stats.latency_max = latency;
+        }
+
+        print_entry(oldest);
+        spsc_ring_skip(&from->ring);
+
+        ++from->stats.drained;
+        ++drained;
+    }
+
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        report_dropped(&klog_cpus[i], i);
+    }
+
+    return drained;
+}
+
+static bool klog_pending(void) {
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        if(spsc_ring_peek(&klog_cpus[i].ring) != NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void klog_flush(void) {
+    if(!ticket_trylock(&drain_lock)) {
+        return;
+    }
+
+    drain_locked();
+    ticket_unlock(&drain_lock);
+}
+
+static void klog_main(void *arg) {
+    (void) arg;
+
+    while(1) {
+        ticket_lock(&drain_lock);
+        drain_locked();
+        ticket_unlock(&drain_lock);
+
+        uint64_t flags = irq_save();
+        if(!klog_pending()) {
+            klog_sleeping = true;
+            thread_block();
+            klog_sleeping = false;
+        }
+        irq_restore(flags);
+    }
+}
+
+void klog_tick(void) {
+    // writers don't wake the thread themselves, they may hold scheduler locks
+    if(klog_sleeping && klog_thread != NULL && klog_pending()) {
+        thread_wake(klog_thread);
+    }
+}
+
+void klog_init(void) {
+    klog_thread = thread_create("klog", klog_main, NULL);
+    if(klog_thread == NULL) {
+        terminal_printf("klog: no thread, messages are only written on flush\n");
+    }
+}
+
+void klog_print_stats(void) {
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        struct klog_stats *stats = &klog_cpus[i].stats;
+        if(stats->written == 0 && stats->dropped == 0) {
+            continue;
+        }
+
+        terminal_printf("klog cpu %#zx written: %#zx\tdropped: %#zx\tdrained: %#zx\tlatency max: %#zx\n",
+            i, stats->written, stats->dropped, stats->drained, stats->latency_max);
+    }
+}
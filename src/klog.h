@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Kernel log. Writers store the timestamp, level, format pointer and raw
+ * arguments in this cpu's ring and return, formatting happens later on the
+ * klog thread, which drains every cpu's ring to the console. The format
+ * string and any %s arguments must outlive the entry, string literals do.
+ *
+ * Messages above KLOG_LEVEL are compiled out. Release builds (NDEBUG) drop
+ * the debug level unless KLOG_LEVEL is given on the command line. The
+ * log_level boot parameter drops more at run time.
+ */
+
+#define KLOG_ERROR 0
+#define KLOG_WARN 1
+#define KLOG_INFO 2
+#define KLOG_DEBUG 3
+
+#ifndef KLOG_LEVEL
+#ifdef NDEBUG
+#define KLOG_LEVEL KLOG_INFO
+#else
+#define KLOG_LEVEL KLOG_DEBUG
+#endif
+#endif
+
+// Arguments past this are dropped
+#define KLOG_MAX_ARGS 6
+
+// Entries per cpu, a full ring drops new entries and counts them
+#define KLOG_RING_SIZE 256
+
+struct klog_entry {
+    uint64_t tsc;
+    const char *fmt;
+    uint16_t level;
+    uint16_t cpu;
+    uint32_t arg_count;
+    uint64_t args[KLOG_MAX_ARGS];
+};
+
+// Safe from any context, including interrupt handlers
+void klog_write(int level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+#if KLOG_LEVEL >= KLOG_ERROR
+#define klog_error(...) klog_write(KLOG_ERROR, __VA_ARGS__)
+#else
+#define klog_error(...) ((void) 0)
+#endif
+
+#if KLOG_LEVEL >= KLOG_WARN
+#define klog_warn(...) klog_write(KLOG_WARN, __VA_ARGS__)
+#else
+#define klog_warn(...) ((void) 0)
+#endif
+
+#if KLOG_LEVEL >= KLOG_INFO
+#define klog_info(...) klog_write(KLOG_INFO, __VA_ARGS__)
+#else
+#define klog_info(...) ((void) 0)
+#endif
+
+#if KLOG_LEVEL >= KLOG_DEBUG
+#define klog_debug(...) klog_write(KLOG_DEBUG, __VA_ARGS__)
+#else
+#define klog_debug(...) ((void) 0)
+#endif
+
+// Starts the klog thread, entries written before this wait in the rings
+void klog_init(void);
+
+/* Formats everything queued so far to the console from the caller.
+ * Does nothing if the klog thread is draining at the same time.
+ */
+void klog_flush(void);
+
+// Called from the timer interrupt, wakes the klog thread when there is work
+void klog_tick(void);
+
+void klog_print_stats(void);
@@ -1,7 +1,14 @@
 #include "kmalloc.h"
+#include "spinlock.h"
+#include "klog.h"
+#include "boot_param.h"
+#include "benchmark.h"
+#include "ktest.h"
 
 const intptr_t heap_start_addr = 4096 * 512 * 512;
-const intptr_t heap_size = 100 * 1024;
+
+static size_t heap_size = 100 * 1024;
+BOOT_PARAM_SIZE("heap_size", heap_size, PAGE_SIZE, 1 << 30);
 
 static intptr_t heap_addr;
 
@@ -13,6 +20,7 @@ struct free_node {
 const size_t minimum_alloc_size = sizeof(struct free_node) + 2*sizeof(uintptr_t);
 
 static struct free_node *free_list_head;
+static struct ticket_lock heap_lock = TICKET_LOCK_INIT;
 
 static inline intptr_t align_addr(intptr_t addr, size_t alignment)  {
     return (alignment) ? ((addr+alignment-1) & ~(alignment-1)) : (addr);
@@ -22,6 +30,10 @@ static inline struct free_node* get_free_node_from_addr(intptr_t addr) {
     return (struct free_node*) (addr - sizeof(struct free_node));
 }
 
+static inline intptr_t get_node_end(const struct free_node *node) {
+    return (intptr_t) node + sizeof(struct free_node) + node->size;
+}
+
 static void compact_heap() {
     struct free_node *node = free_list_head;
 
@@ -37,7 +49,7 @@ void init_heap(void) {
     for(virtual_addr_t addr = heap_start_addr; addr < heap_start_addr + heap_size; addr += PAGE_SIZE) {
         struct page page;
         get_page_for_vaddr(addr, &page);
-        terminal_printf("Mapping page %#x\n", addr);
+        klog_debug("Mapping page %#zx\n", addr);
         map_page(&page, present_bit | writeable_bit);
     }
 
@@ -50,12 +62,12 @@ struct free_node* allocate_memory(size_t required_bytes) {
     struct free_node *alloc_node = NULL;
     struct free_node *node = free_list_head;
 
-    terminal_printf("Required bytes %zx\n", required_bytes);
+    klog_debug("Required bytes %zx\n", required_bytes);
     while(node->next != NULL) {
-        terminal_printf("Old size: %zx\n", node->next->size);
+        klog_debug("Old size: %zx\n", node->next->size);
 
         if(node->next->size >= required_bytes) {
-            terminal_printf("Not from head, old node: %zx\n", node->next);
+            klog_debug("Not from head, old node: %p\n", (void*) node->next);
             struct free_node *old_node = node->next;
             struct free_node *new_next_node = node->next->next;
 
@@ -66,9 +78,9 @@ struct free_node* allocate_memory(size_t required_bytes) {
             }
 
             if(new_free_bytes) {
-                terminal_printf("New free bytes: %zx\n", new_free_bytes);
+                klog_debug("New free bytes: %zx\n", new_free_bytes);
                 new_next_node = (intptr_t) old_node + sizeof(struct free_node) + required_bytes;
-                terminal_printf("New next node: %zx\n", new_next_node);
+                klog_debug("New next node: %p\n", (void*) new_next_node);
                 new_next_node->size = new_free_bytes - sizeof(struct free_node);
                 new_next_node->next = old_node->next;
             }
@@ -85,8 +97,14 @@ struct free_node* allocate_memory(size_t required_bytes) {
     }
 
     if(!alloc_node) {          
-        terminal_printf("From head\n");
+        klog_debug("From head\n");
         struct free_node *old_head = free_list_head;
+
+        // the head must keep room for its own node
+        if(old_head->size < required_bytes + sizeof(struct free_node)) {
+            return NULL;
+        }
+
         struct free_node *new_head = (intptr_t) old_head + sizeof(struct free_node) + required_bytes;
         
         new_head->size = old_head->size - required_bytes - sizeof(struct free_node);
@@ -107,7 +125,14 @@ intptr_t kmalloc(size_t bytes) {
 
     size_t req_bytes = bytes;
 
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
     struct free_node *node = allocate_memory(req_bytes);
+    ticket_unlock_irqrestore(&heap_lock, flags);
+
+    if(node == NULL) {
+        klog_error("kmalloc: out of heap for %#zx bytes\n", bytes);
+        return 0;
+    }
 
     return (intptr_t) node + sizeof(struct free_node);
 }
@@ -132,9 +157,102 @@ intptr_t krealloc(intptr_t addr, size_t bytes) {
     return new_addr;
 }
 
+/* The free list after the head is kept sorted by address, every free block
+ * is below the head. A freed block merges with the free blocks either side
+ * of it, and with the head if it ends there, so the heap doesn't fragment.
+ */
 void kfree(intptr_t addr) {
+    if(addr == 0) {
+        return;
+    }
+
     struct free_node *node = get_free_node_from_addr(addr);
-    terminal_printf("Free node base %zx\n", (intptr_t) node);
-    node->next = free_list_head->next;
-    free_list_head->next = node;
-}
\ No newline at end of file
+    klog_debug("Free node base %p\n", (void*) node);
+
+    uint64_t flags = ticket_lock_irqsave(&heap_lock);
+
+    struct free_node *before = NULL;
+    struct free_node *prev = free_list_head;
+    while(prev->next != NULL && prev->next < node) {
+        before = prev;
+        prev = prev->next;
+    }
+
+    struct free_node *next = prev->next;
+    if(next != NULL && get_node_end(node) == (intptr_t) next) {
+        node->size += sizeof(struct free_node) + next->size;
+        next = next->next;
+    }
+
+    if(prev != free_list_head && get_node_end(prev) == (intptr_t) node) {
+        prev->size += sizeof(struct free_node) + node->size;
+        prev->next = next;
+        node = prev;
+        prev = before;
+    } else {
+        node->next = next;
+        prev->next = node;
+    }
+
+    if(next == NULL && get_node_end(node) == (intptr_t) free_list_head) {
+        prev->next = NULL;
+        node->size += sizeof(struct free_node) + free_list_head->size;
+        node->next = free_list_head->next;
+        free_list_head = node;
+    }
+
+    ticket_unlock_irqrestore(&heap_lock, flags);
+}
+
+static void kmalloc_benchmark(void *context) {
+    (void) context;
+    kfree(kmalloc(0x100));
+}
+BENCHMARK("kmalloc_free", kmalloc_benchmark);
+
+// The sizes and order of the old allocation tests in kernel_main, freeing one in the middle
+static void kmalloc_mixed_benchmark(void *context) {
+    (void) context;
+
+    intptr_t a = kmalloc(0x100);
+    intptr_t b = kmalloc(0x200);
+    intptr_t c = kmalloc(0x100);
+    kfree(b);
+    intptr_t d = kmalloc(0x20);
+    intptr_t e = kmalloc(0x40);
+    intptr_t f = kmalloc(0x50);
+
+    kfree(f);
+    kfree(e);
+    kfree(d);
+    kfree(c);
+    kfree(a);
+}
+BENCHMARK("kmalloc_mixed", kmalloc_mixed_benchmark);
+
+// Live allocations don't overlap, and a freed block is handed out again
+static int kmalloc_test(void) {
+    uint8_t *a = (uint8_t*) kmalloc(0x40);
+    uint8_t *b = (uint8_t*) kmalloc(0x40);
+
+    KTEST_EXPECT(a != NULL && b != NULL);
+    KTEST_EXPECT(a + 0x40 <= b || b + 0x40 <= a);
+
+    for(size_t i=0; i<0x40; ++i) {
+        a[i] = 0xaa;
+        b[i] = 0x55;
+    }
+    for(size_t i=0; i<0x40; ++i) {
+        KTEST_EXPECT(a[i] == 0xaa);
+    }
+
+    kfree((intptr_t) b);
+    uint8_t *c = (uint8_t*) kmalloc(0x40);
+    KTEST_EXPECT(c == b);
+
+    kfree((intptr_t) c);
+    kfree((intptr_t) a);
+
+    return 0;
+}
+KTEST("kmalloc", kmalloc_test);
@@ -0,0 +1,61 @@
+#include "ktest.h"
+#include <stdbool.h>
+#include "qemu.h"
+#include "thread.h"
+#include "terminal.h"
+#include "boot_param.h"
+
+// Set by the linker script around the .ktests section
+extern const struct ktest __ktests_start[];
+extern const struct ktest __ktests_end[];
+
+static bool test = false;
+BOOT_PARAM_BOOL("test", test);
+
+static bool test_exit = false;
+BOOT_PARAM_BOOL("test_exit", test_exit);
+
+void ktest_report_failure(const char *file, int line, const char *condition) {
+    terminal_printf("# %s:%d: expected %s\n", file, line, condition);
+}
+
+size_t ktest_run_all(void) {
+    size_t failed = 0;
+    size_t number = 0;
+
+    for(const struct ktest *ktest = __ktests_start; ktest < __ktests_end; ++ktest) {
+        bool passed = ktest->run() == 0;
+
+        terminal_printf("%s %zu - %s\n", passed ? "ok" : "not ok", ++number, ktest->name);
+        failed += !passed;
+    }
+
+    terminal_printf("1..%zu\n", number);
+
+    return failed;
+}
+
+static void test_main(void *arg) {
+    (void) arg;
+
+    size_t failed = ktest_run_all();
+    terminal_printf("Test: %zu failed\n", failed);
+
+    if(test_exit) {
+        qemu_exit(failed == 0 ? 0 : 1);
+    }
+}
+
+void ktest_init(void) {
+    if(!test) {
+        return;
+    }
+
+    if(thread_create_on(0, "test", test_main, NULL) == NULL) {
+        terminal_printf("Test: no thread to run the tests\n");
+
+        if(test_exit) {
+            qemu_exit(1);
+        }
+    }
+}
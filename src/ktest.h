@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* In-kernel tests. A test is a function returning 0 when it passes,
+ * registered with KTEST next to the code it tests, which places a
+ * descriptor in the .ktests section the way BOOT_PARAM does.
+ *
+ * The test boot parameter runs every test in a thread once the kernel is
+ * up and prints the results in TAP:
+ *   ok 1 - kmalloc_reuse
+ *   not ok 2 - boot_time_budget
+ *   1..2
+ * With test_exit QEMU then exits with 0 if every test passed and 1
+ * otherwise, see make test.
+ */
+
+struct ktest {
+    const char *name;
+    int (*run)(void);
+};
+
+#define KTEST(test_name, run_function) \
+    static const struct ktest ktest_##run_function \
+        __attribute__ ((section (".ktests"), used, aligned (8))) = \
+        { .name = test_name, .run = run_function }
+
+// Fails the test, from its own function, if condition is false
+#define KTEST_EXPECT(condition) \
+    do { \
+        if(!(condition)) { \
+            ktest_report_failure(__FILE__, __LINE__, #condition); \
+            return -1; \
+        } \
+    } while(0)
+
+// Prints a TAP diagnostic line for a failed expectation
+void ktest_report_failure(const char *file, int line, const char *condition);
+
+// Runs every registered test from a thread. Returns the number that failed.
+size_t ktest_run_all(void);
+
+// Starts a thread running the tests if the test boot parameter is set. Must run after scheduler_init.
+void ktest_init(void);
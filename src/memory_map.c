@@ -0,0 +1,285 @@
+#include "memory_map.h"
+#include "frame_allocator.h"
+#include "terminal.h"
+
+// Firmware entries and carve outs, before they are resolved into regions
+#define MEMORY_MAP_MAX_INPUTS 128
+
+struct memory_range {
+    uint64_t start;
+    uint64_t end;
+    enum memory_region_type type;
+};
+
+static struct memory_range inputs[MEMORY_MAP_MAX_INPUTS];
+static size_t input_count;
+
+static uint64_t boundaries[2 * MEMORY_MAP_MAX_INPUTS];
+
+static struct memory_region regions[MEMORY_MAP_MAX_REGIONS];
+static size_t region_count;
+
+// Startup IPIs can only start real mode code in the first 1MiB
+static const uint64_t trampoline_limit = 0x100000;
+static uint64_t trampoline_page;
+
+static const char *const region_type_names[] = {
+    [memory_region_usable] = "usable",
+    [memory_region_kernel] = "kernel",
+    [memory_region_boot] = "boot",
+    [memory_region_trampoline] = "trampoline",
+    [memory_region_acpi] = "acpi",
+    [memory_region_acpi_nvs] = "acpi nvs",
+    [memory_region_reserved] = "reserved",
+    [memory_region_defective] = "defective"
+};
+
+static enum memory_region_type firmware_type(uint32_t type) {
+    switch(type) {
+        case multiboot_ram_available:
+            return memory_region_usable;
+        case multiboot_acpi:
+            return memory_region_acpi;
+        case multiboot_preserved_on_hiber:
+            return memory_region_acpi_nvs;
+        case multiboot_defective_ram:
+            return memory_region_defective;
+        default:
+            return memory_region_reserved;
+    }
+}
+
+static inline uint64_t page_down(uint64_t addr) {
+    return addr & ~(uint64_t) (PAGE_SIZE - 1);
+}
+
+static inline uint64_t page_up(uint64_t addr) {
+    return page_down(addr + PAGE_SIZE - 1);
+}
+
+static void add_input(uint64_t start, uint64_t end, enum memory_region_type type) {
+    // never hand out part of a page that isn't usable
+    if(type == memory_region_usable) {
+        start = page_up(start);
+        end = page_down(end);
+    } else {
+        start = page_down(start);
+        end = page_up(end);
+    }
+
+    if(start >= end) {
+        return;
+    }
+
+    if(input_count == MEMORY_MAP_MAX_INPUTS) {
+        terminal_printf("memory map: dropped range %#zx - %#zx\n", start, end);
+        return;
+    }
+
+    inputs[input_count++] = (struct memory_range) { start, end, type };
+}
+
+static void add_firmware_entries(struct multiboot_memory_map *map) {
+    uintptr_t entry_addr = (uintptr_t) map->memory_maps;
+    uintptr_t end_addr = (uintptr_t) map + map->size;
+
+    for(; entry_addr + sizeof(struct multiboot_memory_map_entry) <= end_addr; entry_addr += map->entry_size) {
+        struct multiboot_memory_map_entry *entry = (struct multiboot_memory_map_entry*) entry_addr;
+        if(entry->length == 0) {
+            continue;
+        }
+
+        add_input(entry->base_addr, entry->base_addr + entry->length, firmware_type(entry->type));
+    }
+}
+
+// Sections grub loaded, including the symbol and string tables that aren't allocated
+static void add_kernel_sections(struct multiboot_elf_symbols *symbols) {
+    for(size_t i=0; i<symbols->num; ++i) {
+        struct multiboot_elf_section_header *header = &symbols->sectionheaders[i];
+        if(header->sh_size == 0 || header->sh_addr == 0) {
+            continue;
+        }
+
+        add_input(header->sh_addr, header->sh_addr + header->sh_size, memory_region_kernel);
+    }
+}
+
+static void sort_boundaries(size_t count) {
+    for(size_t i=1; i<count; ++i) {
+        uint64_t value = boundaries[i];
+        size_t j = i;
+
+        for(; j > 0 && boundaries[j-1] > value; --j) {
+            boundaries[j] = boundaries[j-1];
+        }
+        boundaries[j] = value;
+    }
+}
+
+static void append_region(uint64_t start, uint64_t end, enum memory_region_type type) {
+    if(region_count > 0) {
+        struct memory_region *last = &regions[region_count - 1];
+        if(last->end == start && last->type == type) {
+            last->end = end;
+            return;
+        }
+    }
+
+    if(region_count == MEMORY_MAP_MAX_REGIONS) {
+        terminal_printf("memory map: dropped region %#zx - %#zx\n", start, end);
+        return;
+    }
+
+    regions[region_count++] = (struct memory_region) { start, end, type };
+}
+
+/* Every boundary of every input splits the address space into spans that
+ * no input starts or ends inside, so each span takes the strongest type of
+ * the inputs covering it. With at most a few dozen inputs the quadratic
+ * cost is nothing next to the rest of boot.
+ */
+static void resolve_regions(void) {
+    size_t count = 0;
+    for(size_t i=0; i<input_count; ++i) {
+        boundaries[count++] = inputs[i].start;
+        boundaries[count++] = inputs[i].end;
+    }
+
+    sort_boundaries(count);
+
+    for(size_t i=0; i+1<count; ++i) {
+        uint64_t start = boundaries[i];
+        uint64_t end = boundaries[i+1];
+        if(start == end) {
+            continue;
+        }
+
+        bool covered = false;
+        enum memory_region_type type = memory_region_usable;
+
+        for(size_t j=0; j<input_count; ++j) {
+            if(inputs[j].start <= start && inputs[j].end >= end) {
+                if(!covered || inputs[j].type > type) {
+                    type = inputs[j].type;
+                }
+                covered = true;
+            }
+        }
+
+        if(covered) {
+            append_region(start, end, type);
+        }
+    }
+}
+
+/* Takes the first usable page below 1MiB for the AP trampoline before the
+ * frame allocator can hand it out. Page 0 holds the real mode IVT.
+ */
+static void reserve_trampoline_page(void) {
+    trampoline_page = 0;
+
+    const struct memory_region *region = memory_map_next_usable(PAGE_SIZE);
+    if(region == NULL) {
+        return;
+    }
+
+    uint64_t start = region->start > PAGE_SIZE ? region->start : PAGE_SIZE;
+    if(start + PAGE_SIZE > trampoline_limit) {
+        return;
+    }
+
+    trampoline_page = start;
+    add_input(start, start + PAGE_SIZE, memory_region_trampoline);
+
+    region_count = 0;
+    resolve_regions();
+}
+
+void memory_map_init(struct multiboot_data *data) {
+    input_count = 0;
+    region_count = 0;
+
+    add_firmware_entries(data->memory_map);
+    add_kernel_sections(data->elf_symbols);
+
+    add_input((uintptr_t) data->start, (uintptr_t) data->start + data->start->total_size, memory_region_boot);
+
+    for(size_t i=0; i<data->module_count; ++i) {
+        struct multiboot_module *module = data->modules[i];
+        add_input(module->mod_start, module->mod_end, memory_region_boot);
+    }
+
+    resolve_regions();
+    reserve_trampoline_page();
+}
+
+// Returns the index of the first region ending after addr, region_count if none do
+static size_t first_ending_after(uint64_t addr) {
+    size_t low = 0;
+    size_t high = region_count;
+
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if(regions[middle].end <= addr) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+const struct memory_region* memory_map_find(uint64_t addr) {
+    size_t index = first_ending_after(addr);
+
+    if(index == region_count || regions[index].start > addr) {
+        return NULL;
+    }
+
+    return &regions[index];
+}
+
+static const struct memory_region* usable_from(size_t index) {
+    for(; index < region_count; ++index) {
+        if(regions[index].type == memory_region_usable) {
+            return &regions[index];
+        }
+    }
+
+    return NULL;
+}
+
+const struct memory_region* memory_map_next_usable(uint64_t addr) {
+    return usable_from(first_ending_after(addr));
+}
+
+const struct memory_region* memory_map_usable_after(const struct memory_region *region) {
+    return usable_from(region - regions + 1);
+}
+
+size_t memory_map_usable_bytes(void) {
+    size_t bytes = 0;
+
+    for(size_t i=0; i<region_count; ++i) {
+        if(regions[i].type == memory_region_usable) {
+            bytes += regions[i].end - regions[i].start;
+        }
+    }
+
+    return bytes;
+}
+
+uint64_t memory_map_trampoline_page(void) {
+    return trampoline_page;
+}
+
+void memory_map_print(void) {
+    for(size_t i=0; i<region_count; ++i) {
+        terminal_printf("%#zx - %#zx \t %s\n", regions[i].start, regions[i].end, region_type_names[regions[i].type]);
+    }
+
+    terminal_printf("Usable: %#zx bytes\n", memory_map_usable_bytes());
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "multiboot.h"
+
+/* Physical memory as a table of page aligned regions, sorted by address,
+ * non-overlapping, with neighbours of the same type merged. Addresses not
+ * covered by any region are holes in the firmware map.
+ *
+ * Where firmware entries overlap the more restrictive type wins, so later
+ * types in the enum override earlier ones. Usable RAM is shrunk to whole
+ * pages and everything else grown to whole pages. The kernel image, the
+ * multiboot information, the boot modules and a page below 1MiB for the AP
+ * startup trampoline are carved out of usable RAM as their own regions.
+ */
+
+#define MEMORY_MAP_MAX_REGIONS 128
+
+enum memory_region_type {
+    memory_region_usable,
+    memory_region_kernel,
+    // the multiboot information and the modules
+    memory_region_boot,
+    memory_region_trampoline,
+    memory_region_acpi,
+    memory_region_acpi_nvs,
+    memory_region_reserved,
+    memory_region_defective
+};
+
+struct memory_region {
+    uint64_t start;
+    // exclusive
+    uint64_t end;
+    enum memory_region_type type;
+};
+
+// Builds the table, must run before init_allocator
+void memory_map_init(struct multiboot_data *data);
+
+// Returns the region containing addr, or NULL if addr is in a hole
+const struct memory_region* memory_map_find(uint64_t addr);
+
+// Returns the first usable region ending after addr, or NULL if there is none
+const struct memory_region* memory_map_next_usable(uint64_t addr);
+
+// Returns the usable region after region, or NULL if it was the last
+const struct memory_region* memory_map_usable_after(const struct memory_region *region);
+
+size_t memory_map_usable_bytes(void);
+
+// Physical address of the page kept for the AP trampoline, 0 if no usable page is below 1MiB
+uint64_t memory_map_trampoline_page(void);
+
+void memory_map_print(void);
@@ -0,0 +1,78 @@
+#include "module.h"
+#include "paging.h"
+#include "terminal.h"
+
+// After the heap and the thread stacks, each module starts on its own page
+static const uintptr_t module_area_start = 3UL * 4096 * 512 * 512;
+
+static struct module modules[MULTIBOOT_MAX_MODULES];
+static size_t modules_loaded;
+
+static const char* last_word(const char *string) {
+    const char *word = string;
+
+    for(const char *c = string; *c != '\0'; ++c) {
+        if(*c == ' ' && c[1] != ' ' && c[1] != '\0') {
+            word = c + 1;
+        }
+    }
+
+    return word;
+}
+
+static bool names_equal(const char *a, const char *b) {
+    while(*a != '\0' && *a != ' ' && *a == *b) {
+        ++a;
+        ++b;
+    }
+
+    return (*a == '\0' || *a == ' ') && *b == '\0';
+}
+
+void modules_init(struct multiboot_data *data) {
+    uintptr_t next = module_area_start;
+
+    for(size_t i=0; i<data->module_count; ++i) {
+        struct multiboot_module *mb = data->modules[i];
+        if(mb->mod_end <= mb->mod_start) {
+            continue;
+        }
+
+        uintptr_t first = mb->mod_start & ~(uintptr_t) (PAGE_SIZE - 1);
+        uintptr_t base = next;
+
+        for(uintptr_t addr = first; addr < mb->mod_end; addr += PAGE_SIZE) {
+            struct frame frame;
+            struct page page;
+            get_frame_for_addr(&frame, addr);
+            get_page_for_vaddr(next, &page);
+            map_page_to_frame(&page, &frame, present_bit | no_exec_bit, memory_type_write_back);
+            next += PAGE_SIZE;
+        }
+
+        struct module *module = &modules[modules_loaded++];
+        module->name = last_word((const char*) mb->string);
+        module->data = (const uint8_t*) (base + (mb->mod_start - first));
+        module->size = mb->mod_end - mb->mod_start;
+
+        terminal_printf("Module %s: %#zx bytes at %p\n", module->name, module->size, (void*) module->data);
+    }
+}
+
+size_t module_count(void) {
+    return modules_loaded;
+}
+
+const struct module* module_get(size_t index) {
+    return index < modules_loaded ? &modules[index] : NULL;
+}
+
+const struct module* module_find(const char *name) {
+    for(size_t i=0; i<modules_loaded; ++i) {
+        if(names_equal(modules[i].name, name)) {
+            return &modules[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "multiboot.h"
+
+/* Files the boot loader loaded next to the kernel, e.g. an initrd given to
+ * grub with "module2 /boot/initrd.cpio initrd". The frame allocator keeps
+ * their frames, modules_init maps them read only into kernel memory where
+ * they are used in place.
+ */
+
+struct module {
+    // last word of the module's command line, "initrd" in the example
+    const char *name;
+    const uint8_t *data;
+    size_t size;
+};
+
+// Maps every module the multiboot information lists. Must run after remap_kernel.
+void modules_init(struct multiboot_data *data);
+
+size_t module_count(void);
+
+// Returns NULL if index is past the last module
+const struct module* module_get(size_t index);
+
+// Returns NULL if no module has the name
+const struct module* module_find(const char *name);
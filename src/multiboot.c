@@ -54,7 +54,13 @@ void parse_multiboot_data(uintptr_t pstart) {
                 }
                 break;
             case multiboot_modules_tag:
-                terminal_printf("Modules tag\n");
+                {
+                struct multiboot_module *module = (struct multiboot_module*) curr_tag;
+                terminal_printf("Module: %#x - %#x \t %s\n", module->mod_start, module->mod_end, module->string);
+                if(data.module_count < MULTIBOOT_MAX_MODULES) {
+                    data.modules[data.module_count++] = module;
+                }
+                }
                 break;
             case multiboot_elf_symbols_tag:
                 {
@@ -84,7 +90,13 @@ void parse_multiboot_data(uintptr_t pstart) {
                 terminal_printf("VBE info tag\n");
                 break;
             case multiboot_framebuffer_info_tag:
-                terminal_printf("Framebuffer tag\n");
+                {
+                struct multiboot_framebuffer_info *framebuffer = (struct multiboot_framebuffer_info*) curr_tag;
+                data.framebuffer = framebuffer;
+                terminal_printf("Framebuffer addr: %#zx \t %ux%ux%u \t Type: %u\n", framebuffer->framebuffer_addr,
+                    framebuffer->framebuffer_width, framebuffer->framebuffer_height,
+                    framebuffer->framebuffer_bpp, framebuffer->framebuffer_type);
+                }
                 break;
             case multiboot_EFI32_system_table_tag:
                 terminal_printf("EFI32_system_table_tag tag\n");
@@ -129,6 +141,17 @@ void parse_multiboot_data(uintptr_t pstart) {
     print_elf_symbols();
 }
 
+struct multiboot_tag* multiboot_find_tag(uintptr_t pstart, enum multiboot_tags type) {
+    struct multiboot_tag* curr_tag = (struct multiboot_tag*) (pstart + sizeof(struct multiboot_start));
+    do {
+        if(curr_tag->type == type) {
+            return curr_tag;
+        }
+    } while((curr_tag = find_next_tag_address(curr_tag)) != NULL);
+
+    return NULL;
+}
+
 const char *ef_sh_flags_str[] = { "", "W", "A", "X", "M", "S", "IL", "LO", "OS", "G", "T", "MO", "MP", "ORD", "EXC" };
 
 char* get_sh_flag_string(enum ef_sh_flags flag) {
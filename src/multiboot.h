@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
 // multiboot2 header structure
@@ -37,14 +38,18 @@ struct multiboot_boot_command_line {
     uint8_t string[]; //zero terminated utf8 string
 } __attribute__((packed)) __attribute__ ((aligned (8)));
 
+// One tag per module, the addresses are physical and mod_end is exclusive
 struct multiboot_module {
     uint32_t type;
     uint32_t size;
-    uintptr_t mod_start;
-    uintptr_t mod_end;
-    uint8_t string[];
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint8_t string[]; //zero terminated command line given to the module
 } __attribute__((packed)) __attribute__ ((aligned (8)));
 
+// Modules past this are ignored
+#define MULTIBOOT_MAX_MODULES 8
+
 // Elf header info from
 // https://en.wikipedia.org/wiki/Executable_and_Linkable_Format
 enum elf_sh_type {
@@ -173,7 +178,7 @@ struct multiboot_framebuffer_palette {
 } __attribute__((packed));
 
 struct multiboot_color_type_indexed {
-    uint32_t number_of_colors;
+    uint16_t number_of_colors;
     struct multiboot_framebuffer_palette palette[];
 } __attribute__((packed));
 
@@ -184,7 +189,13 @@ struct multiboot_color_type_direct_rgb {
     uint8_t green_mask_size;
     uint8_t blue_field_position;
     uint8_t blue_mask_size;
-} __attribute__((packed)) __attribute__ ((aligned (8)));
+} __attribute__((packed));
+
+enum multiboot_framebuffer_type {
+    multiboot_framebuffer_indexed = 0,
+    multiboot_framebuffer_direct_rgb = 1,
+    multiboot_framebuffer_ega_text = 2
+};
 
 struct multiboot_framebuffer_info {
     uint32_t type;
@@ -195,9 +206,9 @@ struct multiboot_framebuffer_info {
     uint32_t framebuffer_height;
     uint8_t framebuffer_bpp;
     uint8_t framebuffer_type;
-    uint8_t reserved;
-    uint8_t* color_info; //either a color_type_indexed or color_type_direct
-                         //TODO: 2017/01/17 fix this to correct change the color info;
+    uint16_t reserved;
+    // a multiboot_color_type_indexed or multiboot_color_type_direct_rgb, depending on framebuffer_type
+    uint8_t color_info[];
 } __attribute__((packed)) __attribute__ ((aligned (8)));
 
 struct multiboot_boot_load_name {
@@ -215,6 +226,9 @@ struct multiboot_data {
     struct multiboot_start *start;
     struct multiboot_memory_map *memory_map;
     struct multiboot_elf_symbols *elf_symbols;
+    struct multiboot_framebuffer_info *framebuffer;
+    struct multiboot_module *modules[MULTIBOOT_MAX_MODULES];
+    size_t module_count;
 };
 
 struct multiboot_data data;
@@ -247,3 +261,6 @@ enum multiboot_tags {
     multiboot_EFI64_image_ptr_tag = 20,
     multiboot_image_load_base_phys_addr_tag = 21
 };
+
+// Returns the first tag of the type in the multiboot information at pstart, or NULL
+struct multiboot_tag* multiboot_find_tag(uintptr_t pstart, enum multiboot_tags type);
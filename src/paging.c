@@ -1,7 +1,15 @@
 #include "paging.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "klog.h"
+#include "benchmark.h"
+#include "ktest.h"
 
 const struct page_table* p4_table = 0xfffffffffffff000;
 
+// Serialises changes to the active page tables
+static struct ticket_lock paging_lock = TICKET_LOCK_INIT;
+
 static int64_t read_tlb() {
     int64_t val;
     asm volatile ("mov %%cr3, %0" : "=r"(val));
@@ -301,29 +309,35 @@ struct page_table* get_next_page_table_or_create(struct page_table* table, uint1
     return descened_page_table(table, index);
 }
 
-void map_page_to_frame(struct page *page, struct frame *frame, uintptr_t flags) {
+void map_page_to_frame(struct page *page, struct frame *frame, uintptr_t flags, enum memory_type type) {
+    uint64_t irq_flags = ticket_lock_irqsave(&paging_lock);
+
     struct page_table* p3_table = get_next_page_table_or_create(p4_table, get_p4_index(page));
     struct page_table* p2_table = get_next_page_table_or_create(p3_table, get_p3_index(page));
     struct page_table* p1_table = get_next_page_table_or_create(p2_table, get_p2_index(page));
 
     //make sure unused here!
 
-    set_page_table_entry(&p1_table->entries[get_p1_index(page)], frame, present_bit | flags);
+    set_page_table_entry(&p1_table->entries[get_p1_index(page)], frame, present_bit | flags | memory_type_flags(type));
+
+    ticket_unlock_irqrestore(&paging_lock, irq_flags);
 }
 
 void map_page(struct page *page, uintptr_t flags) {
     struct frame frame;
     int success = allocate_frame(&frame);
-    map_page_to_frame(page, &frame, flags);
+    map_page_to_frame(page, &frame, flags, memory_type_write_back);
 }
 
-void identity_map_page(struct frame *frame, uintptr_t flags) {
+void identity_map_page(struct frame *frame, uintptr_t flags, enum memory_type type) {
     struct page p;
     get_page_for_vaddr(get_frame_start_addr(frame), &p);
-    map_page_to_frame(&p, frame, flags);
+    map_page_to_frame(&p, frame, flags, type);
 }
 
 void unmap_page(struct page *page) {
+    uint64_t irq_flags = ticket_lock_irqsave(&paging_lock);
+
     struct page_table* table = p4_table;
 
     table = descened_page_table(table, get_p4_index(page));
@@ -337,12 +351,149 @@ void unmap_page(struct page *page) {
     deallocate_frame(&frame);
 
     flush_tlb();
+
+    ticket_unlock_irqrestore(&paging_lock, irq_flags);
 }
 
 static intptr_t get_p4_table_phys_addr() {
     return read_tlb();
 }
 
+/* PAT entries, entry i is used by page table entries with
+ * pat << 2 | cache disable << 1 | write through == i. The first four match
+ * the power on values so entries without the pat bit mean the same thing
+ * on a cpu that hasn't run pat_init yet.
+ */
+enum pat_types {
+    pat_uncached = 0x0,
+    pat_write_combining = 0x1,
+    pat_write_through = 0x4,
+    pat_write_back = 0x6,
+    pat_uncached_minus = 0x7
+};
+
+#define PAT_ENTRY(index, type) ((uint64_t) (type) << (8 * (index)))
+
+static const uint64_t kernel_pat =
+    PAT_ENTRY(0, pat_write_back) | PAT_ENTRY(1, pat_write_through)
+    | PAT_ENTRY(2, pat_uncached_minus) | PAT_ENTRY(3, pat_uncached)
+    | PAT_ENTRY(4, pat_write_back) | PAT_ENTRY(5, pat_write_through)
+    | PAT_ENTRY(6, pat_write_combining) | PAT_ENTRY(7, pat_uncached);
+
+static const uint32_t cpuid_edx_pat = 1 << 16;
+
+static bool pat_supported;
+
+void pat_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+
+    if(!(d & cpuid_edx_pat)) {
+        return;
+    }
+
+    write_msr(msr_pat, kernel_pat);
+
+    // nothing was mapped with the new entries yet, dropping cached translations is enough
+    asm volatile("wbinvd" ::: "memory");
+    flush_tlb();
+
+    pat_supported = true;
+}
+
+uintptr_t memory_type_flags(enum memory_type type) {
+    switch(type) {
+        case memory_type_write_through:
+            return write_through_cache_bit;
+        case memory_type_uncached:
+            return write_through_cache_bit | disable_cache_bit;
+        case memory_type_write_combining:
+            if(pat_supported) {
+                return pat_bit | disable_cache_bit;
+            }
+            return write_through_cache_bit | disable_cache_bit;
+        case memory_type_write_back:
+        default:
+            return 0;
+    }
+}
+
+static const uintptr_t memory_type_mask = pat_bit | disable_cache_bit | write_through_cache_bit;
+
+// Returns NULL if any level on the way isn't present
+static struct page_table_entry* find_page_table_entry(struct page *page) {
+    struct page_table *table = descened_page_table((struct page_table*) p4_table, get_p4_index(page));
+
+    if(table != NULL) {
+        table = descened_page_table(table, get_p3_index(page));
+    }
+
+    if(table != NULL) {
+        table = descened_page_table(table, get_p2_index(page));
+    }
+
+    if(table == NULL || !(table->entries[get_p1_index(page)].entry & present_bit)) {
+        return NULL;
+    }
+
+    return &table->entries[get_p1_index(page)];
+}
+
+bool is_mapped(virtual_addr_t vaddr) {
+    if(vaddr >= 0x0000800000000000 && vaddr < 0xffff800000000000) {
+        return false;
+    }
+
+    struct page page;
+    get_page_for_vaddr(vaddr, &page);
+
+    const uint16_t indices[] = { get_p4_index(&page), get_p3_index(&page), get_p2_index(&page) };
+    struct page_table *table = (struct page_table*) p4_table;
+
+    for(size_t level=0; level<3; ++level) {
+        uintptr_t entry = table->entries[indices[level]].entry;
+
+        if(!(entry & present_bit)) {
+            return false;
+        }
+
+        // a 1GiB or 2MiB page, there is no table below
+        if(level > 0 && (entry & huge_bit)) {
+            return true;
+        }
+
+        table = descened_page_table(table, indices[level]);
+    }
+
+    return table->entries[get_p1_index(&page)].entry & present_bit;
+}
+
+int set_memory_type(virtual_addr_t addr, size_t size, enum memory_type type) {
+    uint64_t irq_flags = ticket_lock_irqsave(&paging_lock);
+    int ret = 0;
+
+    for(virtual_addr_t vaddr = addr & ~(virtual_addr_t) (PAGE_SIZE - 1); vaddr < addr + size; vaddr += PAGE_SIZE) {
+        struct page page;
+        get_page_for_vaddr(vaddr, &page);
+
+        struct page_table_entry *entry = find_page_table_entry(&page);
+        if(entry == NULL) {
+            ret = -1;
+            break;
+        }
+
+        entry->entry = (entry->entry & ~memory_type_mask) | memory_type_flags(type);
+        invalidate_page(vaddr);
+    }
+
+    // lines cached under the old type must not be written back later
+    asm volatile("wbinvd" ::: "memory");
+
+    ticket_unlock_irqrestore(&paging_lock, irq_flags);
+
+    return ret;
+}
+
 void remap_kernel() {
     enable_no_exec();
     //enable_write_protect(); //currently breaks as it makes stack unwritable
@@ -352,28 +503,28 @@ void remap_kernel() {
     struct frame new_p4_frame;
     int success = allocate_frame(&new_p4_frame);
 
-    map_page_to_frame(&page, &new_p4_frame, present_bit | writeable_bit);
+    map_page_to_frame(&page, &new_p4_frame, present_bit | writeable_bit, memory_type_write_back);
 
     struct page old_p4_page;
     old_p4_page.number = 0xdddd0000;
     struct frame old_p4_frame;
     get_frame_for_addr(&old_p4_frame, (uintptr_t)read_tlb());
-    terminal_printf("Old page addr: %#zx\n", old_p4_frame.number);
-    map_page_to_frame(&old_p4_page, &old_p4_frame, present_bit | writeable_bit);    
+    klog_debug("Old page addr: %#zx\n", old_p4_frame.number);
+    map_page_to_frame(&old_p4_page, &old_p4_frame, present_bit | writeable_bit, memory_type_write_back);    
     flush_tlb();
 
     struct page_table *old_p4_table = old_p4_page.number * PAGE_SIZE;
     init_page_table(page.number*PAGE_SIZE);
 
-    terminal_printf("CR3 = %#zx\n", read_tlb());
-    terminal_printf("Old p4 entry[511] %#zX\n", p4_table->entries[511]);
-    terminal_printf("Old p4 entry[511] %#zX\n", old_p4_table->entries[511]);
-    terminal_printf("New p4 frame addr %#zX\n", get_frame_start_addr(&new_p4_frame));
+    klog_debug("CR3 = %#zx\n", read_tlb());
+    klog_debug("Old p4 entry[511] %#zX\n", p4_table->entries[511].entry);
+    klog_debug("Old p4 entry[511] %#zX\n", old_p4_table->entries[511].entry);
+    klog_debug("New p4 frame addr %#zX\n", get_frame_start_addr(&new_p4_frame));
 
     set_page_table_entry(page.number*PAGE_SIZE + (8 * 511), &new_p4_frame, present_bit | writeable_bit);
 
     set_page_table_entry(&p4_table->entries[511], &new_p4_frame, present_bit | writeable_bit);
-    terminal_printf("new p4 entry[511] %#zX\n", p4_table->entries[511]);
+    klog_debug("new p4 entry[511] %#zX\n", p4_table->entries[511].entry);
     flush_tlb();
 
     for(int i=0; i<data.elf_symbols->num; ++i) {
@@ -399,34 +550,36 @@ void remap_kernel() {
             flags |= writeable_bit;
         }
 
-        terminal_printf("Addr: %#zx\tFlags : %#zX\n", addr, flags);
+        klog_debug("Addr: %#zx\tFlags : %#zX\n", addr, flags);
 
         while(addr < end_addr) {
             struct frame frame;
             get_frame_for_addr(&frame, addr);
             addr += PAGE_SIZE;
-            identity_map_page(&frame, flags);
+            identity_map_page(&frame, flags, memory_type_write_back);
         }
     }
 
-    //id map the vga buffer
-    struct frame vga_frame;
-    get_frame_for_addr(&vga_frame, 0xb8000);
-    identity_map_page(&vga_frame, writeable_bit | present_bit | no_exec_bit);
+    //id map the vga text window, the screen is only ever written
+    for(uintptr_t vga_addr = VGA_TEXT_START; vga_addr < VGA_TEXT_END; vga_addr += PAGE_SIZE) {
+        struct frame vga_frame;
+        get_frame_for_addr(&vga_frame, vga_addr);
+        identity_map_page(&vga_frame, writeable_bit | present_bit | no_exec_bit, memory_type_write_combining);
+    }
 
     //id map the multiboot structure
     for(intptr_t mboot_addr = (intptr_t)data.start; mboot_addr <= data.start + data.start->total_size; mboot_addr += PAGE_SIZE) {
         struct frame mboot_frame;
         get_frame_for_addr(&mboot_frame, mboot_addr);
-        identity_map_page(&mboot_frame, present_bit | no_exec_bit);
+        identity_map_page(&mboot_frame, present_bit | no_exec_bit, memory_type_write_back);
     }
 
-    terminal_printf("New kernel page tables set up.\n");
+    klog_debug("New kernel page tables set up.\n");
 
     //restore old p4
     set_page_table_entry(&old_p4_table->entries[511], &old_p4_frame, present_bit | writeable_bit);
     flush_tlb();
-    terminal_printf("Old p4 entry[511] %#zX\n", p4_table->entries[511]);
+    klog_debug("Old p4 entry[511] %#zX\n", p4_table->entries[511].entry);
 
     unmap_page(&old_p4_page);
 
@@ -438,7 +591,7 @@ void remap_kernel() {
     guard_page.number = old_p4_frame.number;
     unmap_page(&guard_page);
 
-    terminal_printf("End of remap.\n");
+    klog_debug("End of remap.\n");
 }
 
 /* From http://git.qemu.org/?p=qemu.git;a=blob;f=target/i386/monitor.c
@@ -455,4 +608,47 @@ void remap_kernel() {
   57                    pte & PG_PWT_MASK ? 'T' : '-',
   58                    pte & PG_USER_MASK ? 'U' : '-',
   59                    pte & PG_RW_MASK ? 'W' : '-');
-  */
\ No newline at end of file
+  */
+
+// Its own 1G after the heap, thread stacks, modules and symbols, see thread.c, module.c and symbols.c
+static const virtual_addr_t benchmark_page_addr = 5UL * 512 * 512 * PAGE_SIZE;
+static struct frame benchmark_frame;
+
+static int map_benchmark_setup(void **context) {
+    *context = &benchmark_frame;
+    return allocate_frame(&benchmark_frame);
+}
+
+// Includes the whole TLB flush unmap_page does
+static void map_benchmark(void *context) {
+    struct page page;
+    get_page_for_vaddr(benchmark_page_addr, &page);
+
+    map_page_to_frame(&page, context, writeable_bit, memory_type_write_back);
+    unmap_page(&page);
+}
+BENCHMARK_WITH_SETUP("page_map_unmap", map_benchmark, map_benchmark_setup, NULL);
+
+// Maps the benchmark page, writes through it and unmaps it again
+static int map_test(void) {
+    struct frame frame;
+    struct page page;
+    get_page_for_vaddr(benchmark_page_addr, &page);
+
+    KTEST_EXPECT(!is_mapped(benchmark_page_addr));
+    KTEST_EXPECT(allocate_frame(&frame) == 0);
+
+    map_page_to_frame(&page, &frame, writeable_bit, memory_type_write_back);
+    KTEST_EXPECT(is_mapped(benchmark_page_addr));
+
+    volatile uint64_t *data = (volatile uint64_t*) benchmark_page_addr;
+    data[0] = 0x1234;
+    data[PAGE_SIZE / sizeof(uint64_t) - 1] = 0x5678;
+    KTEST_EXPECT(data[0] == 0x1234 && data[PAGE_SIZE / sizeof(uint64_t) - 1] == 0x5678);
+
+    unmap_page(&page);
+    KTEST_EXPECT(!is_mapped(benchmark_page_addr));
+
+    return 0;
+}
+KTEST("page_map_unmap", map_test);
@@ -15,6 +15,7 @@ enum paging_masks {
     accessed_bit = 0x20,
     dirty_bit = 0x40,
     huge_bit = 0x80,
+    pat_bit = 0x80, // in a 4KiB page table entry
     global_bit = 0x100,
     available_mask = 0xe,
     physical_addr_mask = 0x000ffffffffff000,
@@ -22,9 +23,23 @@ enum paging_masks {
     no_exec_bit = 0x8000000000000000
 };
 
+/* Caching of a mapping. Each type has its own PAT entry, picked by the
+ * pat, cache disable and write through bits of the page table entry.
+ */
+enum memory_type {
+    memory_type_write_back,
+    memory_type_write_through,
+    memory_type_uncached,
+    memory_type_write_combining
+};
+
 #define PAGE_TABLE_ENTRY_COUNT 512
 #define RECURSIVE_PAGE_TABLE_INDEX 511
 
+// Text mode memory, the first page is the visible screen
+#define VGA_TEXT_START 0xB8000
+#define VGA_TEXT_END 0xC0000
+
 typedef uintptr_t virtual_addr_t;
 typedef uintptr_t physical_addr_t;
 
@@ -42,6 +57,30 @@ struct page_table {
 
 void remap_kernel(void);
 
+/* Loads the kernel's PAT. Every cpu must run it before using mappings
+ * that aren't write back. Without PAT support write combining falls back
+ * to uncached.
+ */
+void pat_init(void);
+
+// Page table entry bits that select the memory type
+uintptr_t memory_type_flags(enum memory_type type);
+
 void get_page_for_vaddr(virtual_addr_t vaddr, struct page* p);
+
+// Maps fresh memory, always write back
 void map_page(struct page *page, uintptr_t flags);
-void unmap_page(struct page *page);
\ No newline at end of file
+
+void map_page_to_frame(struct page *page, struct frame *frame, uintptr_t flags, enum memory_type type);
+void identity_map_page(struct frame *frame, uintptr_t flags, enum memory_type type);
+void unmap_page(struct page *page);
+
+/* Returns true if reading vaddr won't fault. Takes no locks so it can run
+ * in fault handlers, a concurrent unmap can still race with the caller.
+ */
+bool is_mapped(virtual_addr_t vaddr);
+
+/* Changes the memory type of mapped pages in [addr, addr + size).
+ * Returns 0 on success. Non-zero if a page isn't mapped.
+ */
+int set_memory_type(virtual_addr_t addr, size_t size, enum memory_type type);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "pic.h"
+#include "rcu.h"
 
 // Following addresses contains information on how to program the 8259 PIC
 // http://stanislavs.org/helppc/8259.html
@@ -95,8 +96,21 @@ void pic_init(uint8_t master_remap_offset, uint8_t slave_remap_offset) {
 
 }
 
+// Indexed by vector, called through by the shims in boot64.s
+extern intptr_t interrupt_functions[256];
+
 void add_interrupt_handler(uint16_t interrupt, intptr_t handler) {
-    asm_add_interrupt_handler(interrupt, handler);
+    rcu_assign_pointer(interrupt_functions[interrupt], handler);
+}
+
+intptr_t replace_interrupt_handler(uint16_t interrupt, intptr_t handler) {
+    intptr_t old = __atomic_exchange_n(&interrupt_functions[interrupt], handler, __ATOMIC_ACQ_REL);
+
+    // interrupt handlers are read-side sections, once every cpu has been
+    // quiescent none of them can still be running the old one
+    synchronize_rcu();
+
+    return old;
 }
 
 void pic_write_EOI(uint8_t irq) {
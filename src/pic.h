@@ -2,9 +2,31 @@
 #include <stdint.h>
 #include "util.h"
 
+/* What the cpu pushes on an interrupt without an error code. The shims in
+ * boot64.s pass handlers a pointer to it and the interrupted rbp:
+ * int handler(struct interrupt_frame *frame, uintptr_t rbp)
+ * A handler returns 1 if the cpu pushed an error code that must be popped.
+ */
+struct interrupt_frame {
+    uintptr_t instruction_ptr;
+    uintptr_t code_segement;
+    uintptr_t flags;
+    uintptr_t stack_ptr;
+    uintptr_t stack_segement;
+};
+
 void add_interrupt_handler(uint16_t interrupt, intptr_t handler);
 
+/* Swaps the handler and waits until no cpu can still be executing the old one.
+ * Returns the old handler. Must be called from a thread.
+ */
+intptr_t replace_interrupt_handler(uint16_t interrupt, intptr_t handler);
+
 void pic_init(uint8_t master_remap_offset, uint8_t slave_remap_offset);
 
+// Masking stops the pic from raising the irq line's vector
+void irq_set_mask(uint8_t irq_line);
+void irq_clear_mask(uint8_t irq_line);
+
 void pic_enable_interrupts(void);
 void pic_disable_interrupts(void);
\ No newline at end of file
@@ -1,19 +1,44 @@
 #include "pit.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "terminal.h"
+#include "klog.h"
+#include "keyboard.h"
+#include "boot_param.h"
+#include "profiler.h"
 
 const uint8_t pit_channel0_data_port = 0x40;
 const uint8_t pit_channel1_data_port = 0x41;
 const uint8_t pit_channel2_data_port = 0x42;
 const uint8_t pit_command_register_port = 0x43;
 
+static const uint32_t pit_base_frequency = 1193182;
+
+enum pit_command {
+    pit_select_channel0 = 0x00,
+    pit_access_low_high = 0x30,
+    pit_mode_square_wave = 0x06
+};
+
 typedef uint8_t pit_cmd_word_t;
 
+static volatile uint64_t pit_ticks;
+static uint32_t pit_frequency;
+
+// Timer ticks the TSC is counted over by pit_tsc_frequency
+static const uint64_t tsc_calibration_ticks = 10;
+
+// The divider is 16 bits, so the slowest rate is just over 18Hz
+static int64_t timer_hz = PIT_DEFAULT_HZ;
+BOOT_PARAM_INT("timer_hz", timer_hz, 19, 10000);
+
 static uint8_t pit_read_cmd_word(void) {
     return inb(pit_command_register_port);
 }
 
 static void pit_write_cmd_word(uint8_t port, uint16_t word) {
-    outb(port, word & 0xf);
-    outb(port, (word & 0xf0) >> 8);
+    outb(port, word & 0xff);
+    outb(port, (word >> 8) & 0xff);
 }
 
 static void pit_write_cmd_byte(uint8_t port, uint8_t byte) {
@@ -21,5 +46,47 @@ static void pit_write_cmd_byte(uint8_t port, uint8_t byte) {
 }
 
 void pit_set_pit0_freq(uint16_t new_divider) {
+    pit_write_cmd_byte(pit_command_register_port, pit_select_channel0 | pit_access_low_high | pit_mode_square_wave);
     pit_write_cmd_word(pit_channel0_data_port, new_divider);
-}
\ No newline at end of file
+}
+
+void pit_init(void) {
+    pit_frequency = timer_hz;
+    pit_set_pit0_freq(pit_base_frequency / pit_frequency);
+}
+
+int pit_timer_interrupt(struct interrupt_frame *frame, uintptr_t rbp) {
+    ++pit_ticks;
+    profiler_tick(frame, rbp);
+    terminal_timer_flush();
+    klog_tick();
+    keyboard_tick();
+    scheduler_tick();
+
+    return 0;
+}
+
+uint64_t pit_get_ticks(void) {
+    return pit_ticks;
+}
+
+uint32_t pit_get_frequency(void) {
+    return pit_frequency;
+}
+
+uint64_t pit_tsc_frequency(void) {
+    // start on a tick edge
+    uint64_t tick = pit_get_ticks();
+    while(pit_get_ticks() == tick) {
+        cpu_relax();
+    }
+
+    uint64_t start = read_tsc();
+
+    tick = pit_get_ticks();
+    while(pit_get_ticks() - tick < tsc_calibration_ticks) {
+        cpu_relax();
+    }
+
+    return (read_tsc() - start) * pit_frequency / tsc_calibration_ticks;
+}
@@ -1,6 +1,19 @@
 #pragma once
 
 #include "util.h"
+#include "pic.h"
 #include <stdint.h>
 
-void pit_set_pit0_freq(uint16_t new_divider);
\ No newline at end of file
+#define PIT_DEFAULT_HZ 100
+
+void pit_set_pit0_freq(uint16_t new_divider);
+
+// Runs channel 0 at the timer_hz boot parameter, PIT_DEFAULT_HZ unless set
+void pit_init(void);
+int pit_timer_interrupt(struct interrupt_frame *frame, uintptr_t rbp);
+
+uint64_t pit_get_ticks(void);
+uint32_t pit_get_frequency(void);
+
+// TSC cycles per second, counted over ten timer ticks. Interrupts must be enabled.
+uint64_t pit_tsc_frequency(void);
@@ -0,0 +1,351 @@
+#include "pmu.h"
+#include "cpu.h"
+#include "apic.h"
+#include "terminal.h"
+#include "thread.h"
+
+// IA32_PERFEVTSELx, Intel SDM Vol. 3B 18.2.1.1
+enum perfevtsel_bits {
+    perfevtsel_usr = 1 << 16,
+    perfevtsel_os = 1 << 17,
+    perfevtsel_int = 1 << 20,
+    perfevtsel_enable = 1 << 22
+};
+
+// IA32_FIXED_CTR_CTRL has 4 bits per counter
+enum fixed_ctr_ctrl_bits {
+    fixed_ctr_os = 1 << 0,
+    fixed_ctr_usr = 1 << 1
+};
+
+// rdpmc reads fixed counters with this bit set in ecx
+static const uint32_t rdpmc_fixed = 1U << 30;
+
+// Global control and status hold the fixed counters from this bit
+static const unsigned global_fixed_shift = 32;
+
+static const uint64_t pmu_max_period = 0x7fffffff;
+
+struct pmu_event_encoding {
+    // event select | umask << 8
+    uint16_t encoding;
+    // its bit in CPUID.0AH:EBX
+    uint32_t unavailable_bit;
+    // the fixed counter that counts it, -1 if none does
+    int fixed_counter;
+};
+
+static const struct pmu_event_encoding event_encodings[PMU_EVENT_COUNT] = {
+    [pmu_event_cycles] = { 0x003c, 1 << 0, 1 },
+    [pmu_event_instructions] = { 0x00c0, 1 << 1, 0 },
+    [pmu_event_llc_misses] = { 0x412e, 1 << 4, -1 },
+    [pmu_event_branch_misses] = { 0x00c5, 1 << 6, -1 }
+};
+
+static const char *const event_names[PMU_EVENT_COUNT] = {
+    [pmu_event_cycles] = "cycles",
+    [pmu_event_instructions] = "instructions",
+    [pmu_event_llc_misses] = "llc misses",
+    [pmu_event_branch_misses] = "branch misses"
+};
+
+struct pmu_assignment {
+    bool present;
+    bool fixed;
+    uint8_t counter;
+    uint64_t mask;
+};
+
+static struct pmu_info info;
+static struct pmu_assignment assignments[PMU_EVENT_COUNT];
+static uint64_t sample_period;
+
+static inline uint64_t width_mask(uint8_t width) {
+    return width >= 64 ? UINT64_MAX : (1ULL << width) - 1;
+}
+
+static inline uint64_t rdpmc(uint32_t counter) {
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+    return ((uint64_t) high << 32) | low;
+}
+
+static inline uint8_t sample_counter(void) {
+    return info.counters - 1;
+}
+
+static void assign_counters(void) {
+    // the last general purpose counter is the profiler's
+    uint8_t next_counter = 0;
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        const struct pmu_event_encoding *event = &event_encodings[i];
+        struct pmu_assignment *assignment = &assignments[i];
+
+        if(event->fixed_counter >= 0 && event->fixed_counter < info.fixed_counters) {
+            *assignment = (struct pmu_assignment) { true, true, event->fixed_counter, width_mask(info.fixed_counter_width) };
+        } else if(!(info.unavailable_events & event->unavailable_bit) && next_counter + 1 < info.counters) {
+            *assignment = (struct pmu_assignment) { true, false, next_counter++, width_mask(info.counter_width) };
+        }
+    }
+}
+
+void pmu_init(void) {
+    uint32_t a, b, c, d;
+
+    cpuid(0, &a, &b, &c, &d);
+    if(a < 0xa) {
+        return;
+    }
+
+    cpuid(0xa, &a, &b, &c, &d);
+
+    info.version = a & 0xff;
+    info.counters = (a >> 8) & 0xff;
+    info.counter_width = (a >> 16) & 0xff;
+
+    // events past the length of the bit vector aren't there either
+    uint8_t events = (a >> 24) & 0xff;
+    info.unavailable_events = b | (events < 32 ? ~0U << events : 0);
+
+    if(info.version >= 2) {
+        info.fixed_counters = d & 0x1f;
+        info.fixed_counter_width = (d >> 5) & 0xff;
+    }
+
+    if(info.version > 0) {
+        assign_counters();
+    }
+}
+
+void pmu_cpu_init(void) {
+    uint64_t global = 0;
+    uint64_t fixed_ctrl = 0;
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        const struct pmu_assignment *assignment = &assignments[i];
+        if(!assignment->present) {
+            continue;
+        }
+
+        if(assignment->fixed) {
+            write_msr(msr_fixed_ctr0 + assignment->counter, 0);
+            fixed_ctrl |= (uint64_t) (fixed_ctr_os | fixed_ctr_usr) << (4 * assignment->counter);
+            global |= 1ULL << (global_fixed_shift + assignment->counter);
+        } else {
+            write_msr(msr_perfevtsel0 + assignment->counter, 0);
+            write_msr(msr_pmc0 + assignment->counter, 0);
+            write_msr(msr_perfevtsel0 + assignment->counter,
+                event_encodings[i].encoding | perfevtsel_os | perfevtsel_usr | perfevtsel_enable);
+            global |= 1ULL << assignment->counter;
+        }
+    }
+
+    // version 1 has no global control, the enable bits alone start the counters
+    if(info.version >= 2) {
+        write_msr(msr_fixed_ctr_ctrl, fixed_ctrl);
+        write_msr(msr_perf_global_ctrl, read_msr(msr_perf_global_ctrl) | global);
+    }
+}
+
+const struct pmu_info* pmu_get_info(void) {
+    return &info;
+}
+
+bool pmu_present(void) {
+    return info.version > 0 && info.counters > 0 && !(info.unavailable_events & event_encodings[pmu_event_cycles].unavailable_bit);
+}
+
+void pmu_read(struct pmu_counts *counts) {
+    counts->tsc = read_tsc();
+    counts->valid = 0;
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        const struct pmu_assignment *assignment = &assignments[i];
+
+        if(assignment->present) {
+            counts->events[i] = rdpmc(assignment->fixed ? rdpmc_fixed | assignment->counter : assignment->counter);
+            counts->valid |= 1U << i;
+        } else {
+            counts->events[i] = 0;
+        }
+    }
+}
+
+// Counters wrap at their width
+static inline uint64_t counter_delta(size_t event, uint64_t now, uint64_t then) {
+    return (now - then) & assignments[event].mask;
+}
+
+void pmu_switch_out(struct pmu_thread_state *state) {
+    if(!state->counting) {
+        return;
+    }
+
+    struct pmu_counts now;
+    pmu_read(&now);
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        state->total[i] += counter_delta(i, now.events[i], state->base[i]);
+    }
+}
+
+void pmu_switch_in(struct pmu_thread_state *state) {
+    if(!state->counting) {
+        return;
+    }
+
+    struct pmu_counts now;
+    pmu_read(&now);
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        state->base[i] = now.events[i];
+    }
+}
+
+static struct pmu_thread_state* current_state(void) {
+    struct thread *thread = thread_current();
+    return thread != NULL ? &thread->pmu : NULL;
+}
+
+void pmu_thread_start(void) {
+    uint64_t flags = irq_save();
+    struct pmu_thread_state *state = current_state();
+
+    if(state != NULL && !state->counting) {
+        for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+            state->total[i] = 0;
+        }
+
+        state->counting = true;
+        pmu_switch_in(state);
+    }
+
+    irq_restore(flags);
+}
+
+void pmu_thread_read(struct pmu_counts *counts) {
+    // not switched out halfway through
+    uint64_t flags = irq_save();
+    struct pmu_thread_state *state = current_state();
+
+    pmu_read(counts);
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        // before the scheduler runs the boot code counts as one thread
+        if(state != NULL && state->counting) {
+            counts->events[i] = state->total[i] + counter_delta(i, counts->events[i], state->base[i]);
+        }
+    }
+
+    irq_restore(flags);
+}
+
+void pmu_region_begin(struct pmu_region *region) {
+    pmu_thread_start();
+    pmu_thread_read(&region->start);
+}
+
+void pmu_region_end(const struct pmu_region *region, struct pmu_counts *counts) {
+    pmu_thread_read(counts);
+
+    counts->tsc -= region->start.tsc;
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        counts->events[i] = counter_delta(i, counts->events[i], region->start.events[i]);
+    }
+}
+
+void pmu_print_counts(const char *name, const struct pmu_counts *counts, uint64_t operations) {
+    uint64_t ops = operations != 0 ? operations : 1;
+
+    terminal_printf("%s: %zu ops, %zu tsc/op", name, operations, counts->tsc / ops);
+
+    uint64_t cycles = counts->events[pmu_event_cycles];
+    uint64_t instructions = counts->events[pmu_event_instructions];
+    uint32_t both = (1U << pmu_event_cycles) | (1U << pmu_event_instructions);
+
+    if((counts->valid & both) == both && cycles != 0) {
+        uint64_t ipc = instructions * 100 / cycles;
+        terminal_printf(", %zu cycles/op, ipc %zu.%02zu", cycles / ops, ipc / 100, ipc % 100);
+    }
+
+    // misses are rare enough to need more than whole numbers per op
+    for(size_t i=pmu_event_llc_misses; i<PMU_EVENT_COUNT; ++i) {
+        if(counts->valid & (1U << i)) {
+            terminal_printf(", %zu %s/1k ops", counts->events[i] * 1000 / ops, event_names[i]);
+        }
+    }
+
+    terminal_printf("\n");
+}
+
+// Counts up from -period so it overflows after period events
+static void load_sample_counter(void) {
+    // only the low 32 bits are written, sign extended to the counter width
+    write_msr(msr_pmc0 + sample_counter(), -(int64_t) sample_period);
+}
+
+int pmu_sample_start(uint64_t period) {
+    if(!pmu_present()) {
+        return -1;
+    }
+
+    sample_period = period == 0 ? 1 : (period > pmu_max_period ? pmu_max_period : period);
+
+    write_msr(msr_perfevtsel0 + sample_counter(), 0);
+    load_sample_counter();
+    lapic_perfmon_unmask();
+
+    if(info.version >= 2) {
+        write_msr(msr_perf_global_ctrl, read_msr(msr_perf_global_ctrl) | (1ULL << sample_counter()));
+    }
+
+    write_msr(msr_perfevtsel0 + sample_counter(),
+        event_encodings[pmu_event_cycles].encoding | perfevtsel_os | perfevtsel_usr | perfevtsel_int | perfevtsel_enable);
+
+    return 0;
+}
+
+void pmu_sample_rearm(void) {
+    load_sample_counter();
+
+    if(info.version >= 2) {
+        write_msr(msr_perf_global_ovf_ctrl, 1ULL << sample_counter());
+    }
+
+    lapic_perfmon_unmask();
+}
+
+void pmu_sample_stop(void) {
+    if(!pmu_present()) {
+        return;
+    }
+
+    write_msr(msr_perfevtsel0 + sample_counter(), 0);
+    lapic_perfmon_mask();
+
+    if(info.version >= 2) {
+        write_msr(msr_perf_global_ovf_ctrl, 1ULL << sample_counter());
+    }
+}
+
+void pmu_print_info(void) {
+    if(info.version == 0) {
+        terminal_printf("PMU: no architectural performance monitoring\n");
+        return;
+    }
+
+    terminal_printf("PMU: version %zu, %zu counters of %zu bits, %zu fixed of %zu bits\n",
+        (size_t) info.version, (size_t) info.counters, (size_t) info.counter_width,
+        (size_t) info.fixed_counters, (size_t) info.fixed_counter_width);
+
+    for(size_t i=0; i<PMU_EVENT_COUNT; ++i) {
+        const struct pmu_assignment *assignment = &assignments[i];
+
+        if(!assignment->present) {
+            terminal_printf("  %s: not counted\n", event_names[i]);
+        } else {
+            terminal_printf("  %s: %s counter %zu\n", event_names[i], assignment->fixed ? "fixed" : "general", (size_t) assignment->counter);
+        }
+    }
+}
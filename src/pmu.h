@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Architectural performance monitoring, Intel SDM Vol. 3B 18.2. CPUID leaf
+ * 0xA reports the version and the number and width of the counters.
+ * Version 0 means there are none, as under QEMU without KVM.
+ *
+ * Every cpu counts the events below all the time, on the fixed counters
+ * from version 2 and otherwise on general purpose ones. The last general
+ * purpose counter is left for the profiler's sampling. Counts are read
+ * with rdpmc and followed per thread: the scheduler adds what a counting
+ * thread's run used up when it is switched out, so a thread's counts
+ * don't include other threads even if it is preempted or moves cpu.
+ */
+
+enum pmu_event {
+    pmu_event_cycles,
+    pmu_event_instructions,
+    pmu_event_llc_misses,
+    pmu_event_branch_misses,
+    PMU_EVENT_COUNT
+};
+
+struct pmu_info {
+    uint8_t version;
+    // general purpose counters per cpu
+    uint8_t counters;
+    uint8_t counter_width;
+    // version 2 and later
+    uint8_t fixed_counters;
+    uint8_t fixed_counter_width;
+    // bit set for each architectural event the cpu can't count
+    uint32_t unavailable_events;
+};
+
+struct pmu_counts {
+    uint64_t tsc;
+    uint64_t events[PMU_EVENT_COUNT];
+    // bit per event that is counted on this machine
+    uint32_t valid;
+};
+
+// Kept in struct thread and only touched by the scheduler and pmu.c
+struct pmu_thread_state {
+    bool counting;
+    // counters when the thread was last switched in
+    uint64_t base[PMU_EVENT_COUNT];
+    // counted in its earlier runs
+    uint64_t total[PMU_EVENT_COUNT];
+};
+
+// Counts read at pmu_region_begin, see pmu_region_end
+struct pmu_region {
+    struct pmu_counts start;
+};
+
+// Reads CPUID once and picks a counter for each event, the counters are the same on every cpu
+void pmu_init(void);
+
+// Starts this cpu's counters, every cpu runs it after pmu_init
+void pmu_cpu_init(void);
+
+const struct pmu_info* pmu_get_info(void);
+
+// True if there is a general purpose counter that can count core cycles
+bool pmu_present(void);
+
+// Reads this cpu's counters as they are
+void pmu_read(struct pmu_counts *counts);
+
+// Starts counting for the current thread, if it isn't already
+void pmu_thread_start(void);
+
+// Events counted while the current thread ran since it started counting
+void pmu_thread_read(struct pmu_counts *counts);
+
+// Called by the scheduler around a switch, state belongs to the thread leaving or coming back
+void pmu_switch_out(struct pmu_thread_state *state);
+void pmu_switch_in(struct pmu_thread_state *state);
+
+// Counts the current thread from here until pmu_region_end
+void pmu_region_begin(struct pmu_region *region);
+
+// Sets counts to what the current thread did since pmu_region_begin
+void pmu_region_end(const struct pmu_region *region, struct pmu_counts *counts);
+
+/* Prints wall time, IPC and misses per operation for counts covering
+ * operations repetitions of something, leaving out what can't be counted.
+ */
+void pmu_print_counts(const char *name, const struct pmu_counts *counts, uint64_t operations);
+
+/* Sampling on this cpu: the last general purpose counter counts unhalted
+ * core cycles and interrupts on apic_perfmon_vector every period cycles,
+ * at most 2^31 - 1. Returns 0 on success. Non-zero without a PMU.
+ */
+int pmu_sample_start(uint64_t period);
+
+// Reloads the sampling counter, from the overflow interrupt
+void pmu_sample_rearm(void);
+
+void pmu_sample_stop(void);
+
+void pmu_print_info(void);
@@ -0,0 +1,439 @@
+#include "profiler.h"
+#include <stdbool.h>
+#include <stdarg.h>
+#include "cpu.h"
+#include "apic.h"
+#include "pic.h"
+#include "pit.h"
+#include "pmu.h"
+#include "ring.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "symbols.h"
+#include "backtrace.h"
+#include "serial.h"
+#include "format.h"
+#include "terminal.h"
+#include "boot_param.h"
+
+// Functions printed in the histogram
+#define PROFILER_TOP_FUNCTIONS 20
+
+struct profiler_sample {
+    const char *thread;
+    size_t depth;
+    // addresses[0] is the interrupted instruction
+    uintptr_t addresses[PROFILER_MAX_DEPTH];
+};
+
+struct profiler_cpu {
+    struct spsc_ring ring;
+    struct profiler_sample storage[PROFILER_RING_SIZE];
+    volatile uint64_t dropped;
+
+    // the start the PMU counter was armed for, 0 when it isn't
+    uint64_t armed_generation;
+} __attribute__ ((aligned (64)));
+
+// Functions are their start address, 0 for code outside any known function
+struct stack_entry {
+    uint64_t count;
+    const char *thread;
+    size_t depth;
+    uintptr_t functions[PROFILER_MAX_DEPTH];
+};
+
+struct function_entry {
+    uint64_t count;
+    uintptr_t function;
+};
+
+enum profile_choice {
+    profile_off,
+    profile_timer,
+    profile_pmu
+};
+
+static int profile = profile_off;
+static const char *const profile_names[] = { "off", "timer", "pmu", NULL };
+BOOT_PARAM_ENUM("profile", profile, profile_names);
+
+static int64_t profile_seconds = 10;
+BOOT_PARAM_INT("profile_seconds", profile_seconds, 1, 3600);
+
+static size_t profile_period = 1000000;
+BOOT_PARAM_SIZE("profile_period", profile_period, 1000, 0x7fffffff);
+
+static struct profiler_cpu cpus[MAX_CPUS];
+
+static volatile bool active;
+static enum profiler_source active_source;
+static uint64_t active_period;
+static uint64_t generation;
+
+// Hash tables, an entry is free while its count is 0
+static struct stack_entry stacks[PROFILER_MAX_STACKS];
+static struct function_entry functions[PROFILER_MAX_FUNCTIONS];
+static size_t stack_count;
+static size_t function_count;
+static uint64_t sample_count;
+static uint64_t stacks_lost;
+static uint64_t functions_lost;
+
+// The rings have one consumer and the tables one writer
+static struct ticket_lock drain_lock = TICKET_LOCK_INIT;
+
+static struct thread *session_thread;
+static volatile bool session_sleeping;
+static uint64_t ticks_since_wake;
+
+static void record_sample(struct interrupt_frame *frame, uintptr_t rbp) {
+    struct profiler_cpu *cpu = &cpus[this_cpu_id()];
+    struct thread *thread = scheduler_current();
+    struct unwind_registers regs = { frame->instruction_ptr, frame->stack_ptr, rbp };
+    struct profiler_sample sample;
+
+    sample.thread = thread != NULL ? thread->name : NULL;
+    sample.depth = backtrace_collect_frame_pointers(&regs, sample.addresses, PROFILER_MAX_DEPTH);
+
+    if(sample.depth == 0 || spsc_ring_push(&cpu->ring, &sample) != 0) {
+        ++cpu->dropped;
+    }
+}
+
+static int pmu_interrupt(struct interrupt_frame *frame, uintptr_t rbp) {
+    // once stopped the entry stays masked until the next tick disarms the counter
+    if(__atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+        record_sample(frame, rbp);
+        pmu_sample_rearm();
+    }
+
+    lapic_eoi();
+
+    return 0;
+}
+
+void profiler_tick(struct interrupt_frame *frame, uintptr_t rbp) {
+    struct profiler_cpu *cpu = &cpus[this_cpu_id()];
+    bool running = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+
+    // every cpu programs its own counter
+    uint64_t wanted = running && active_source == profiler_source_pmu ? generation : 0;
+    if(wanted != cpu->armed_generation) {
+        if(wanted != 0) {
+            pmu_sample_start(active_period);
+        } else {
+            pmu_sample_stop();
+        }
+        cpu->armed_generation = wanted;
+    }
+
+    if(running && active_source == profiler_source_timer) {
+        record_sample(frame, rbp);
+    }
+
+    // the session thread is on cpu 0, so it can't be between setting sleeping and blocking
+    if(this_cpu_id() == 0 && session_sleeping && ++ticks_since_wake >= PROFILER_DRAIN_TICKS) {
+        ticks_since_wake = 0;
+        thread_wake(session_thread);
+    }
+}
+
+int profiler_start(enum profiler_source source, uint64_t period) {
+    if(__atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    if(source == profiler_source_pmu && !pmu_present()) {
+        return -1;
+    }
+
+    active_source = source;
+    active_period = period;
+    ++generation;
+    __atomic_store_n(&active, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void profiler_stop(void) {
+    __atomic_store_n(&active, false, __ATOMIC_RELEASE);
+}
+
+static uint64_t hash_word(uint64_t hash, uintptr_t word) {
+    // FNV-1a over whole words
+    return (hash ^ word) * 0x100000001b3ULL;
+}
+
+static inline uint64_t hash_finish(uint64_t hash) {
+    return hash ^ (hash >> 32);
+}
+
+static bool stack_matches(const struct stack_entry *entry, const char *thread, const uintptr_t *functions, size_t depth) {
+    if(entry->thread != thread || entry->depth != depth) {
+        return false;
+    }
+
+    for(size_t i=0; i<depth; ++i) {
+        if(entry->functions[i] != functions[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Tables stop taking new entries at 3/4 full, probes stay short
+static void count_stack(const char *thread, const uintptr_t *functions, size_t depth) {
+    uint64_t hash = hash_word(0xcbf29ce484222325ULL, (uintptr_t) thread);
+    for(size_t i=0; i<depth; ++i) {
+        hash = hash_word(hash, functions[i]);
+    }
+
+    size_t index = hash_finish(hash) & (PROFILER_MAX_STACKS - 1);
+
+    for(;; index = (index + 1) & (PROFILER_MAX_STACKS - 1)) {
+        struct stack_entry *entry = &stacks[index];
+
+        if(entry->count == 0) {
+            if(stack_count >= PROFILER_MAX_STACKS * 3 / 4) {
+                ++stacks_lost;
+                return;
+            }
+
+            entry->count = 1;
+            entry->thread = thread;
+            entry->depth = depth;
+            for(size_t i=0; i<depth; ++i) {
+                entry->functions[i] = functions[i];
+            }
+            ++stack_count;
+            return;
+        }
+
+        if(stack_matches(entry, thread, functions, depth)) {
+            ++entry->count;
+            return;
+        }
+    }
+}
+
+static void count_function(uintptr_t function) {
+    size_t index = hash_finish(hash_word(0xcbf29ce484222325ULL, function)) & (PROFILER_MAX_FUNCTIONS - 1);
+
+    for(;; index = (index + 1) & (PROFILER_MAX_FUNCTIONS - 1)) {
+        struct function_entry *entry = &functions[index];
+
+        if(entry->count == 0) {
+            if(function_count >= PROFILER_MAX_FUNCTIONS * 3 / 4) {
+                ++functions_lost;
+                return;
+            }
+
+            entry->count = 1;
+            entry->function = function;
+            ++function_count;
+            return;
+        }
+
+        if(entry->function == function) {
+            ++entry->count;
+            return;
+        }
+    }
+}
+
+static uintptr_t function_start(uintptr_t addr) {
+    uintptr_t offset;
+    return symbols_lookup(addr, &offset) != NULL ? addr - offset : 0;
+}
+
+static void aggregate(const struct profiler_sample *sample) {
+    uintptr_t starts[PROFILER_MAX_DEPTH];
+
+    for(size_t i=0; i<sample->depth; ++i) {
+        starts[i] = function_start(sample->addresses[i]);
+    }
+
+    ++sample_count;
+    count_stack(sample->thread, starts, sample->depth);
+    count_function(starts[0]);
+}
+
+static void drain_locked(void) {
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        const struct profiler_sample *sample;
+
+        while((sample = spsc_ring_peek(&cpus[i].ring)) != NULL) {
+            aggregate(sample);
+            spsc_ring_skip(&cpus[i].ring);
+        }
+    }
+}
+
+void profiler_drain(void) {
+    ticket_lock(&drain_lock);
+    drain_locked();
+    ticket_unlock(&drain_lock);
+}
+
+static const char* function_name(uintptr_t function) {
+    const char *name = function != 0 ? symbols_lookup(function, NULL) : NULL;
+    return name != NULL ? name : "[unknown]";
+}
+
+static void print_histogram(uint64_t dropped) {
+    terminal_printf("Profile: %zu samples, %zu dropped, %zu outside the stack table\n",
+        sample_count, dropped, stacks_lost);
+
+    // the table is emptied after the dump, so it can be sorted in place
+    size_t count = 0;
+    for(size_t i=0; i<PROFILER_MAX_FUNCTIONS; ++i) {
+        if(functions[i].count != 0) {
+            functions[count++] = functions[i];
+        }
+    }
+
+    for(size_t i=0; i<count && i<PROFILER_TOP_FUNCTIONS; ++i) {
+        size_t top = i;
+        for(size_t j=i+1; j<count; ++j) {
+            if(functions[j].count > functions[top].count) {
+                top = j;
+            }
+        }
+
+        struct function_entry entry = functions[top];
+        functions[top] = functions[i];
+        functions[i] = entry;
+
+        terminal_printf("%8zu %3zu%% %s\n", entry.count, entry.count * 100 / sample_count, function_name(entry.function));
+    }
+
+    if(functions_lost != 0) {
+        terminal_printf("%8zu      functions past the table\n", functions_lost);
+    }
+}
+
+static void serial_flush_buffer(struct format_buffer *buffer) {
+    serial_write(buffer->data, buffer->used);
+    buffer->used = 0;
+}
+
+static void serial_printf(const char *fmt, ...) {
+    char data[128];
+    struct format_buffer out = {
+        .data = data,
+        .size = sizeof(data),
+        .used = 0,
+        .total = 0,
+        .flush = serial_flush_buffer,
+        .context = NULL
+    };
+
+    va_list args;
+    va_start(args, fmt);
+    kvformat(&out, fmt, args);
+    va_end(args);
+
+    serial_flush_buffer(&out);
+}
+
+// Outermost frame first, as the flame graph tools expect
+static void print_folded(void) {
+    if(!serial_present()) {
+        terminal_printf("Profile: no serial port for the folded stacks\n");
+        return;
+    }
+
+    serial_printf("# folded begin\n");
+
+    for(size_t i=0; i<PROFILER_MAX_STACKS; ++i) {
+        const struct stack_entry *entry = &stacks[i];
+        if(entry->count == 0) {
+            continue;
+        }
+
+        serial_printf("%s", entry->thread != NULL ? entry->thread : "[none]");
+        for(size_t frame = entry->depth; frame-- > 0;) {
+            serial_printf(";%s", function_name(entry->functions[frame]));
+        }
+        serial_printf(" %zu\n", entry->count);
+    }
+
+    serial_printf("# folded end\n");
+}
+
+void profiler_dump(void) {
+    ticket_lock(&drain_lock);
+    drain_locked();
+
+    uint64_t dropped = 0;
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        dropped += __atomic_exchange_n(&cpus[i].dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    print_histogram(dropped);
+    print_folded();
+
+    for(size_t i=0; i<PROFILER_MAX_STACKS; ++i) {
+        stacks[i].count = 0;
+    }
+    for(size_t i=0; i<PROFILER_MAX_FUNCTIONS; ++i) {
+        functions[i].count = 0;
+    }
+    stack_count = 0;
+    function_count = 0;
+    sample_count = 0;
+    stacks_lost = 0;
+    functions_lost = 0;
+
+    ticket_unlock(&drain_lock);
+}
+
+// Samples for profile_seconds from boot, draining every few ticks
+static void session_main(void *arg) {
+    (void) arg;
+
+    enum profiler_source source = profile == profile_pmu ? profiler_source_pmu : profiler_source_timer;
+    if(source == profiler_source_pmu && !pmu_present()) {
+        terminal_printf("Profile: no PMU, sampling on the timer\n");
+        source = profiler_source_timer;
+    }
+
+    if(profiler_start(source, profile_period) != 0) {
+        return;
+    }
+
+    uint64_t end = pit_get_ticks() + profile_seconds * pit_get_frequency();
+
+    while(pit_get_ticks() < end) {
+        uint64_t flags = irq_save();
+        session_sleeping = true;
+        thread_block();
+        session_sleeping = false;
+        irq_restore(flags);
+
+        profiler_drain();
+    }
+
+    profiler_stop();
+    profiler_dump();
+}
+
+void profiler_init(void) {
+    for(size_t i=0; i<MAX_CPUS; ++i) {
+        spsc_ring_init(&cpus[i].ring, cpus[i].storage, PROFILER_RING_SIZE, sizeof(struct profiler_sample));
+    }
+
+    add_interrupt_handler(apic_perfmon_vector, (intptr_t) pmu_interrupt);
+
+    if(profile == profile_off) {
+        return;
+    }
+
+    session_thread = thread_create_on(0, "profiler", session_main, NULL);
+    if(session_thread == NULL) {
+        terminal_printf("Profile: no thread to run the profile\n");
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pic.h"
+
+/* Sampling profiler. A sample is the interrupted rip and the return
+ * addresses along the rbp chain, taken on every timer tick or every period
+ * core cycles by a PMU counter. Interrupt handlers push samples into a ring
+ * per cpu. A thread drains the rings into a table of distinct stacks and a
+ * histogram of the functions the samples landed in.
+ *
+ * profiler_dump prints the histogram, then the stacks over serial in the
+ * folded format of flamegraph.pl and inferno, one "thread;outer;...;inner
+ * count" line each between "# folded begin" and "# folded end":
+ *   sed -n '/^# folded begin/,/^# folded end/{/^#/!p}' serial.log | flamegraph.pl > kernel.svg
+ *
+ * The profile boot parameter (off, timer or pmu) samples for profile_seconds
+ * from boot and dumps the result, profile_period sets the PMU period.
+ */
+
+#define PROFILER_MAX_DEPTH 16
+
+// Samples per cpu waiting to be aggregated, must be a power of two
+#define PROFILER_RING_SIZE 256
+
+// Distinct stacks and functions kept, samples past either are only counted. Powers of two.
+#define PROFILER_MAX_STACKS 512
+#define PROFILER_MAX_FUNCTIONS 512
+
+// Timer ticks between drains of the rings
+#define PROFILER_DRAIN_TICKS 5
+
+enum profiler_source {
+    profiler_source_timer,
+    profiler_source_pmu
+};
+
+// Sets up the rings and handlers, starts the boot parameter's profile. Must run after scheduler_init.
+void profiler_init(void);
+
+/* Starts sampling on every cpu, each arms its PMU counter on its next
+ * timer tick. period is in core cycles and only used by the PMU source.
+ * Returns 0 on success. Non-zero if already running or there is no PMU.
+ */
+int profiler_start(enum profiler_source source, uint64_t period);
+
+void profiler_stop(void);
+
+// Aggregates what is waiting in the rings, called from a thread
+void profiler_drain(void);
+
+// Drains, prints the histogram and the folded stacks, and starts over with empty tables
+void profiler_dump(void);
+
+// Called from the timer interrupts of every cpu
+void profiler_tick(struct interrupt_frame *frame, uintptr_t rbp);
@@ -0,0 +1,17 @@
+#include "qemu.h"
+#include "util.h"
+#include "klog.h"
+#include "serial.h"
+#include "terminal.h"
+
+void qemu_exit(uint8_t code) {
+    klog_flush();
+    terminal_flush();
+    serial_flush();
+
+    outb(QEMU_DEBUG_EXIT_PORT, code);
+
+    for(;;) {
+        asm volatile("cli\nhlt");
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+/* QEMU's isa-debug-exit device, present when QEMU is started with
+ *   -device isa-debug-exit,iobase=0xf4,iosize=0x04
+ * Writing a byte to its port makes QEMU exit with status (byte << 1) | 1,
+ * which is how make bench gets a result out of a headless run.
+ */
+#define QEMU_DEBUG_EXIT_PORT 0xf4
+
+/* Waits for the console and serial output to go out, then exits QEMU with
+ * status (code << 1) | 1. Halts if the device isn't there.
+ */
+__attribute__ ((noreturn)) void qemu_exit(uint8_t code);
@@ -0,0 +1,176 @@
+#include "rcu.h"
+#include "smp.h"
+#include "thread.h"
+#include "workqueue.h"
+#include "terminal.h"
+
+struct rcu_stats {
+    uint64_t quiescent_states;
+    uint64_t grace_periods;
+    uint64_t callbacks;
+};
+
+// Only the owning cpu touches pending and waiting, with interrupts disabled.
+// done is handed to the worker, which may run on another cpu.
+struct rcu_cpu {
+    // gp_sequence as seen at this cpu's last quiescent state
+    volatile uint64_t quiescent_sequence;
+
+    struct rcu_head *pending;
+    struct rcu_head **pending_tail;
+
+    struct rcu_head *waiting;
+    struct rcu_head **waiting_tail;
+    uint64_t waiting_sequence;
+
+    struct rcu_head *volatile done;
+    volatile bool scheduled;
+    struct work_item work;
+
+    struct rcu_stats stats;
+} __attribute__ ((aligned (64)));
+
+static volatile uint64_t gp_sequence;
+static struct rcu_cpu rcu_cpus[MAX_CPUS];
+
+static inline struct rcu_cpu* this_rcu_cpu(void) {
+    return &rcu_cpus[this_cpu_id()];
+}
+
+void rcu_quiescent_state(void) {
+    struct rcu_cpu *rc = this_rcu_cpu();
+
+    // stores may pass later loads on x86, without the fence a read-side
+    // section after this point could read a pointer before the writer
+    // sees this cpu as quiescent
+    __atomic_store_n(&rc->quiescent_sequence, __atomic_load_n(&gp_sequence, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    ++rc->stats.quiescent_states;
+}
+
+static bool grace_period_completed(uint64_t sequence) {
+    size_t cpus = smp_cpu_count();
+
+    for(size_t i=0; i<cpus; ++i) {
+        if(__atomic_load_n(&rcu_cpus[i].quiescent_sequence, __ATOMIC_ACQUIRE) < sequence) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t start_grace_period(void) {
+    return __atomic_add_fetch(&gp_sequence, 1, __ATOMIC_SEQ_CST);
+}
+
+static void rcu_run_callbacks(struct work_item *item) {
+    struct rcu_cpu *rc = item->arg;
+
+    do {
+        struct rcu_head *head = __atomic_exchange_n(&rc->done, NULL, __ATOMIC_ACQUIRE);
+
+        while(head != NULL) {
+            struct rcu_head *next = head->next;
+            head->function(head);
+            __atomic_add_fetch(&rc->stats.callbacks, 1, __ATOMIC_RELAXED);
+            head = next;
+        }
+
+        __atomic_store_n(&rc->scheduled, false, __ATOMIC_SEQ_CST);
+
+        // a batch that completed while running didn't queue another run
+    } while(__atomic_load_n(&rc->done, __ATOMIC_ACQUIRE) != NULL
+            && !__atomic_exchange_n(&rc->scheduled, true, __ATOMIC_SEQ_CST));
+}
+
+static void schedule_callbacks(struct rcu_cpu *rc) {
+    if(__atomic_exchange_n(&rc->scheduled, true, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    rc->work.function = rcu_run_callbacks;
+    rc->work.arg = rc;
+    rc->work.group = NULL;
+
+    if(work_submit(&rc->work) != 0) {
+        // retried on the next tick
+        rc->scheduled = false;
+    }
+}
+
+static void move_to_done(struct rcu_cpu *rc) {
+    struct rcu_head *head = __atomic_load_n(&rc->done, __ATOMIC_RELAXED);
+
+    do {
+        *rc->waiting_tail = head;
+    } while(!__atomic_compare_exchange_n(&rc->done, &head, rc->waiting, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    rc->waiting = NULL;
+    ++rc->stats.grace_periods;
+
+    schedule_callbacks(rc);
+}
+
+void rcu_tick(void) {
+    struct rcu_cpu *rc = this_rcu_cpu();
+
+    if(preempt_count() == 0) {
+        rcu_quiescent_state();
+    }
+
+    if(rc->waiting != NULL && grace_period_completed(rc->waiting_sequence)) {
+        move_to_done(rc);
+    }
+
+    if(rc->done != NULL && !rc->scheduled) {
+        schedule_callbacks(rc);
+    }
+
+    // one batch waits at a time, everything queued meanwhile goes in the next
+    if(rc->waiting == NULL && rc->pending != NULL) {
+        rc->waiting = rc->pending;
+        rc->waiting_tail = rc->pending_tail;
+        rc->pending = NULL;
+        rc->waiting_sequence = start_grace_period();
+    }
+}
+
+void synchronize_rcu(void) {
+    assert(preempt_count() == 0);
+
+    uint64_t sequence = start_grace_period();
+    rcu_quiescent_state();
+
+    while(!grace_period_completed(sequence)) {
+        thread_yield();
+    }
+}
+
+void call_rcu(struct rcu_head *head, void (*function)(struct rcu_head *head)) {
+    uint64_t flags = irq_save();
+    struct rcu_cpu *rc = this_rcu_cpu();
+
+    head->next = NULL;
+    head->function = function;
+
+    if(rc->pending == NULL) {
+        rc->pending = head;
+    } else {
+        *rc->pending_tail = head;
+    }
+    rc->pending_tail = &head->next;
+
+    irq_restore(flags);
+}
+
+void rcu_print_stats(void) {
+    size_t cpus = smp_cpu_count();
+
+    for(size_t i=0; i<cpus; ++i) {
+        struct rcu_stats *stats = &rcu_cpus[i].stats;
+        terminal_printf("cpu %#zx quiescent: %#zx\tgrace periods: %#zx\tcallbacks: %#zx\n",
+            i, stats->quiescent_states, stats->grace_periods, stats->callbacks);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+/* Quiescent state based read-copy-update.
+ *
+ * Readers bracket their accesses with rcu_read_lock/rcu_read_unlock, which
+ * only bump this cpu's preempt count. A thread in a read-side section is not
+ * preempted, so a context switch, the idle loop or a timer tick that
+ * interrupted preempt count 0 all mean the cpu holds no old references.
+ * A grace period is over once every online cpu has passed such a point.
+ *
+ * Interrupt handlers run with interrupts disabled and are read-side
+ * sections as they are. The timer handlers must not touch protected data
+ * after calling scheduler_tick, which may switch threads.
+ */
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*function)(struct rcu_head *head);
+};
+
+static inline void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+// Loads a protected pointer inside a read-side section
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+// Publishes a fully initialised object to readers
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+// Reports that this cpu holds no references, called by the scheduler
+void rcu_quiescent_state(void);
+
+// Called from the timer tick, the preempt count is still that of the interrupted thread
+void rcu_tick(void);
+
+// Waits for a full grace period. Must be called from a thread outside a read-side section.
+void synchronize_rcu(void);
+
+/* Runs function(head) after a grace period, on a worker thread.
+ * Safe to call from interrupt handlers.
+ */
+void call_rcu(struct rcu_head *head, void (*function)(struct rcu_head *head));
+
+void rcu_print_stats(void);
@@ -0,0 +1,375 @@
+#include "ring.h"
+#include "util.h"
+#include "cpu.h"
+#include "smp.h"
+#include "thread.h"
+#include "terminal.h"
+#include "ktest.h"
+#include "benchmark.h"
+
+static inline bool is_power_of_two(size_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+// Most rings carry single words, skip the rep movsb setup for those
+static inline void copy_element(void *dest, const void *src, size_t size) {
+    if(size == sizeof(uint64_t)) {
+        *(uint64_t*) dest = *(const uint64_t*) src;
+    } else {
+        memcpy(dest, src, size);
+    }
+}
+
+int spsc_ring_init(struct spsc_ring *ring, void *storage, size_t capacity, size_t element_size) {
+    if(!is_power_of_two(capacity)) {
+        return -1;
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->buffer = storage;
+    ring->mask = capacity - 1;
+    ring->element_size = element_size;
+
+    return 0;
+}
+
+int spsc_ring_push(struct spsc_ring *ring, const void *element) {
+    uint64_t head = ring->head;
+
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+        return -1;
+    }
+
+    copy_element(&ring->buffer[(head & ring->mask) * ring->element_size], element, ring->element_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int spsc_ring_pop(struct spsc_ring *ring, void *element) {
+    uint64_t tail = ring->tail;
+
+    if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    copy_element(element, &ring->buffer[(tail & ring->mask) * ring->element_size], ring->element_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+const void* spsc_ring_peek(const struct spsc_ring *ring) {
+    uint64_t tail = ring->tail;
+
+    if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->buffer[(tail & ring->mask) * ring->element_size];
+}
+
+void spsc_ring_skip(struct spsc_ring *ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+size_t spsc_ring_count(const struct spsc_ring *ring) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static inline volatile uint64_t* mpsc_slot_sequence(const struct mpsc_ring *ring, uint64_t position) {
+    return (volatile uint64_t*) &ring->slots[(position & ring->mask) * ring->slot_size];
+}
+
+int mpsc_ring_init(struct mpsc_ring *ring, void *storage, size_t capacity, size_t element_size) {
+    if(!is_power_of_two(capacity)) {
+        return -1;
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->slots = storage;
+    ring->mask = capacity - 1;
+    ring->element_size = element_size;
+    ring->slot_size = MPSC_RING_SLOT_SIZE(element_size);
+
+    // slot i is free for the producer at position i
+    for(size_t i=0; i<capacity; ++i) {
+        *mpsc_slot_sequence(ring, i) = i;
+    }
+
+    return 0;
+}
+
+int mpsc_ring_push(struct mpsc_ring *ring, const void *element) {
+    uint64_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    volatile uint64_t *sequence;
+
+    while(1) {
+        sequence = mpsc_slot_sequence(ring, position);
+        int64_t diff = (int64_t) (__atomic_load_n(sequence, __ATOMIC_ACQUIRE) - position);
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&ring->head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if(diff < 0) {
+            // the consumer hasn't freed this slot from the previous lap
+            return -1;
+        } else {
+            position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    copy_element((void*) (sequence + 1), element, ring->element_size);
+    __atomic_store_n(sequence, position + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int mpsc_ring_pop(struct mpsc_ring *ring, void *element) {
+    uint64_t position = ring->tail;
+    volatile uint64_t *sequence = mpsc_slot_sequence(ring, position);
+
+    if(__atomic_load_n(sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        return -1;
+    }
+
+    copy_element(element, (const void*) (sequence + 1), ring->element_size);
+
+    // hand the slot to the producer one lap ahead
+    __atomic_store_n(sequence, position + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->tail = position + 1;
+
+    return 0;
+}
+
+bool mpsc_ring_empty(const struct mpsc_ring *ring) {
+    return __atomic_load_n(mpsc_slot_sequence(ring, ring->tail), __ATOMIC_ACQUIRE) != ring->tail + 1;
+}
+
+/* Throughput benchmarks. Each iteration the producer threads push a round
+ * of items each and the runner pops them all. The producers go on the
+ * other cpus, on the runner's own only if there are no others.
+ */
+#define BENCHMARK_RING_CAPACITY 1024
+#define BENCHMARK_RING_ROUND 256
+
+static struct spsc_ring benchmark_spsc;
+static struct mpsc_ring benchmark_mpsc;
+static uint64_t benchmark_spsc_storage[BENCHMARK_RING_CAPACITY];
+static uint8_t benchmark_mpsc_storage[MPSC_RING_STORAGE_SIZE(BENCHMARK_RING_CAPACITY, sizeof(uint64_t))];
+
+static bool benchmark_multi_producer;
+static size_t benchmark_producers;
+static volatile uint64_t benchmark_round;
+static volatile bool benchmark_stop;
+static volatile size_t benchmark_exited;
+
+// Pushes a round each time the runner starts one, until it stops them
+static void benchmark_producer(void *arg) {
+    (void) arg;
+    uint64_t seen = 0;
+
+    for(;;) {
+        uint64_t round;
+        while((round = __atomic_load_n(&benchmark_round, __ATOMIC_ACQUIRE)) == seen) {
+            thread_yield();
+        }
+
+        if(__atomic_load_n(&benchmark_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        seen = round;
+        for(uint64_t i=0; i<BENCHMARK_RING_ROUND; ++i) {
+            while((benchmark_multi_producer ? mpsc_ring_push(&benchmark_mpsc, &i)
+                                            : spsc_ring_push(&benchmark_spsc, &i)) != 0) {
+                cpu_relax();
+            }
+        }
+    }
+
+    __atomic_add_fetch(&benchmark_exited, 1, __ATOMIC_RELEASE);
+}
+
+static int ring_benchmark_setup(bool multi_producer) {
+    size_t cpus = smp_cpu_count();
+    size_t count = multi_producer && cpus > 1 ? cpus - 1 : 1;
+
+    spsc_ring_init(&benchmark_spsc, benchmark_spsc_storage, BENCHMARK_RING_CAPACITY, sizeof(uint64_t));
+    mpsc_ring_init(&benchmark_mpsc, benchmark_mpsc_storage, BENCHMARK_RING_CAPACITY, sizeof(uint64_t));
+
+    benchmark_multi_producer = multi_producer;
+    benchmark_producers = 0;
+    benchmark_round = 0;
+    benchmark_stop = false;
+    benchmark_exited = 0;
+
+    for(size_t i=0; i<count; ++i) {
+        size_t cpu = (this_cpu_id() + 1 + i) % cpus;
+        if(thread_create_on(cpu, "ring bench", benchmark_producer, NULL) != NULL) {
+            ++benchmark_producers;
+        }
+    }
+
+    return benchmark_producers == 0 ? -1 : 0;
+}
+
+static int spsc_benchmark_setup(void **context) {
+    (void) context;
+    return ring_benchmark_setup(false);
+}
+
+static int mpsc_benchmark_setup(void **context) {
+    (void) context;
+    return ring_benchmark_setup(true);
+}
+
+static void ring_benchmark_run(void) {
+    uint64_t element;
+    size_t items = benchmark_producers * BENCHMARK_RING_ROUND;
+
+    __atomic_add_fetch(&benchmark_round, 1, __ATOMIC_RELEASE);
+
+    for(size_t received = 0; received < items; ) {
+        int result = benchmark_multi_producer ? mpsc_ring_pop(&benchmark_mpsc, &element)
+                                              : spsc_ring_pop(&benchmark_spsc, &element);
+
+        if(result == 0) {
+            ++received;
+        } else {
+            // a producer may share this cpu
+            thread_yield();
+        }
+    }
+}
+
+static void ring_benchmark_teardown(void *context) {
+    (void) context;
+
+    __atomic_store_n(&benchmark_stop, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&benchmark_round, 1, __ATOMIC_RELEASE);
+
+    while(__atomic_load_n(&benchmark_exited, __ATOMIC_ACQUIRE) != benchmark_producers) {
+        thread_yield();
+    }
+
+    terminal_printf("ring bench producers: %#zx items per iteration: %#zx\n",
+        benchmark_producers, benchmark_producers * BENCHMARK_RING_ROUND);
+}
+
+static void spsc_benchmark(void *context) {
+    (void) context;
+    ring_benchmark_run();
+}
+BENCHMARK_WITH_SETUP("ring_spsc", spsc_benchmark, spsc_benchmark_setup, ring_benchmark_teardown);
+
+static void mpsc_benchmark(void *context) {
+    (void) context;
+    ring_benchmark_run();
+}
+BENCHMARK_WITH_SETUP("ring_mpsc", mpsc_benchmark, mpsc_benchmark_setup, ring_benchmark_teardown);
+
+// Fills and empties a small ring several times so the indices wrap
+static int spsc_ring_test(void) {
+    static struct spsc_ring ring;
+    static uint8_t storage[SPSC_RING_STORAGE_SIZE(4, sizeof(uint64_t))];
+
+    KTEST_EXPECT(spsc_ring_init(&ring, storage, 3, sizeof(uint64_t)) != 0);
+    KTEST_EXPECT(spsc_ring_init(&ring, storage, 4, sizeof(uint64_t)) == 0);
+
+    uint64_t value = 0;
+    for(uint64_t round=0; round<3; ++round) {
+        for(uint64_t i=0; i<4; ++i) {
+            value = round * 4 + i;
+            KTEST_EXPECT(spsc_ring_push(&ring, &value) == 0);
+        }
+        KTEST_EXPECT(spsc_ring_push(&ring, &value) != 0);
+        KTEST_EXPECT(spsc_ring_count(&ring) == 4);
+
+        for(uint64_t i=0; i<4; ++i) {
+            KTEST_EXPECT(spsc_ring_pop(&ring, &value) == 0);
+            KTEST_EXPECT(value == round * 4 + i);
+        }
+        KTEST_EXPECT(spsc_ring_pop(&ring, &value) != 0);
+    }
+
+    return 0;
+}
+KTEST("spsc_ring", spsc_ring_test);
+
+#define TEST_MPSC_PRODUCERS 3
+#define TEST_MPSC_ITEMS 2000
+
+static struct mpsc_ring test_mpsc;
+static uint8_t test_mpsc_storage[MPSC_RING_STORAGE_SIZE(8, sizeof(uint64_t))];
+
+// Pushes its id in the high half and a sequence number in the low half
+static void test_mpsc_producer(void *arg) {
+    uint64_t id = (uintptr_t) arg;
+
+    for(uint64_t i=0; i<TEST_MPSC_ITEMS; ++i) {
+        uint64_t value = id << 32 | i;
+        while(mpsc_ring_push(&test_mpsc, &value) != 0) {
+            // the consumer may share this cpu
+            thread_yield();
+        }
+    }
+}
+
+/* Fills a small ring, then has producers on the other cpus push through it
+ * concurrently, so it is full and wraps many times. Each producer's items
+ * must come out in the order it pushed them.
+ */
+static int mpsc_ring_test(void) {
+    KTEST_EXPECT(mpsc_ring_init(&test_mpsc, test_mpsc_storage, 6, sizeof(uint64_t)) != 0);
+    KTEST_EXPECT(mpsc_ring_init(&test_mpsc, test_mpsc_storage, 8, sizeof(uint64_t)) == 0);
+
+    uint64_t value = 0;
+    for(uint64_t round=0; round<3; ++round) {
+        for(uint64_t i=0; i<8; ++i) {
+            value = round * 8 + i;
+            KTEST_EXPECT(mpsc_ring_push(&test_mpsc, &value) == 0);
+        }
+        KTEST_EXPECT(mpsc_ring_push(&test_mpsc, &value) != 0);
+
+        for(uint64_t i=0; i<8; ++i) {
+            KTEST_EXPECT(mpsc_ring_pop(&test_mpsc, &value) == 0);
+            KTEST_EXPECT(value == round * 8 + i);
+        }
+        KTEST_EXPECT(mpsc_ring_empty(&test_mpsc));
+    }
+
+    size_t cpus = smp_cpu_count();
+    size_t producers = 0;
+
+    for(size_t i=0; i<TEST_MPSC_PRODUCERS; ++i) {
+        size_t cpu = (this_cpu_id() + 1 + i) % cpus;
+        if(thread_create_on(cpu, "ring test", test_mpsc_producer, (void*) (uintptr_t) producers) != NULL) {
+            ++producers;
+        }
+    }
+    KTEST_EXPECT(producers > 0);
+
+    uint64_t next[TEST_MPSC_PRODUCERS] = { 0 };
+    for(size_t received = 0; received < producers * TEST_MPSC_ITEMS; ) {
+        if(mpsc_ring_pop(&test_mpsc, &value) != 0) {
+            thread_yield();
+            continue;
+        }
+
+        uint64_t id = value >> 32;
+        KTEST_EXPECT(id < producers);
+        KTEST_EXPECT((value & 0xffffffff) == next[id]);
+        ++next[id];
+        ++received;
+    }
+
+    KTEST_EXPECT(mpsc_ring_empty(&test_mpsc));
+
+    return 0;
+}
+KTEST("mpsc_ring", mpsc_ring_test);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Bounded lock-free rings of fixed size elements. The caller provides the
+ * storage, the capacity must be a power of two. Producer and consumer
+ * indices sit on their own cache lines.
+ *
+ * spsc: one producer and one consumer, e.g. an interrupt handler and its bottom half.
+ * mpsc: any number of producers, one consumer. Every slot carries a sequence
+ *       number so a producer that has claimed a slot but not yet filled it
+ *       never exposes a partial element.
+ */
+
+#define RING_CACHE_LINE 64
+
+#define SPSC_RING_STORAGE_SIZE(capacity, element_size) ((capacity) * (element_size))
+
+#define MPSC_RING_SLOT_SIZE(element_size) ((sizeof(uint64_t) + (element_size) + 7) & ~(size_t) 7)
+#define MPSC_RING_STORAGE_SIZE(capacity, element_size) ((capacity) * MPSC_RING_SLOT_SIZE(element_size))
+
+struct spsc_ring {
+    volatile uint64_t head;
+    uint8_t head_padding[RING_CACHE_LINE - sizeof(uint64_t)];
+
+    volatile uint64_t tail;
+    uint8_t tail_padding[RING_CACHE_LINE - sizeof(uint64_t)];
+
+    uint8_t *buffer;
+    size_t mask;
+    size_t element_size;
+} __attribute__ ((aligned (RING_CACHE_LINE)));
+
+struct mpsc_ring {
+    volatile uint64_t head;
+    uint8_t head_padding[RING_CACHE_LINE - sizeof(uint64_t)];
+
+    uint64_t tail;
+    uint8_t tail_padding[RING_CACHE_LINE - sizeof(uint64_t)];
+
+    uint8_t *slots;
+    size_t mask;
+    size_t element_size;
+    size_t slot_size;
+} __attribute__ ((aligned (RING_CACHE_LINE)));
+
+/* Returns 0 on success. Non-zero if capacity is not a power of two.
+ * storage must hold SPSC_RING_STORAGE_SIZE(capacity, element_size) bytes.
+ */
+int spsc_ring_init(struct spsc_ring *ring, void *storage, size_t capacity, size_t element_size);
+
+// Returns 0 on success. Non-zero if the ring is full.
+int spsc_ring_push(struct spsc_ring *ring, const void *element);
+
+// Returns 0 on success. Non-zero if the ring is empty.
+int spsc_ring_pop(struct spsc_ring *ring, void *element);
+
+/* Consumer only. Returns the oldest element in place, or NULL if the ring
+ * is empty. It stays valid until spsc_ring_skip.
+ */
+const void* spsc_ring_peek(const struct spsc_ring *ring);
+
+// Consumer only. Drops the element returned by spsc_ring_peek.
+void spsc_ring_skip(struct spsc_ring *ring);
+
+size_t spsc_ring_count(const struct spsc_ring *ring);
+
+/* Returns 0 on success. Non-zero if capacity is not a power of two.
+ * storage must hold MPSC_RING_STORAGE_SIZE(capacity, element_size) bytes.
+ */
+int mpsc_ring_init(struct mpsc_ring *ring, void *storage, size_t capacity, size_t element_size);
+
+// Safe from any cpu and from interrupt handlers. Returns 0 on success. Non-zero if the ring is full.
+int mpsc_ring_push(struct mpsc_ring *ring, const void *element);
+
+// Consumer only. Returns 0 on success. Non-zero if the ring is empty.
+int mpsc_ring_pop(struct mpsc_ring *ring, void *element);
+
+bool mpsc_ring_empty(const struct mpsc_ring *ring);
@@ -0,0 +1,276 @@
+#include "scheduler.h"
+#include "cpu.h"
+#include "smp.h"
+#include "rcu.h"
+#include "assert.h"
+#include "boot_param.h"
+
+struct run_queue {
+    struct thread *current;
+    struct thread *idle;
+
+    struct thread *head;
+    struct thread *tail;
+    size_t length;
+
+    // Threads woken by other cpus, pushed lock-free and moved onto the
+    // run queue by the owning cpu
+    struct thread *volatile remote_wake;
+
+    // Exited thread whose stack was still in use until the switch completed
+    struct thread *zombie;
+
+    size_t quantum_left;
+    uint64_t switch_start;
+};
+
+static struct run_queue run_queues[MAX_CPUS];
+
+static int64_t quantum_ticks = SCHEDULER_QUANTUM_TICKS;
+BOOT_PARAM_INT("sched_quantum", quantum_ticks, 1, 1000);
+
+extern void context_switch(uintptr_t *old_sp, uintptr_t new_sp);
+
+static inline struct run_queue* this_run_queue(void) {
+    return &run_queues[this_cpu_id()];
+}
+
+// The interrupt shims only save the general purpose registers, so a thread
+// that is preempted needs its SSE state kept. Voluntary switches are plain
+// function calls and the xmm registers are caller saved.
+static inline void fpu_save(struct thread *thread) {
+    asm volatile("fxsave %0" : "=m"(thread->fpu_state));
+    thread->fpu_saved = true;
+}
+
+static inline void fpu_restore(struct thread *thread) {
+    asm volatile("fxrstor %0" : : "m"(thread->fpu_state));
+    thread->fpu_saved = false;
+}
+
+static void run_queue_push(struct run_queue *rq, struct thread *thread) {
+    thread->next = NULL;
+
+    if(rq->tail != NULL) {
+        rq->tail->next = thread;
+    } else {
+        rq->head = thread;
+    }
+
+    rq->tail = thread;
+    ++rq->length;
+}
+
+static struct thread* run_queue_pop(struct run_queue *rq) {
+    struct thread *thread = rq->head;
+
+    if(thread != NULL) {
+        rq->head = thread->next;
+        if(rq->head == NULL) {
+            rq->tail = NULL;
+        }
+
+        thread->next = NULL;
+        --rq->length;
+    }
+
+    return thread;
+}
+
+static void remote_wake_push(struct run_queue *rq, struct thread *thread) {
+    struct thread *head = __atomic_load_n(&rq->remote_wake, __ATOMIC_RELAXED);
+
+    do {
+        thread->next = head;
+    } while(!__atomic_compare_exchange_n(&rq->remote_wake, &head, thread, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Only the owning cpu takes from the list and it takes all of it, so there is no ABA problem
+static void remote_wake_drain(struct run_queue *rq) {
+    if(rq->remote_wake == NULL) {
+        return;
+    }
+
+    struct thread *list = __atomic_exchange_n(&rq->remote_wake, NULL, __ATOMIC_ACQUIRE);
+
+    // pushed newest first, reverse to keep wakeup order
+    struct thread *reversed = NULL;
+    while(list != NULL) {
+        struct thread *next = list->next;
+        list->next = reversed;
+        reversed = list;
+        list = next;
+    }
+
+    while(reversed != NULL) {
+        struct thread *next = reversed->next;
+        run_queue_push(rq, reversed);
+        reversed = next;
+    }
+}
+
+void scheduler_init(struct thread *idle) {
+    struct run_queue *rq = this_run_queue();
+
+    rq->idle = idle;
+    rq->current = idle;
+    rq->quantum_left = quantum_ticks;
+}
+
+void scheduler_enqueue(struct thread *thread) {
+    uint64_t flags = irq_save();
+
+    thread->state = thread_ready;
+
+    if(thread->cpu == this_cpu_id()) {
+        run_queue_push(this_run_queue(), thread);
+    } else {
+        remote_wake_push(&run_queues[thread->cpu], thread);
+        smp_send_reschedule(thread->cpu);
+    }
+
+    irq_restore(flags);
+}
+
+void schedule(bool voluntary) {
+    uint64_t start = read_tsc();
+    struct run_queue *rq = this_run_queue();
+    struct thread *prev = rq->current;
+
+    if(prev == NULL) {
+        return;
+    }
+
+    // sleeping or being preempted inside an rcu read-side section would stall grace periods
+    assert(preempt_count() == 0);
+    rcu_quiescent_state();
+
+    remote_wake_drain(rq);
+
+    if(prev->state == thread_zombie) {
+        rq->zombie = prev;
+    } else if(prev->state == thread_running) {
+        prev->state = thread_ready;
+        if(prev != rq->idle) {
+            run_queue_push(rq, prev);
+        }
+    }
+
+    struct thread *next = run_queue_pop(rq);
+    if(next == NULL) {
+        next = rq->idle;
+    }
+
+    rq->quantum_left = quantum_ticks;
+    next->state = thread_running;
+
+    if(next == prev) {
+        return;
+    }
+
+    if(voluntary) {
+        ++prev->stats.voluntary_switches;
+    } else {
+        ++prev->stats.involuntary_switches;
+        fpu_save(prev);
+    }
+
+    rq->current = next;
+    rq->switch_start = start;
+    pmu_switch_out(&prev->pmu);
+    context_switch(&prev->saved_sp, next->saved_sp);
+
+    // prev has been switched back in
+    pmu_switch_in(&prev->pmu);
+    if(prev->fpu_saved) {
+        fpu_restore(prev);
+    }
+
+    scheduler_switched_in();
+}
+
+void scheduler_switched_in(void) {
+    struct run_queue *rq = this_run_queue();
+
+    if(rq->zombie != NULL) {
+        __atomic_store_n(&rq->zombie->state, thread_dead, __ATOMIC_RELEASE);
+        rq->zombie = NULL;
+    }
+
+    struct thread_stats *stats = &rq->current->stats;
+    uint64_t latency = read_tsc() - rq->switch_start;
+
+    ++stats->switched_in;
+    stats->switch_latency_total += latency;
+    if(latency > stats->switch_latency_max) {
+        stats->switch_latency_max = latency;
+    }
+}
+
+void scheduler_tick(void) {
+    struct run_queue *rq = this_run_queue();
+
+    if(rq->current == NULL) {
+        return;
+    }
+
+    rcu_tick();
+    remote_wake_drain(rq);
+
+    if(rq->quantum_left > 0) {
+        --rq->quantum_left;
+    }
+
+    // a thread with preemption disabled is switched on a later tick
+    if(preempt_count() != 0) {
+        return;
+    }
+
+    if(rq->current == rq->idle) {
+        if(rq->head != NULL) {
+            schedule(false);
+        }
+    } else if(rq->quantum_left == 0) {
+        schedule(false);
+    }
+}
+
+void scheduler_preempt(void) {
+    struct run_queue *rq = this_run_queue();
+
+    if(rq->current == NULL || rq->head == NULL) {
+        return;
+    }
+
+    if(preempt_count() != 0) {
+        rq->quantum_left = 0;
+        return;
+    }
+
+    schedule(false);
+}
+
+struct thread* scheduler_current(void) {
+    return this_run_queue()->current;
+}
+
+void scheduler_idle_loop(void) {
+    while(1) {
+        uint64_t flags = irq_save();
+
+        struct run_queue *rq = this_run_queue();
+
+        if(rq->head != NULL || rq->remote_wake != NULL) {
+            schedule(true);
+        } else {
+            rcu_quiescent_state();
+
+            // sti takes effect after hlt starts, so a wakeup can't slip in between
+            asm volatile("sti\n"
+                         "hlt"
+                         ::: "memory");
+        }
+
+        irq_restore(flags);
+    }
+}
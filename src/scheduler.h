@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include "thread.h"
+
+// Timer ticks a thread may run before it is preempted, unless set by the sched_quantum boot parameter
+#define SCHEDULER_QUANTUM_TICKS 5
+
+// idle is the thread already running on this cpu
+void scheduler_init(struct thread *idle);
+
+// The thread may belong to another cpu, in which case that cpu is sent a reschedule ipi
+void scheduler_enqueue(struct thread *thread);
+
+/* Picks the next thread from this cpu's run queue and switches to it.
+ * Must be called with interrupts disabled. voluntary is false when the
+ * switch is forced by the timer.
+ */
+void schedule(bool voluntary);
+
+// Called from the timer interrupt
+void scheduler_tick(void);
+
+/* Called from an interrupt handler that has just woken a thread that
+ * should not wait out the current quantum. Switches now if any thread is
+ * ready, or on the next tick if preemption is disabled.
+ */
+void scheduler_preempt(void);
+
+// Accounts the switch latency, called first thing after a thread is switched to
+void scheduler_switched_in(void);
+
+struct thread* scheduler_current(void);
+
+void scheduler_idle_loop(void) __attribute__ ((noreturn));
@@ -0,0 +1,224 @@
+#include "serial.h"
+#include "util.h"
+#include "cpu.h"
+#include "pic.h"
+#include "spinlock.h"
+
+// Offsets from the base port, see http://wiki.osdev.org/Serial_Ports
+enum serial_registers {
+    serial_data = 0,
+    serial_interrupt_enable = 1,
+    serial_divisor_low = 0,
+    serial_divisor_high = 1,
+    serial_interrupt_id = 2,
+    serial_fifo_control = 2,
+    serial_line_control = 3,
+    serial_modem_control = 4,
+    serial_line_status = 5
+};
+
+enum serial_bits {
+    serial_ier_tx_empty = 0x02,
+
+    serial_lcr_8n1 = 0x03,
+    serial_lcr_divisor_latch = 0x80,
+
+    // enable, clear both fifos, receive trigger at 14 bytes
+    serial_fcr_enable = 0xC7,
+    serial_iir_fifo_enabled = 0xC0,
+
+    serial_mcr_dtr_rts_out2 = 0x0B,
+    serial_mcr_loopback = 0x1E,
+
+    serial_lsr_tx_empty = 0x20
+};
+
+static const uint32_t serial_base_baud = 115200;
+static const uint8_t serial_loopback_test_byte = 0xAE;
+
+struct serial_port {
+    uint16_t port;
+    bool present;
+
+    // bytes the transmitter takes at once when it reports empty
+    size_t fifo_size;
+
+    // the transmit interrupt is armed and will refill the fifo
+    bool tx_active;
+
+    uint8_t tx_ring[SERIAL_TX_RING_SIZE];
+    size_t tx_head;
+    size_t tx_tail;
+};
+
+static struct serial_port serial;
+static struct ticket_lock serial_lock = TICKET_LOCK_INIT;
+
+static const size_t tx_mask = SERIAL_TX_RING_SIZE - 1;
+
+static inline bool tx_ring_empty(void) {
+    return serial.tx_head == serial.tx_tail;
+}
+
+static inline bool tx_ring_full(void) {
+    return serial.tx_head - serial.tx_tail == SERIAL_TX_RING_SIZE;
+}
+
+static inline bool transmitter_empty(void) {
+    return inb(serial.port + serial_line_status) & serial_lsr_tx_empty;
+}
+
+/* Fills the fifo if the transmitter is empty, and arms the interrupt while
+ * anything is left queued. The lock must be held.
+ */
+static void start_tx_locked(void) {
+    if(transmitter_empty()) {
+        for(size_t i=0; i<serial.fifo_size && !tx_ring_empty(); ++i) {
+            outb(serial.port + serial_data, serial.tx_ring[serial.tx_tail++ & tx_mask]);
+        }
+    }
+
+    serial.tx_active = !tx_ring_empty();
+    outb(serial.port + serial_interrupt_enable, serial.tx_active ? serial_ier_tx_empty : 0);
+}
+
+int serial_init(uint16_t port, uint8_t irq, uint32_t baud) {
+    uint16_t divisor = serial_base_baud / baud;
+
+    serial.port = port;
+
+    outb(port + serial_interrupt_enable, 0);
+    outb(port + serial_line_control, serial_lcr_divisor_latch);
+    outb(port + serial_divisor_low, divisor & 0xff);
+    outb(port + serial_divisor_high, (divisor >> 8) & 0xff);
+    outb(port + serial_line_control, serial_lcr_8n1);
+    outb(port + serial_fifo_control, serial_fcr_enable);
+
+    // a byte sent in loopback mode must come straight back
+    outb(port + serial_modem_control, serial_mcr_loopback);
+    outb(port + serial_data, serial_loopback_test_byte);
+    if(inb(port + serial_data) != serial_loopback_test_byte) {
+        return -1;
+    }
+
+    // out2 gates the interrupt line to the pic
+    outb(port + serial_modem_control, serial_mcr_dtr_rts_out2);
+
+    // an 8250 without working fifos takes one byte at a time
+    bool has_fifo = (inb(port + serial_interrupt_id) & serial_iir_fifo_enabled) == serial_iir_fifo_enabled;
+    serial.fifo_size = has_fifo ? 16 : 1;
+
+    serial.present = true;
+    irq_clear_mask(irq);
+
+    return 0;
+}
+
+bool serial_present(void) {
+    return serial.present;
+}
+
+// Makes room by transmitting with polling, the interrupt may not reach this cpu
+static void wait_for_space_locked(void) {
+    while(tx_ring_full()) {
+        while(!transmitter_empty()) {
+            cpu_relax();
+        }
+        start_tx_locked();
+    }
+}
+
+static inline void queue_byte_locked(uint8_t byte) {
+    if(tx_ring_full()) {
+        wait_for_space_locked();
+    }
+
+    serial.tx_ring[serial.tx_head++ & tx_mask] = byte;
+}
+
+void serial_write(const char *text, size_t length) {
+    if(!serial.present) {
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&serial_lock);
+
+    for(size_t i=0; i<length; ++i) {
+        if(text[i] == '\n') {
+            queue_byte_locked('\r');
+        }
+        queue_byte_locked(text[i]);
+    }
+
+    if(!serial.tx_active) {
+        start_tx_locked();
+    }
+
+    ticket_unlock_irqrestore(&serial_lock, flags);
+}
+
+// Sends everything queued without the interrupt, the lock must be held
+static void transmit_polled_locked(void) {
+    while(!tx_ring_empty()) {
+        while(!transmitter_empty()) {
+            cpu_relax();
+        }
+        start_tx_locked();
+    }
+}
+
+void serial_flush(void) {
+    if(!serial.present) {
+        return;
+    }
+
+    uint64_t flags = ticket_lock_irqsave(&serial_lock);
+    transmit_polled_locked();
+
+    while(!transmitter_empty()) {
+        cpu_relax();
+    }
+
+    ticket_unlock_irqrestore(&serial_lock, flags);
+}
+
+static void put_byte_polled(uint8_t byte) {
+    while(!transmitter_empty()) {
+        cpu_relax();
+    }
+
+    outb(serial.port + serial_data, byte);
+}
+
+void serial_write_polled(const char *text, size_t length) {
+    if(!serial.present) {
+        return;
+    }
+
+    if(ticket_trylock(&serial_lock)) {
+        transmit_polled_locked();
+        ticket_unlock(&serial_lock);
+    }
+
+    for(size_t i=0; i<length; ++i) {
+        if(text[i] == '\n') {
+            put_byte_polled('\r');
+        }
+        put_byte_polled(text[i]);
+    }
+}
+
+int serial_interrupt(void) {
+    if(!serial.present) {
+        return 0;
+    }
+
+    // reading the id register acknowledges the transmit empty interrupt
+    (void) inb(serial.port + serial_interrupt_id);
+
+    ticket_lock(&serial_lock);
+    start_tx_locked();
+    ticket_unlock(&serial_lock);
+
+    return 0;
+}
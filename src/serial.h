@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SERIAL_COM1 0x3F8
+#define SERIAL_COM1_IRQ 4
+
+#define SERIAL_DEFAULT_BAUD 115200
+
+// Characters queued for transmission, must be a power of two
+#define SERIAL_TX_RING_SIZE 16384
+
+/* Sets up the 16550 at port for 8N1 with FIFOs enabled and unmasks irq.
+ * Returns 0 on success. Non-zero if no working uart answers on the port.
+ * The interrupt handler must already be installed.
+ */
+int serial_init(uint16_t port, uint8_t irq, uint32_t baud);
+
+bool serial_present(void);
+
+/* Queues text for transmission and returns, the transmit interrupt feeds
+ * the FIFO. '\n' goes out as "\r\n". Only waits for the uart when the
+ * ring is full. Safe from interrupt handlers.
+ */
+void serial_write(const char *text, size_t length);
+
+// Transmits everything queued by polling, for use with interrupts disabled or before halting
+void serial_flush(void);
+
+/* Transmits text by polling, without the lock, for reporting a fault that
+ * may have hit while it was held. Anything queued goes out first if the
+ * lock is free.
+ */
+void serial_write_polled(const char *text, size_t length);
+
+int serial_interrupt(void);
@@ -0,0 +1,148 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "pit.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "workqueue.h"
+#include "paging.h"
+#include "memory_map.h"
+#include "pmu.h"
+#include "terminal.h"
+
+// How long the BSP waits for application processors to check in
+static const uint64_t ap_boot_timeout_ms = 100;
+
+static struct per_cpu per_cpu_areas[MAX_CPUS];
+static volatile size_t cpus_online = 1;
+
+// Shared with ap_trampoline.s, each AP takes the next stack by index
+volatile uint32_t ap_boot_count;
+uint32_t ap_stack_count;
+uintptr_t ap_stack_tops[MAX_CPUS - 1];
+
+static struct thread *ap_idle_threads[MAX_CPUS - 1];
+
+// APs run their setup one at a time, the frame allocator is shared
+static volatile uint32_t ap_init_turn;
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_cr3[];
+
+void per_cpu_init(size_t cpu_id) {
+    struct per_cpu *cpu = &per_cpu_areas[cpu_id];
+
+    cpu->self = cpu;
+    cpu->cpu_id = cpu_id;
+
+    write_msr(msr_gs_base, (uintptr_t) cpu);
+}
+
+struct per_cpu* get_per_cpu(size_t cpu_id) {
+    return &per_cpu_areas[cpu_id];
+}
+
+size_t smp_cpu_count(void) {
+    return cpus_online;
+}
+
+void smp_send_reschedule(size_t cpu_id) {
+    lapic_send_ipi(per_cpu_areas[cpu_id].apic_id, apic_reschedule_vector);
+}
+
+static void wait_ticks(uint64_t ticks) {
+    uint64_t start = pit_get_ticks();
+
+    // one extra as we may be just before a tick edge
+    while(pit_get_ticks() - start < ticks + 1) {
+        cpu_relax();
+    }
+}
+
+/* Returns the page number the trampoline was copied to, the memory map
+ * keeps a page below 1MiB for it.
+ */
+static uint8_t copy_trampoline(void) {
+    uint64_t addr = memory_map_trampoline_page();
+    assert(addr != 0);
+
+    struct frame frame;
+    get_frame_for_addr(&frame, addr);
+
+    identity_map_page(&frame, present_bit | writeable_bit, memory_type_write_back);
+
+    uint8_t *trampoline = (uint8_t*) get_frame_start_addr(&frame);
+    memcpy(trampoline, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+
+    // APs share the BSP's page tables
+    *(uint32_t*)(trampoline + (ap_trampoline_cr3 - ap_trampoline_start)) = read_cr3();
+
+    return frame.number;
+}
+
+// Entered from ap_trampoline.s on the AP's idle thread stack
+void ap_main(uint32_t index) {
+    size_t cpu_id = index + 1;
+
+    per_cpu_init(cpu_id);
+    pat_init();
+
+    while(__atomic_load_n(&ap_init_turn, __ATOMIC_ACQUIRE) != index) {
+        cpu_relax();
+    }
+
+    lapic_init();
+    this_cpu()->apic_id = lapic_id();
+    pmu_cpu_init();
+
+    scheduler_init(ap_idle_threads[index]);
+    workqueue_init();
+    lapic_timer_start();
+
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&ap_init_turn, 1, __ATOMIC_RELEASE);
+
+    asm volatile("sti");
+    scheduler_idle_loop();
+}
+
+void smp_init(void) {
+    lapic_init();
+    this_cpu()->apic_id = lapic_id();
+    lapic_timer_calibrate();
+
+    uint8_t trampoline_page = copy_trampoline();
+
+    for(size_t i=0; i<MAX_CPUS - 1; ++i) {
+        ap_idle_threads[i] = thread_create_idle(i + 1);
+        assert(ap_idle_threads[i] != NULL);
+        ap_stack_tops[i] = ap_idle_threads[i]->stack_top;
+    }
+    ap_stack_count = MAX_CPUS - 1;
+
+    // INIT-SIPI-SIPI, Intel MultiProcessor Specification B.4
+    lapic_send_init_all();
+    wait_ticks(1);
+    lapic_send_startup_all(trampoline_page);
+    wait_ticks(1);
+    lapic_send_startup_all(trampoline_page);
+
+    wait_ticks(ap_boot_timeout_ms * pit_get_frequency() / 1000);
+
+    uint32_t started = ap_boot_count;
+    if(started > ap_stack_count) {
+        started = ap_stack_count;
+    }
+
+    while(cpus_online < started + 1) {
+        cpu_relax();
+    }
+
+    // hand the unused idle stacks back
+    for(size_t i=started; i<MAX_CPUS - 1; ++i) {
+        ap_idle_threads[i]->state = thread_dead;
+    }
+
+    terminal_printf("SMP: %#zx cpus online\n", cpus_online);
+}
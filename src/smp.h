@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+
+// Starts every application processor, called on the BSP once the scheduler is up
+void smp_init(void);
+
+size_t smp_cpu_count(void);
+
+// Brings another cpu out of hlt so it looks at its run queue
+void smp_send_reschedule(size_t cpu_id);
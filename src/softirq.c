@@ -0,0 +1,114 @@
+#include "softirq.h"
+#include "workqueue.h"
+#include "terminal.h"
+#include "cpu.h"
+#include "ring.h"
+#include "scheduler.h"
+
+// Single producer (the interrupt handler) single consumer (the bottom half,
+// of which at most one instance is queued at a time) ring per vector
+struct softirq_vector {
+    struct spsc_ring ring;
+    uint64_t storage[SOFTIRQ_RING_SIZE];
+
+    softirq_handler handler;
+    volatile bool scheduled;
+    struct work_item work;
+
+    struct softirq_stats stats;
+} __attribute__ ((aligned (64)));
+
+static struct softirq_vector softirq_vectors[SOFTIRQ_VECTOR_COUNT];
+
+static inline struct softirq_vector* get_softirq_vector(uint8_t vector) {
+    assert(vector >= SOFTIRQ_FIRST_VECTOR && vector < SOFTIRQ_FIRST_VECTOR + SOFTIRQ_VECTOR_COUNT);
+    return &softirq_vectors[vector - SOFTIRQ_FIRST_VECTOR];
+}
+
+static void softirq_run(struct work_item *item) {
+    struct softirq_vector *sv = item->arg;
+    uint8_t vector = (sv - softirq_vectors) + SOFTIRQ_FIRST_VECTOR;
+
+    do {
+        uint64_t data;
+
+        while(spsc_ring_pop(&sv->ring, &data) == 0) {
+            uint64_t start = read_tsc();
+            sv->handler(vector, data);
+            uint64_t cycles = read_tsc() - start;
+
+            if(cycles > sv->stats.max_handler_cycles) {
+                sv->stats.max_handler_cycles = cycles;
+            }
+            ++sv->stats.processed;
+        }
+
+        __atomic_store_n(&sv->scheduled, false, __ATOMIC_SEQ_CST);
+
+        // anything raised after the drain but before the flag was cleared
+        // did not queue a new run, so pick it up here
+    } while(spsc_ring_count(&sv->ring) != 0
+            && !__atomic_exchange_n(&sv->scheduled, true, __ATOMIC_SEQ_CST));
+}
+
+void softirq_register(uint8_t vector, softirq_handler handler) {
+    struct softirq_vector *sv = get_softirq_vector(vector);
+
+    spsc_ring_init(&sv->ring, sv->storage, SOFTIRQ_RING_SIZE, sizeof(uint64_t));
+    sv->work.function = softirq_run;
+    sv->work.arg = sv;
+    sv->work.group = NULL;
+
+    // publishes the ring and work item to softirq_raise
+    __atomic_store_n(&sv->handler, handler, __ATOMIC_RELEASE);
+}
+
+int softirq_raise(uint8_t vector, uint64_t data) {
+    struct softirq_vector *sv = get_softirq_vector(vector);
+
+    // the ring isn't set up until a handler is registered
+    if(__atomic_load_n(&sv->handler, __ATOMIC_ACQUIRE) == NULL || spsc_ring_push(&sv->ring, &data) != 0) {
+        ++sv->stats.dropped;
+        return -1;
+    }
+
+    ++sv->stats.raised;
+
+    if(!__atomic_exchange_n(&sv->scheduled, true, __ATOMIC_SEQ_CST)) {
+        if(work_submit(&sv->work) != 0) {
+            // picked up by the next raise
+            sv->scheduled = false;
+        }
+    }
+
+    return 0;
+}
+
+void softirq_irq_exit(uint8_t vector, uint64_t start) {
+    struct softirq_vector *sv = get_softirq_vector(vector);
+    uint64_t cycles = read_tsc() - start;
+
+    if(cycles > sv->stats.max_irq_cycles) {
+        sv->stats.max_irq_cycles = cycles;
+    }
+
+    // the worker was woken for the bottom half, run it instead of waiting out the quantum
+    if(__atomic_load_n(&sv->scheduled, __ATOMIC_ACQUIRE)) {
+        scheduler_preempt();
+    }
+}
+
+void softirq_print_stats(void) {
+    for(size_t i=0; i<SOFTIRQ_VECTOR_COUNT; ++i) {
+        struct softirq_vector *sv = &softirq_vectors[i];
+        if(sv->handler == NULL) {
+            continue;
+        }
+
+        terminal_printf("vector %#zx raised: %#zx\tdropped: %#zx\tprocessed: %#zx\n",
+            i + SOFTIRQ_FIRST_VECTOR, sv->stats.raised, sv->stats.dropped, sv->stats.processed);
+
+        terminal_printf("  max cycles with IF=0: %#zx\tbottom half max: %#zx\n",
+            sv->stats.max_irq_cycles, sv->stats.max_handler_cycles);
+    }
+}
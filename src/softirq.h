@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bottom halves for the PIC vectors 0x20 - 0x2f
+#define SOFTIRQ_FIRST_VECTOR 0x20
+#define SOFTIRQ_VECTOR_COUNT 16
+
+// Must be a power of two
+#define SOFTIRQ_RING_SIZE 64
+
+// Runs on a worker thread with interrupts enabled, once per raised entry
+typedef void (*softirq_handler)(uint8_t vector, uint64_t data);
+
+struct softirq_stats {
+    uint64_t raised;
+    uint64_t dropped;
+    uint64_t processed;
+
+    // longest time spent in the interrupt handler itself, in TSC cycles
+    uint64_t max_irq_cycles;
+
+    // longest run of the bottom half for one entry, with interrupts enabled
+    uint64_t max_handler_cycles;
+};
+
+void softirq_register(uint8_t vector, softirq_handler handler);
+
+/* Called from the interrupt handler. Queues data for the bottom half.
+ * Returns 0 on success. Non-zero if the ring was full and data was dropped.
+ */
+int softirq_raise(uint8_t vector, uint64_t data);
+
+/* Called last thing in the interrupt handler, start is the TSC read on
+ * entry to it. Records the handler time and, if the bottom half is queued,
+ * switches to it as the interrupt returns.
+ */
+void softirq_irq_exit(uint8_t vector, uint64_t start);
+
+// Prints the worst case time with IF=0 and the longest bottom half run per vector
+void softirq_print_stats(void);
@@ -0,0 +1,441 @@
+#include "spinlock.h"
+#include "cpu.h"
+#include "smp.h"
+#include "thread.h"
+#include "terminal.h"
+#include "benchmark.h"
+#include "boot_param.h"
+
+#ifdef LOCK_STATS
+static inline void lock_acquired(struct lock_stats *stats, uint64_t spins) {
+    ++stats->acquisitions;
+    if(spins != 0) {
+        ++stats->contended;
+        stats->spins += spins;
+    }
+    stats->acquired_at = read_tsc();
+}
+
+static inline void lock_released(struct lock_stats *stats) {
+    uint64_t held = read_tsc() - stats->acquired_at;
+
+    stats->hold_cycles_total += held;
+    if(held > stats->hold_cycles_max) {
+        stats->hold_cycles_max = held;
+    }
+}
+#else
+static inline void lock_acquired(struct lock_stats *stats, uint64_t spins) {
+    (void) stats;
+    (void) spins;
+}
+
+static inline void lock_released(struct lock_stats *stats) {
+    (void) stats;
+}
+#endif
+
+void ticket_lock_init(struct ticket_lock *lock) {
+    *lock = (struct ticket_lock) TICKET_LOCK_INIT;
+}
+
+void ticket_lock(struct ticket_lock *lock) {
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+
+    while(__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_relax();
+        ++spins;
+    }
+
+    lock_acquired(&lock->stats, spins);
+}
+
+bool ticket_trylock(struct ticket_lock *lock) {
+    uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint32_t expected = owner;
+
+    // only free if nobody holds or waits for a ticket
+    if(!__atomic_compare_exchange_n(&lock->next, &expected, owner + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    lock_acquired(&lock->stats, 0);
+    return true;
+}
+
+void ticket_unlock(struct ticket_lock *lock) {
+    lock_released(&lock->stats);
+
+    // only the holder writes owner
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t ticket_lock_irqsave(struct ticket_lock *lock) {
+    uint64_t flags = irq_save();
+    ticket_lock(lock);
+    return flags;
+}
+
+void ticket_unlock_irqrestore(struct ticket_lock *lock, uint64_t flags) {
+    ticket_unlock(lock);
+    irq_restore(flags);
+}
+
+void mcs_lock_init(struct mcs_lock *lock) {
+    *lock = (struct mcs_lock) MCS_LOCK_INIT;
+}
+
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node) {
+    node->next = NULL;
+    node->locked = true;
+
+    struct mcs_node *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    uint64_t spins = 0;
+
+    if(prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+        while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+            ++spins;
+        }
+    }
+
+    lock_acquired(&lock->stats, spins);
+}
+
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node) {
+    lock_released(&lock->stats);
+
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if(next == NULL) {
+        struct mcs_node *expected = node;
+        if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        // a waiter swapped itself in but hasn't linked to us yet
+        while((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+            cpu_relax();
+        }
+    }
+
+    __atomic_store_n(&next->locked, false, __ATOMIC_RELEASE);
+}
+
+uint64_t mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_node *node) {
+    uint64_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+void mcs_unlock_irqrestore(struct mcs_lock *lock, struct mcs_node *node, uint64_t flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+enum rw_lock_bits {
+    rw_writer = 0x80000000,
+    rw_writer_waiting = 0x40000000,
+    rw_readers_mask = 0x3fffffff
+};
+
+void rw_lock_init(struct rw_lock *lock) {
+    *lock = (struct rw_lock) RW_LOCK_INIT;
+}
+
+// Readers run concurrently, so the stats only cover the write side
+void read_lock(struct rw_lock *lock) {
+    while(1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+        if((state & (rw_writer | rw_writer_waiting)) == 0
+            && __atomic_compare_exchange_n(&lock->state, &state, state + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+
+        cpu_relax();
+    }
+}
+
+void read_unlock(struct rw_lock *lock) {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(struct rw_lock *lock) {
+    uint64_t spins = 0;
+
+    while(1) {
+        uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+        if((state & ~rw_writer_waiting) == 0) {
+            // taking the lock clears waiting, other waiting writers set it again
+            if(__atomic_compare_exchange_n(&lock->state, &state, rw_writer, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if((state & rw_writer_waiting) == 0) {
+            __atomic_fetch_or(&lock->state, rw_writer_waiting, __ATOMIC_RELAXED);
+        }
+
+        cpu_relax();
+        ++spins;
+    }
+
+    lock_acquired(&lock->stats, spins);
+}
+
+void write_unlock(struct rw_lock *lock) {
+    lock_released(&lock->stats);
+    __atomic_fetch_and(&lock->state, ~rw_writer, __ATOMIC_RELEASE);
+}
+
+uint64_t read_lock_irqsave(struct rw_lock *lock) {
+    uint64_t flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(struct rw_lock *lock, uint64_t flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+uint64_t write_lock_irqsave(struct rw_lock *lock) {
+    uint64_t flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(struct rw_lock *lock, uint64_t flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
+
+void seqlock_init(struct seqlock *lock) {
+    *lock = (struct seqlock) SEQLOCK_INIT;
+}
+
+void write_seqlock(struct seqlock *lock) {
+    ticket_lock(&lock->lock);
+
+    // odd while the write is in progress, ordered before the data stores
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_sequnlock(struct seqlock *lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+    ticket_unlock(&lock->lock);
+}
+
+uint64_t write_seqlock_irqsave(struct seqlock *lock) {
+    uint64_t flags = irq_save();
+    write_seqlock(lock);
+    return flags;
+}
+
+void write_sequnlock_irqrestore(struct seqlock *lock, uint64_t flags) {
+    write_sequnlock(lock);
+    irq_restore(flags);
+}
+
+uint32_t read_seqbegin(const struct seqlock *lock) {
+    uint32_t sequence;
+
+    while((sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+
+    return sequence;
+}
+
+bool read_seqretry(const struct seqlock *lock, uint32_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != sequence;
+}
+
+void lock_print_stats(const char *name, const struct lock_stats *stats) {
+    uint64_t average = stats->acquisitions ? stats->hold_cycles_total / stats->acquisitions : 0;
+
+    terminal_printf("%s acq: %#zx\tcontended: %#zx\tspins: %#zx\thold avg: %#zx max: %#zx\n",
+        name, stats->acquisitions, stats->contended, stats->spins,
+        average, stats->hold_cycles_max);
+}
+
+/* Contention benchmarks. Each iteration is a round of acquisitions of one
+ * lock by the runner on cpu 0 and a thread on each of the other cpus, up to
+ * bench_lock_cpus of them. Interrupts stay off while holding the lock so a
+ * holder is never preempted.
+ */
+#define LOCK_BENCHMARK_ROUND 64
+
+// Every this many acquisitions of the rw lock is a write
+#define LOCK_BENCHMARK_RW_WRITES 4
+
+static int64_t bench_lock_cpus = MAX_CPUS;
+BOOT_PARAM_INT("bench_lock_cpus", bench_lock_cpus, 1, MAX_CPUS);
+
+enum lock_benchmark_kind {
+    lock_benchmark_ticket,
+    lock_benchmark_mcs,
+    lock_benchmark_rw
+};
+
+static struct ticket_lock benchmark_ticket_lock;
+static struct mcs_lock benchmark_mcs_lock;
+static struct rw_lock benchmark_rw_lock;
+
+static enum lock_benchmark_kind benchmark_kind;
+static size_t benchmark_helpers;
+static volatile uint64_t benchmark_round;
+static volatile size_t benchmark_done;
+static volatile size_t benchmark_exited;
+static volatile bool benchmark_stop;
+static volatile uint64_t benchmark_counter;
+static volatile uint64_t benchmark_sink;
+
+static void lock_benchmark_round(void) {
+    struct mcs_node node;
+
+    for(size_t i=0; i<LOCK_BENCHMARK_ROUND; ++i) {
+        if(benchmark_kind == lock_benchmark_ticket) {
+            uint64_t flags = ticket_lock_irqsave(&benchmark_ticket_lock);
+            ++benchmark_counter;
+            ticket_unlock_irqrestore(&benchmark_ticket_lock, flags);
+        } else if(benchmark_kind == lock_benchmark_mcs) {
+            uint64_t flags = mcs_lock_irqsave(&benchmark_mcs_lock, &node);
+            ++benchmark_counter;
+            mcs_unlock_irqrestore(&benchmark_mcs_lock, &node, flags);
+        } else if(i % LOCK_BENCHMARK_RW_WRITES == 0) {
+            uint64_t flags = write_lock_irqsave(&benchmark_rw_lock);
+            ++benchmark_counter;
+            write_unlock_irqrestore(&benchmark_rw_lock, flags);
+        } else {
+            uint64_t flags = read_lock_irqsave(&benchmark_rw_lock);
+            benchmark_sink = benchmark_counter;
+            read_unlock_irqrestore(&benchmark_rw_lock, flags);
+        }
+    }
+}
+
+// Runs a round each time the runner starts one, until it stops them
+static void lock_benchmark_thread(void *arg) {
+    (void) arg;
+    uint64_t seen = 0;
+
+    for(;;) {
+        uint64_t round;
+        while((round = __atomic_load_n(&benchmark_round, __ATOMIC_ACQUIRE)) == seen) {
+            thread_yield();
+        }
+
+        if(__atomic_load_n(&benchmark_stop, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        seen = round;
+        lock_benchmark_round();
+        __atomic_add_fetch(&benchmark_done, 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_add_fetch(&benchmark_exited, 1, __ATOMIC_RELEASE);
+}
+
+static int lock_benchmark_setup(enum lock_benchmark_kind kind) {
+    size_t cpus = smp_cpu_count();
+    if(cpus > (size_t) bench_lock_cpus) {
+        cpus = bench_lock_cpus;
+    }
+
+    ticket_lock_init(&benchmark_ticket_lock);
+    mcs_lock_init(&benchmark_mcs_lock);
+    rw_lock_init(&benchmark_rw_lock);
+
+    benchmark_kind = kind;
+    benchmark_helpers = 0;
+    benchmark_round = 0;
+    benchmark_done = 0;
+    benchmark_exited = 0;
+    benchmark_stop = false;
+    benchmark_counter = 0;
+
+    // the runner is on cpu 0
+    for(size_t cpu=1; cpu<cpus; ++cpu) {
+        if(thread_create_on(cpu, "lock bench", lock_benchmark_thread, NULL) != NULL) {
+            ++benchmark_helpers;
+        }
+    }
+
+    return 0;
+}
+
+static void lock_benchmark_run(void) {
+    __atomic_store_n(&benchmark_done, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&benchmark_round, 1, __ATOMIC_RELEASE);
+
+    lock_benchmark_round();
+
+    while(__atomic_load_n(&benchmark_done, __ATOMIC_ACQUIRE) != benchmark_helpers) {
+        cpu_relax();
+    }
+}
+
+static void lock_benchmark_teardown(void *context) {
+    (void) context;
+
+    __atomic_store_n(&benchmark_stop, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&benchmark_round, 1, __ATOMIC_RELEASE);
+
+    while(__atomic_load_n(&benchmark_exited, __ATOMIC_ACQUIRE) != benchmark_helpers) {
+        thread_yield();
+    }
+
+    // the stop bumped the round too
+    size_t writes = benchmark_kind == lock_benchmark_rw ? LOCK_BENCHMARK_ROUND / LOCK_BENCHMARK_RW_WRITES : LOCK_BENCHMARK_ROUND;
+    assert(benchmark_counter == (benchmark_round - 1) * (benchmark_helpers + 1) * writes);
+
+    terminal_printf("lock bench cpus: %#zx acquisitions per round: %#zx\n", benchmark_helpers + 1, (size_t) LOCK_BENCHMARK_ROUND);
+
+    if(benchmark_kind == lock_benchmark_ticket) {
+        lock_print_stats("ticket", &benchmark_ticket_lock.stats);
+    } else if(benchmark_kind == lock_benchmark_mcs) {
+        lock_print_stats("mcs", &benchmark_mcs_lock.stats);
+    } else {
+        lock_print_stats("rw writes", &benchmark_rw_lock.stats);
+    }
+}
+
+static int ticket_benchmark_setup(void **context) {
+    (void) context;
+    return lock_benchmark_setup(lock_benchmark_ticket);
+}
+
+static int mcs_benchmark_setup(void **context) {
+    (void) context;
+    return lock_benchmark_setup(lock_benchmark_mcs);
+}
+
+static int rw_benchmark_setup(void **context) {
+    (void) context;
+    return lock_benchmark_setup(lock_benchmark_rw);
+}
+
+static void ticket_contention_benchmark(void *context) {
+    (void) context;
+    lock_benchmark_run();
+}
+BENCHMARK_WITH_SETUP("lock_ticket_contention", ticket_contention_benchmark, ticket_benchmark_setup, lock_benchmark_teardown);
+
+static void mcs_contention_benchmark(void *context) {
+    (void) context;
+    lock_benchmark_run();
+}
+BENCHMARK_WITH_SETUP("lock_mcs_contention", mcs_contention_benchmark, mcs_benchmark_setup, lock_benchmark_teardown);
+
+static void rw_contention_benchmark(void *context) {
+    (void) context;
+    lock_benchmark_run();
+}
+BENCHMARK_WITH_SETUP("lock_rw_contention", rw_contention_benchmark, rw_benchmark_setup, lock_benchmark_teardown);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Contention statistics are only kept when built with -DLOCK_STATS.
+// Everything but spins is updated while the lock is held. Cycles are TSC cycles.
+struct lock_stats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t spins;
+    uint64_t hold_cycles_total;
+    uint64_t hold_cycles_max;
+    uint64_t acquired_at;
+};
+
+// Fair FIFO lock, every waiter spins on the same cache line
+struct ticket_lock {
+    volatile uint32_t next;
+    volatile uint32_t owner;
+    struct lock_stats stats;
+};
+
+// Queue lock, every waiter spins on its own node
+struct mcs_node {
+    struct mcs_node *volatile next;
+    volatile bool locked;
+} __attribute__ ((aligned (64)));
+
+struct mcs_lock {
+    struct mcs_node *volatile tail;
+    struct lock_stats stats;
+};
+
+// Readers share the lock, a waiting writer stops new readers from entering
+struct rw_lock {
+    volatile uint32_t state;
+    struct lock_stats stats;
+};
+
+// Writers are serialised by the ticket lock, readers never write to the lock
+// and retry if a write overlapped their read
+struct seqlock {
+    volatile uint32_t sequence;
+    struct ticket_lock lock;
+};
+
+#define TICKET_LOCK_INIT { 0, 0, { 0 } }
+#define MCS_LOCK_INIT { NULL, { 0 } }
+#define RW_LOCK_INIT { 0, { 0 } }
+#define SEQLOCK_INIT { 0, TICKET_LOCK_INIT }
+
+void ticket_lock_init(struct ticket_lock *lock);
+void ticket_lock(struct ticket_lock *lock);
+bool ticket_trylock(struct ticket_lock *lock);
+void ticket_unlock(struct ticket_lock *lock);
+uint64_t ticket_lock_irqsave(struct ticket_lock *lock);
+void ticket_unlock_irqrestore(struct ticket_lock *lock, uint64_t flags);
+
+void mcs_lock_init(struct mcs_lock *lock);
+void mcs_lock(struct mcs_lock *lock, struct mcs_node *node);
+void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node);
+uint64_t mcs_lock_irqsave(struct mcs_lock *lock, struct mcs_node *node);
+void mcs_unlock_irqrestore(struct mcs_lock *lock, struct mcs_node *node, uint64_t flags);
+
+void rw_lock_init(struct rw_lock *lock);
+void read_lock(struct rw_lock *lock);
+void read_unlock(struct rw_lock *lock);
+void write_lock(struct rw_lock *lock);
+void write_unlock(struct rw_lock *lock);
+uint64_t read_lock_irqsave(struct rw_lock *lock);
+void read_unlock_irqrestore(struct rw_lock *lock, uint64_t flags);
+uint64_t write_lock_irqsave(struct rw_lock *lock);
+void write_unlock_irqrestore(struct rw_lock *lock, uint64_t flags);
+
+void seqlock_init(struct seqlock *lock);
+void write_seqlock(struct seqlock *lock);
+void write_sequnlock(struct seqlock *lock);
+uint64_t write_seqlock_irqsave(struct seqlock *lock);
+void write_sequnlock_irqrestore(struct seqlock *lock, uint64_t flags);
+
+/* Usage:
+ *  uint32_t seq;
+ *  do {
+ *      seq = read_seqbegin(&lock);
+ *      ... copy the protected data ...
+ *  } while(read_seqretry(&lock, seq));
+ */
+uint32_t read_seqbegin(const struct seqlock *lock);
+bool read_seqretry(const struct seqlock *lock, uint32_t sequence);
+
+void lock_print_stats(const char *name, const struct lock_stats *stats);
@@ -0,0 +1,211 @@
+#include "symbols.h"
+#include "paging.h"
+#include "terminal.h"
+
+struct elf64_symbol {
+    uint32_t st_name;
+    uint8_t st_info;
+    uint8_t st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} __attribute__ ((packed));
+
+enum elf_symbol_type {
+    stt_notype = 0,
+    stt_object = 1,
+    stt_func = 2,
+    stt_section = 3,
+    stt_file = 4
+};
+
+static const uint16_t shn_undef = 0;
+static const uint16_t shn_loreserve = 0xff00;
+
+// The kernel is linked at 1MiB so 32 bits hold any of its addresses
+struct symbol_entry {
+    uint32_t address;
+    uint32_t size;
+    uint32_t name;
+};
+
+// After the modules, the tables aren't page aligned so they can't be identity mapped read only
+static const uintptr_t symbol_area_start = 4UL * 4096 * 512 * 512;
+
+static struct symbol_entry entries[SYMBOLS_MAX_COUNT];
+static size_t entry_count;
+
+static const char *string_table;
+static size_t string_table_size;
+
+// Returns where the section's contents were mapped
+static uintptr_t map_section(struct multiboot_elf_section_header *section, uintptr_t *next) {
+    uintptr_t first = section->sh_addr & ~(uintptr_t) (PAGE_SIZE - 1);
+    uintptr_t base = *next;
+
+    for(uintptr_t addr = first; addr < section->sh_addr + section->sh_size; addr += PAGE_SIZE) {
+        struct frame frame;
+        struct page page;
+        get_frame_for_addr(&frame, addr);
+        get_page_for_vaddr(*next, &page);
+        map_page_to_frame(&page, &frame, present_bit | no_exec_bit, memory_type_write_back);
+        *next += PAGE_SIZE;
+    }
+
+    return base + (section->sh_addr - first);
+}
+
+static bool entry_less(const struct symbol_entry *a, const struct symbol_entry *b) {
+    return a->address < b->address;
+}
+
+static void sift_down(size_t root, size_t count) {
+    while(2 * root + 1 < count) {
+        size_t child = 2 * root + 1;
+
+        if(child + 1 < count && entry_less(&entries[child], &entries[child + 1])) {
+            ++child;
+        }
+
+        if(!entry_less(&entries[root], &entries[child])) {
+            return;
+        }
+
+        struct symbol_entry tmp = entries[root];
+        entries[root] = entries[child];
+        entries[child] = tmp;
+        root = child;
+    }
+}
+
+// Heapsort, the symbol table comes in no particular order and there's no heap to spare
+static void sort_entries(void) {
+    for(size_t i = entry_count / 2; i-- > 0;) {
+        sift_down(i, entry_count);
+    }
+
+    for(size_t end = entry_count; end-- > 1;) {
+        struct symbol_entry tmp = entries[0];
+        entries[0] = entries[end];
+        entries[end] = tmp;
+        sift_down(0, end);
+    }
+}
+
+// Assembly labels have no type, they count as functions if they're in an executable section
+static bool is_code_symbol(const struct elf64_symbol *symbol, struct multiboot_elf_symbols *sections) {
+    uint8_t type = symbol->st_info & 0xf;
+
+    if(type != stt_func && type != stt_notype) {
+        return false;
+    }
+
+    if(symbol->st_shndx == shn_undef || symbol->st_shndx >= shn_loreserve || symbol->st_shndx >= sections->num) {
+        return false;
+    }
+
+    return symbol->st_name != 0 && symbol->st_value <= UINT32_MAX
+        && elf_section_is_exectuable(&sections->sectionheaders[symbol->st_shndx]);
+}
+
+void symbols_init(struct multiboot_data *data) {
+    struct multiboot_elf_symbols *sections = data->elf_symbols;
+    struct multiboot_elf_section_header *symtab = NULL;
+
+    for(size_t i=0; i<sections->num; ++i) {
+        if(sections->sectionheaders[i].sh_type == sht_symtab) {
+            symtab = &sections->sectionheaders[i];
+            break;
+        }
+    }
+
+    if(symtab == NULL || symtab->sh_addr == 0 || symtab->sh_link >= sections->num) {
+        terminal_printf("No kernel symbol table\n");
+        return;
+    }
+
+    struct multiboot_elf_section_header *strtab = &sections->sectionheaders[symtab->sh_link];
+
+    uintptr_t next = symbol_area_start;
+    const struct elf64_symbol *symbols = (const struct elf64_symbol*) map_section(symtab, &next);
+    string_table = (const char*) map_section(strtab, &next);
+    string_table_size = strtab->sh_size;
+
+    size_t symbol_count = symtab->sh_size / sizeof(struct elf64_symbol);
+    size_t skipped = 0;
+
+    for(size_t i=0; i<symbol_count; ++i) {
+        const struct elf64_symbol *symbol = &symbols[i];
+
+        if(!is_code_symbol(symbol, sections) || symbol->st_name >= string_table_size) {
+            continue;
+        }
+
+        if(entry_count == SYMBOLS_MAX_COUNT) {
+            ++skipped;
+            continue;
+        }
+
+        entries[entry_count++] = (struct symbol_entry) { symbol->st_value, symbol->st_size, symbol->st_name };
+    }
+
+    sort_entries();
+
+    terminal_printf("Symbols: %zu functions indexed, %zu skipped\n", entry_count, skipped);
+}
+
+/* Sized functions end at their size. Assembly labels have size 0 and run
+ * up to the next symbol.
+ */
+const char* symbols_lookup(uintptr_t addr, uintptr_t *offset) {
+    size_t low = 0;
+    size_t high = entry_count;
+
+    // find the first entry starting after addr
+    while(low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if(entries[middle].address <= addr) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if(low == 0) {
+        return NULL;
+    }
+
+    // aliases share an address, prefer one with a size
+    size_t index = low - 1;
+    while(index > 0 && entries[index - 1].address == entries[index].address && entries[index].size == 0) {
+        --index;
+    }
+
+    const struct symbol_entry *entry = &entries[index];
+
+    if(entry->size != 0 && addr - entry->address >= entry->size) {
+        return NULL;
+    }
+
+    if(offset != NULL) {
+        *offset = addr - entry->address;
+    }
+
+    return string_table + entry->name;
+}
+
+void symbols_print_address(uintptr_t addr) {
+    uintptr_t offset;
+    const char *name = symbols_lookup(addr, &offset);
+
+    if(name != NULL) {
+        terminal_printf("%#zx %s+%#zx\n", addr, name, offset);
+    } else {
+        terminal_printf("%#zx\n", addr);
+    }
+}
+
+size_t symbols_count(void) {
+    return entry_count;
+}
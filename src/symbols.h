@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "multiboot.h"
+
+/* Address to name lookup for kernel code, built from the .symtab grub
+ * loads with the kernel. The index holds the start, size and string table
+ * offset of each function sorted by address. Lookups are a binary search
+ * that neither allocates nor takes locks, so they are safe in fault
+ * handlers and interrupts.
+ */
+
+// Functions past this are left out of the index
+#define SYMBOLS_MAX_COUNT 4096
+
+// Maps the symbol and string tables and builds the index. Must run after remap_kernel.
+void symbols_init(struct multiboot_data *data);
+
+/* Returns the name of the function containing addr and sets offset to the
+ * distance from its start. Returns NULL if no function contains addr or
+ * the index hasn't been built.
+ */
+const char* symbols_lookup(uintptr_t addr, uintptr_t *offset);
+
+// Prints addr as "0x... name+0x..", or just the address if it isn't in a function
+void symbols_print_address(uintptr_t addr);
+
+size_t symbols_count(void);
@@ -1,9 +1,30 @@
 #include "terminal.h"
+#include "spinlock.h"
+#include "format.h"
+#include "cpu.h"
+#include "serial.h"
+#include "framebuffer.h"
+#include "benchmark.h"
+#include "workqueue.h"
 
 const int tab_space_num = 4;
 
 static Terminal terminal;
 
+// Taken by the public entry points, everything static assumes it is held
+static struct ticket_lock terminal_lock = TICKET_LOCK_INIT;
+
+// Cpus reporting a fault, their output goes around the locks, see terminal_panic_begin
+static volatile bool panicking[MAX_CPUS];
+
+// The framebuffer is drawn with SSE and the interrupt shims don't save it,
+// so the timer hands that flush to a worker thread
+static struct work_item flush_work;
+static volatile bool flush_queued;
+
+// A fault report draws from the exception handler, it keeps the interrupted SSE state here
+static uint8_t panic_fpu_state[MAX_CPUS][512] __attribute__ ((aligned (16)));
+
 static inline vga_color make_vga_color(vga_color_code fg, vga_color_code bg) {
 	return fg | bg << 4;
 }
@@ -12,569 +33,516 @@ static inline vga_char make_vga_char(unsigned char uc, vga_color color) {
 	return (uint16_t) uc | (uint16_t) color << 8;
 }
 
+static const uint32_t all_lines_dirty = (1u << TERMINAL_HEIGHT) - 1;
+
+static inline vga_char* terminal_line(size_t y) {
+	return terminal.shadow[(terminal.top + y) % terminal.col_max];
+}
+
 static inline void terminal_put_char_at(vga_char c, size_t x, size_t y) {
-	terminal.buffer[x + y * terminal.row_max] = c;
+	terminal_line(y)[x] = c;
+	terminal.dirty |= 1u << y;
 }
 
-void init_terminal(void) {
-	terminal.col = 0;
-	terminal.row = 0;
-	terminal.buffer = (uint16_t*) 0xB8000;
-	terminal.default_color = make_vga_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
-	terminal.color = terminal.default_color;
-	terminal.col_max = COL_MAX;
-	terminal.row_max = ROW_MAX;
+static void clear_line(vga_char *line) {
+	vga_char blank = make_vga_char(' ', terminal.default_color);
 
-	clear_terminal();
+	for(size_t x=0; x < terminal.row_max; ++x) {
+		line[x] = blank;
+	}
+}
 
-	print_text("Terminal init completed.\n");
+// Lines that scroll off the top are kept run length encoded. Runs and the
+// per line index are both rings, the oldest lines go once either fills up.
+struct vga_run {
+	uint16_t length;
+	vga_char c;
+};
+
+struct history_line {
+	uint32_t first_run;
+	uint16_t run_count;
+};
+
+static struct {
+	struct vga_run runs[TERMINAL_SCROLLBACK_RUNS];
+	uint32_t run_head;
+	uint32_t run_tail;
+
+	struct history_line lines[TERMINAL_SCROLLBACK_LINES];
+	size_t line_head;
+	size_t line_tail;
+
+	// lines scrolled back from the live screen, 0 shows the live screen
+	size_t view_offset;
+	bool view_dirty;
+} scrollback;
+
+static inline size_t history_count(void) {
+	return scrollback.line_head - scrollback.line_tail;
 }
 
-void clear_terminal(void) {
+static void drop_oldest_line(void) {
+	struct history_line *line = &scrollback.lines[scrollback.line_tail % TERMINAL_SCROLLBACK_LINES];
+
+	scrollback.run_tail = line->first_run + line->run_count;
+	++scrollback.line_tail;
+
+	if(scrollback.view_offset > history_count()) {
+		scrollback.view_offset = history_count();
+	}
+}
+
+static void push_history(const vga_char *text) {
+	struct vga_run encoded[TERMINAL_WIDTH];
+	uint16_t run_count = 0;
+
 	for(size_t x=0; x < terminal.row_max; ++x) {
-		for(size_t y=0; y < terminal.col_max; ++y) {
-			terminal_put_char_at(make_vga_char(' ', terminal.default_color), x, y);
+		if(run_count != 0 && encoded[run_count - 1].c == text[x]) {
+			++encoded[run_count - 1].length;
+		} else {
+			encoded[run_count++] = (struct vga_run){ 1, text[x] };
 		}
 	}
-}
 
-size_t strlen(const char* s) {
-	size_t len=0;
-	while(s[len]) {
-		++len;
+	while(history_count() == TERMINAL_SCROLLBACK_LINES
+		|| (uint32_t) (scrollback.run_head - scrollback.run_tail) + run_count > TERMINAL_SCROLLBACK_RUNS) {
+		drop_oldest_line();
 	}
 
-	return len;
-}
+	struct history_line *line = &scrollback.lines[scrollback.line_head % TERMINAL_SCROLLBACK_LINES];
+	line->first_run = scrollback.run_head;
+	line->run_count = run_count;
 
-static void scroll_terminal(void) {
-	for(size_t x=0; x < terminal.row_max; x++) {
-		for(size_t y=0; y < terminal.col_max-1; y++) {
-			terminal.buffer[x + y * terminal.row_max] = terminal.buffer[x + (1+y) * terminal.row_max];
-		}
+	for(uint16_t i=0; i < run_count; ++i) {
+		scrollback.runs[(scrollback.run_head + i) % TERMINAL_SCROLLBACK_RUNS] = encoded[i];
 	}
 
-	for(size_t x=0; x < terminal.row_max; x++) {
-		terminal_put_char_at(make_vga_char(' ', terminal.default_color), x, terminal.col_max-1);
+	scrollback.run_head += run_count;
+	++scrollback.line_head;
+
+	// keep showing the same lines while scrolled back
+	if(scrollback.view_offset != 0) {
+		++scrollback.view_offset;
 	}
 }
 
-void print_newline(void) {
-	terminal.row = 0;
-	terminal.col++;
-	if(terminal.col == terminal.col_max) {
-		scroll_terminal();
-		terminal.col--;
+static void decode_history_line(size_t index, vga_char *text) {
+	struct history_line *line = &scrollback.lines[(scrollback.line_tail + index) % TERMINAL_SCROLLBACK_LINES];
+	size_t x = 0;
+
+	for(uint16_t i=0; i < line->run_count; ++i) {
+		struct vga_run run = scrollback.runs[(line->first_run + i) % TERMINAL_SCROLLBACK_RUNS];
+
+		for(uint16_t j=0; j < run.length; ++j) {
+			text[x++] = run.c;
+		}
 	}
 }
 
-void terminal_put_char(vga_char c) {
-	terminal_put_char_at(c, terminal.row, terminal.col);
+// VGA memory is write combining, write whole lines with as few stores as possible
+static void write_vga_line(size_t y, const vga_char *text) {
+	const uint64_t *src = (const uint64_t*) text;
+	volatile uint64_t *dest = (volatile uint64_t*) &terminal.buffer[y * terminal.row_max];
 
-	++terminal.row;
-	if(terminal.row == terminal.row_max) {
-		terminal.row = 0;
-		print_newline();
+	for(size_t i=0; i < TERMINAL_WIDTH * sizeof(vga_char) / sizeof(uint64_t); ++i) {
+		dest[i] = src[i];
 	}
 }
 
-static const char newline = '\n';
+static void write_screen_line(size_t y, const vga_char *text) {
+	if(terminal.backends & TERMINAL_BACKEND_VGA) {
+		write_vga_line(y, text);
+	}
 
-void terminal_print_char(char c) {
-	if(c == newline) {
-		print_newline();
-	} else {
-		terminal_put_char(make_vga_char(c, terminal.default_color));
+	if(terminal.backends & TERMINAL_BACKEND_FRAMEBUFFER) {
+		framebuffer_draw_line(y, text, terminal.row_max);
 	}
 }
 
-void print_text(const char* text) {
-	for(size_t i=0; i < strlen(text); ++i) {
-		if(text[i] == newline) {
-			print_newline();
+// Redraws one screen's worth, however long the history is
+static void draw_view(void) {
+	vga_char text[TERMINAL_WIDTH] __attribute__ ((aligned (8)));
+	size_t first = history_count() - scrollback.view_offset;
+
+	for(size_t y=0; y < terminal.col_max; ++y) {
+		size_t index = first + y;
+
+		if(index < history_count()) {
+			decode_history_line(index, text);
+			write_screen_line(y, text);
 		} else {
-			terminal_put_char(make_vga_char(text[i], terminal.default_color));
+			write_screen_line(y, terminal_line(index - history_count()));
 		}
 	}
 }
 
-static void print_tab() {
-	size_t cur_col = terminal.row;
-	size_t spaces_needed = tab_space_num - (cur_col % tab_space_num);
+static void flush_locked(void) {
+	if(scrollback.view_offset != 0) {
+		if(scrollback.view_dirty || terminal.dirty != 0) {
+			draw_view();
+		}
 
-	if(spaces_needed + cur_col >= ROW_MAX) {
-		print_newline();
-	} else {
-		vga_char sp = make_vga_char(' ', terminal.default_color);
+		// everything is redrawn when the view returns to the live screen
+		scrollback.view_dirty = false;
+		terminal.dirty = 0;
+		store_fence();
+		return;
+	}
 
-		for(int i=0; i < spaces_needed; ++i) {
-			terminal_put_char(sp);
+	uint32_t dirty = terminal.dirty;
+
+	for(size_t y=0; dirty != 0; ++y, dirty >>= 1) {
+		if(dirty & 1) {
+			write_screen_line(y, terminal_line(y));
 		}
 	}
+
+	terminal.dirty = 0;
+	store_fence();
 }
 
-enum types {
-	INT, 
-	S_CHAR, 
-	CHAR, 
-	SHORT_INT, 
-	LONG_INT, 
-	LONG_LONG_INT, 
-	INTMAX_T, 
-	SIZE_T, 
-	PTRDIFF_T, 
-	LONG_DOUBLE, 
-	WINT_T, 
-	WCHAR_T, 
-	VOID, 
-	DOUBLE, 
-	NO_FORMAT
-};
+void terminal_flush(void) {
+	size_t cpu = this_cpu_id();
 
-enum printf_flags {
-	NO_FLAGS = 0x0,
-	LEFT_JUSTIFY = 0x01,
-	ALWAYS_SHOW_SIGN = 0x02,
-	ALWAYS_SHOW_SPACE = 0x04,
-	ALWAYS_SHOW_0x_OR_DECIMAL_POINT = 0x08,
-	LEFT_PAD_WITH_ZEROS = 0x10
-};
+	if(panicking[cpu]) {
+		// the serial output went out by polling already
+		asm volatile("fxsave %0" : "=m"(panic_fpu_state[cpu]));
+		flush_locked();
+		asm volatile("fxrstor %0" : : "m"(panic_fpu_state[cpu]));
+		return;
+	}
 
-enum width_format {
-	NONE = 0, FORMAT_ARG_SPECIFIED = -2
-};
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
+	flush_locked();
+	ticket_unlock_irqrestore(&terminal_lock, flags);
 
-struct printf_format {
-	enum printf_flags flags;
-	int width;
-	int precision;
+	if(terminal.backends & TERMINAL_BACKEND_SERIAL) {
+		serial_flush();
+	}
+}
 
-	enum types type;
-	int is_unsigned;
-	int is_pointer;
-	char specifier;
-};
+static void flush_work_function(struct work_item *item) {
+	(void) item;
 
-/* Returns:
- * -1 for error
- * 0 for nothing found
- * Returns integer offset of the next character to be read
- */
-static int get_flags(struct printf_format* format, const char* str) {
-	int i = 0;
-	format->flags = NO_FLAGS;
-
-	switch(str[i]) {
-		case '-':
-			++i;
-			format->flags |= LEFT_JUSTIFY;
-			break;
-		case '+':
-			++i;
-			format->flags |= ALWAYS_SHOW_SIGN;
-			break;
-		case ' ':
-			++i;
-			format->flags |= ALWAYS_SHOW_SPACE;
-			break;
-		case '#':
-			++i;
-			format->flags |= ALWAYS_SHOW_0x_OR_DECIMAL_POINT;
-			break;
-		case '0':
-			++i;
-			format->flags |= LEFT_PAD_WITH_ZEROS;
-			break;
-		default:
-			break;
-	}
+	// anything drawn after this is flushed by the next tick
+	__atomic_store_n(&flush_queued, false, __ATOMIC_RELEASE);
 
-	return i;
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
+	flush_locked();
+	ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
-static inline int read_decimal(const char* str, int* pos) {
-	int i = *pos;
-	int d = 0;
-	int power = 1;
+void terminal_timer_flush(void) {
+	if(terminal.dirty == 0 && !scrollback.view_dirty) {
+		return;
+	}
+
+	if(terminal.backends & TERMINAL_BACKEND_FRAMEBUFFER) {
+		if(!__atomic_exchange_n(&flush_queued, true, __ATOMIC_ACQ_REL)) {
+			flush_work.function = flush_work_function;
+			if(work_submit(&flush_work) != 0) {
+				__atomic_store_n(&flush_queued, false, __ATOMIC_RELEASE);
+			}
+		}
+		return;
+	}
 
-	while(str[i] >= '0' && str[i] <= '9') {
-		d += power * (str[i] - '0');
-		power *= 10;
-		++i;
+	if(!ticket_trylock(&terminal_lock)) {
+		return;
 	}
 
-	*pos = i;
-	return d;
+	flush_locked();
+	ticket_unlock(&terminal_lock);
 }
 
-static int get_width(struct printf_format* format, const char* str) {
-	if(str[0] == '*') {
-		format->width = FORMAT_ARG_SPECIFIED;
-		return 1;
-	}
-	
-	int i=0;
-	int spec = read_decimal(&str[i], &i);
-	format->width = spec;
+bool terminal_panic_begin(void) {
+	bool locked = ticket_trylock(&terminal_lock);
+	panicking[this_cpu_id()] = true;
 
-	return i;
+	return locked;
 }
 
-static int get_precision(struct printf_format* format, const char* str) {
-	if(str[0] != '.') {
-		format->precision = NONE;
-		return 0;
+void terminal_panic_end(bool locked) {
+	panicking[this_cpu_id()] = false;
+
+	if(locked) {
+		ticket_unlock(&terminal_lock);
 	}
+}
 
-	int i=1;
-	if(str[i] == '*') {
-		format->precision = FORMAT_ARG_SPECIFIED;
+static void set_view_offset(size_t offset) {
+	if(offset > history_count()) {
+		offset = history_count();
 	}
-	format->precision = read_decimal(&str[i], &i);
 
-	return i;
+	if(offset != scrollback.view_offset) {
+		scrollback.view_offset = offset;
+		scrollback.view_dirty = true;
+
+		if(offset == 0) {
+			terminal.dirty = all_lines_dirty;
+		}
+	}
 }
 
-static int get_length_and_specifier(struct printf_format* format, const char* str) {
-	int i = 0;
+void terminal_view_scroll(int lines) {
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
 
-	switch(str[i]) {
-		case 'h':
-			++i;
-			if(str[i] == 'h') {
-				format->type = S_CHAR;
-				++i;
-			} else {
-				format->type = SHORT_INT;
-			}
-			break;
-		case 'l':
-			++i;
-			if(str[i] == 'l') {
-				format->type = LONG_LONG_INT;
-				++i;
-			} else {
-				format->type = LONG_INT;
-			}
-			break;
-		case 'j':
-			++i;
-			format->type = INTMAX_T;
-			break;
-		case 'z':
-			++i;
-			format->type = SIZE_T;
-			break;
-		case 't':
-			++i;
-			format->type = PTRDIFF_T;
-			break;
-		case 'L':
-			++i;
-			format->type = LONG_DOUBLE;
-			break;
-		default:
-			format->type = INT;
-			break;
-	}
-
-	format->is_unsigned = 0;
-	format->is_pointer = 0;
-	switch(str[i]) {
-		case 'd':
-		case 'i':
-			assert(format->type != LONG_DOUBLE);
-			break;
-		case 'u':
-		case 'o':
-		case 'x':
-		case 'X':
-			format->is_unsigned = 1;
-			break;
-		case 'f':
-		case 'F':
-		case 'e':
-		case 'E':
-		case 'g':
-		case 'G':
-		case 'a':
-		case 'A':
-			assert(format->type == LONG_DOUBLE || format->type == INT);
-			if(format->type == INT) {
-				format->type = DOUBLE;
-			}
-			break;
-		case 'c':
-			assert(format->type == LONG_INT || format->type == INT);
-			if(format->type == LONG_INT) {
-				format->type = WINT_T;
-			}
-			break;
-		case 's':
-			format->is_pointer = 1;
-			assert(format->type == LONG_INT || format->type == INT);
-			if(format->type == INT) {
-				format->type = CHAR;
-			} else {
-				format->type = WCHAR_T;
-			}
-			break;
-		case 'p':
-			format->is_pointer = 1;
-			assert(format->type == INT);
-			format->type = VOID;
-			break;
-		case 'n':
-			assert(format->type != LONG_DOUBLE);
-			format->is_pointer = 1;
-		default:
-			assert(0!=0);
+	if(lines < 0 && (size_t) -lines > scrollback.view_offset) {
+		set_view_offset(0);
+	} else {
+		set_view_offset(scrollback.view_offset + lines);
 	}
 
-	format->specifier = str[i];
-
-	return i;
+	ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
-static int get_format(struct printf_format* format, const char* str) {
-	int i = 0;
-	i += get_flags(format, &str[i]);
-	assert(i != -1);
-
-	int ret = get_width(format, &str[i]);
-	assert(ret != -1);
-	i += ret;
+void terminal_view_reset(void) {
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
+	set_view_offset(0);
+	ticket_unlock_irqrestore(&terminal_lock, flags);
+}
 
-	ret = get_precision(format, &str[i]);
-	assert(ret != -1);
-	i += ret;
+void init_terminal(void) {
+	terminal.col = 0;
+	terminal.row = 0;
+	terminal.buffer = (uint16_t*) 0xB8000;
+	terminal.default_color = make_vga_color(VGA_COLOR_LIGHT_GREEN, VGA_COLOR_BLACK);
+	terminal.color = terminal.default_color;
+	terminal.col_max = COL_MAX;
+	terminal.row_max = ROW_MAX;
+	terminal.backends = TERMINAL_BACKEND_VGA;
 
-	ret = get_length_and_specifier(format, &str[i]);
-	assert(ret != -1);
-	i += ret;
+	clear_terminal();
 
-	return i;
+	print_text("Terminal init completed.\n");
+	terminal_flush();
 }
 
-static inline int min(int a, int b) {
-	if(a < b) {
-		return a;
-	} else {
-		return b;
+void terminal_set_backends(uint8_t backends) {
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
+
+	// a screen that was off hasn't seen any of the lines
+	if((backends & TERMINAL_SCREEN_BACKENDS) & ~terminal.backends) {
+		terminal.dirty = all_lines_dirty;
+		scrollback.view_dirty = true;
 	}
+
+	terminal.backends = backends;
+
+	ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
-static void print_integer_as_hex(struct printf_format *format, size_t num) {
-	char buf[17] = "0000000000000000";
+uint8_t terminal_get_backends(void) {
+	return terminal.backends;
+}
 
-	char offset_for_hex = 0x57;
-	if(format->specifier == 'X') {
-		offset_for_hex = 0x37;
-	}
+void clear_terminal(void) {
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
 
-	int i=15;
-	while(num > 0) {
-		int end_digit = num % 16;
-		buf[i--] = (end_digit < 10) ? (end_digit + 0x30) : (end_digit + offset_for_hex);
-		num = num >> 4;
+	for(size_t y=0; y < terminal.col_max; ++y) {
+		clear_line(terminal.shadow[y]);
 	}
 
-	for(i=0; i < sizeof(buf)/sizeof(buf[0]) - 1; ++i) {
-		if(buf[i] != '0') {
-			break;
-		}
-	}
+	terminal.top = 0;
+	terminal.dirty = all_lines_dirty;
 
-	i = min(i, 15 - format->width);
+	ticket_unlock_irqrestore(&terminal_lock, flags);
+}
 
-	if(format->flags & ALWAYS_SHOW_0x_OR_DECIMAL_POINT) {
-		if(format->specifier == 'X') {
-			print_text("0X");
-		} else {
-			print_text("0x");
-		}
+size_t strlen(const char* s) {
+	size_t len=0;
+	while(s[len]) {
+		++len;
 	}
 
-	print_text(&buf[i]);
+	return len;
 }
 
-static void print_integer_as_decimal(struct printf_format *format, size_t num) {
+// The old top line becomes the new bottom line, nothing is moved until the flush
+static void scroll_terminal(void) {
+	push_history(terminal_line(0));
 
+	terminal.top = (terminal.top + 1) % terminal.col_max;
+	clear_line(terminal_line(terminal.col_max - 1));
+	terminal.dirty = all_lines_dirty;
 }
 
-static void print_integer(struct printf_format *format, size_t num) {
-	if(format->specifier == 'X' || format->specifier == 'x') {
-		print_integer_as_hex(format, num);
-	} else {
-		print_integer_as_decimal(format, num);
+void print_newline(void) {
+	terminal.row = 0;
+	terminal.col++;
+	if(terminal.col == terminal.col_max) {
+		scroll_terminal();
+		terminal.col--;
 	}
 }
 
-static void print_int(struct printf_format* format, int data) {
-	size_t elem = data;
-	print_integer(format, elem);
-}
+void terminal_put_char(vga_char c) {
+	terminal_put_char_at(c, terminal.row, terminal.col);
 
-static void print_unsigned_int(struct printf_format* format, size_t data) {
-	print_integer(format, data);
+	++terminal.row;
+	if(terminal.row == terminal.row_max) {
+		terminal.row = 0;
+		print_newline();
+	}
 }
 
-static void print_signed_int(struct printf_format* format, long long int data) {
-	print_integer(format, data);
-}
+static const char newline = '\n';
 
-static void print_char(struct printf_format* format, char data) {
-	terminal_put_char(make_vga_char(data, terminal.default_color));
-}
+void terminal_print_char(char c) {
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
 
-static void print_long_int(struct printf_format* format, long int data) {
-	size_t elem = data;
-	print_integer(format, elem);
-}
+	if(terminal.backends & TERMINAL_BACKEND_SERIAL) {
+		serial_write(&c, 1);
+	}
 
-static void print_long_long_int(struct printf_format* format, long long int data) {
-	size_t elem = data;
-	print_integer(format, elem);
-}
+	if(terminal.backends & TERMINAL_SCREEN_BACKENDS) {
+		if(c == newline) {
+			print_newline();
+		} else {
+			terminal_put_char(make_vga_char(c, terminal.default_color));
+		}
+	}
 
-static void print_intmax_t(struct printf_format* format, intmax_t data) {
-	size_t elem = data;
-	print_integer(format, elem);
+	ticket_unlock_irqrestore(&terminal_lock, flags);
 }
 
-static void print_size_t(struct printf_format* format, size_t data) {
-	size_t elem = data;
-	print_integer(format, elem);
-}
+static void print_tab() {
+	size_t cur_col = terminal.row;
+	size_t spaces_needed = tab_space_num - (cur_col % tab_space_num);
 
-static void print_short_int(struct printf_format* format, short int data) {
-	size_t elem = data;
-	print_integer(format, data);
-}
+	if(spaces_needed + cur_col >= ROW_MAX) {
+		print_newline();
+	} else {
+		vga_char sp = make_vga_char(' ', terminal.default_color);
 
-static void print_s_char(struct printf_format* format, unsigned char data) {
-	size_t elem = data;
-	print_integer(format, data);
+		for(int i=0; i < spaces_needed; ++i) {
+			terminal_put_char(sp);
+		}
+	}
 }
 
-static void print_ptrdiff_t(struct printf_format* format, ptrdiff_t data) {
-	size_t elem = data;
-	print_integer(format, elem);
+// Draws a run of text a line at a time, the lock must be held
+static void write_locked(const char* text, size_t length) {
+	vga_color color = terminal.default_color;
+	size_t i = 0;
+
+	while(i < length) {
+		if(text[i] == newline) {
+			print_newline();
+			++i;
+			continue;
+		} else if(text[i] == '\t') {
+			print_tab();
+			++i;
+			continue;
+		}
+
+		vga_char *line = terminal_line(terminal.col);
+		size_t space = terminal.row_max - terminal.row;
+		size_t n = 0;
+
+		while(n < space && i + n < length && text[i + n] != newline && text[i + n] != '\t') {
+			line[terminal.row + n] = make_vga_char(text[i + n], color);
+			++n;
+		}
+
+		terminal.dirty |= 1u << terminal.col;
+		terminal.row += n;
+		i += n;
+
+		if(terminal.row == terminal.row_max) {
+			terminal.row = 0;
+			print_newline();
+		}
+	}
 }
 
-static void print_wchar_t(struct printf_format* format, wchar_t data) {
+// Hands the text to every selected backend, the lock must be held
+static void output_locked(const char* text, size_t length) {
+	if(terminal.backends & TERMINAL_BACKEND_SERIAL) {
+		if(panicking[this_cpu_id()]) {
+			serial_write_polled(text, length);
+		} else {
+			serial_write(text, length);
+		}
+	}
+
+	if(terminal.backends & TERMINAL_SCREEN_BACKENDS) {
+		write_locked(text, length);
+	}
+}
 
+// Takes the lock, unless this cpu is reporting a fault and may hold it already
+static void lock_terminal(void) {
+	if(!panicking[this_cpu_id()]) {
+		ticket_lock(&terminal_lock);
+	}
 }
 
-static void print_string(struct printf_format* format, const char* data) {
-	int i=0;
-	while(data[i] != 0) {
-		terminal_put_char(make_vga_char(data[i++], terminal.default_color));
+static void unlock_terminal(void) {
+	if(!panicking[this_cpu_id()]) {
+		ticket_unlock(&terminal_lock);
 	}
 }
 
-static void print_long_double(struct printf_format* format, long double data) {
+void terminal_write(const char* text, size_t length) {
+	uint64_t flags = irq_save();
+	lock_terminal();
+	output_locked(text, length);
+	unlock_terminal();
+	irq_restore(flags);
+}
 
+void print_text(const char* text) {
+	terminal_write(text, strlen(text));
 }
 
-static void print_double(struct printf_format* format, double data) {
+// Formatting happens outside the lock into a per cpu buffer, which is only
+// safe to use with interrupts disabled
+static char printf_buffers[MAX_CPUS][TERMINAL_PRINTF_BUFFER_SIZE];
+
+static void printf_flush(struct format_buffer *buffer) {
+	lock_terminal();
+	output_locked(buffer->data, buffer->used);
+	unlock_terminal();
 
+	buffer->used = 0;
 }
 
 void terminal_printf(const char* str, ...) {
-	int curr_arg = 0;
 	va_list args;
-
 	va_start(args, str);
 
-	for(int i=0; i < strlen(str); ++i) {
-		if(str[i] == '\\') {
-			switch(str[++i]) {
-				case '\\':
-					break;
-			}
-		} else if(str[i] == '%') {
-			if(str[++i] != '%') {
-				struct printf_format format;
-				i += get_format(&format, &str[i]);
-				int width=0;
-				int precision = 0;
-
-				if(format.width == FORMAT_ARG_SPECIFIED) {
-					format.width = va_arg(args, int);
-				}
-
-				if(format.precision == FORMAT_ARG_SPECIFIED) {
-					format.precision = va_arg(args, int);
-				}
-
-				switch(format.type) {
-					case NO_FORMAT:
-						break;
-					case INT:
-						if(format.is_unsigned) {
-							print_unsigned_int(&format, va_arg(args, unsigned int));
-						} else {
-							print_signed_int(&format, va_arg(args, int));
-						}
-						break;
-					case S_CHAR:
-						break;
-					case CHAR:
-						if(format.is_pointer) {
-							print_string(&format, (char*)va_arg(args, int));
-						} else {
-							print_char(&format, (char)va_arg(args, int));
-						}
-						break;
-					case SHORT_INT:
-						print_short_int(&format, (short int)va_arg(args, int));
-						break;
-					case LONG_INT:
-						print_long_int(&format, va_arg(args, long int));
-						break;
-					case LONG_LONG_INT:
-						print_long_long_int(&format, va_arg(args, long long int));
-						break;
-					case INTMAX_T:
-						print_intmax_t(&format, va_arg(args, intmax_t));
-						break;
-					case SIZE_T:
-						print_size_t(&format, va_arg(args, size_t));
-						break;
-					case PTRDIFF_T:
-						print_ptrdiff_t(&format, va_arg(args, ptrdiff_t));
-						break;
-					case LONG_DOUBLE:
-						print_long_double(&format, va_arg(args, long double));
-						break;
-					case WINT_T:
-						//print_wint_t(format, va_arg(args, wint_t));
-
-						//unknown type?
-						break;
-					case WCHAR_T:
-						print_wchar_t(&format, va_arg(args, wchar_t));
-						break;
-					case DOUBLE:
-						print_double(&format, va_arg(args, double));
-						break;
-					default:
-						assert(0!=0);
-				}
-				continue;
-			}
-		}
+	uint64_t flags = irq_save();
 
-		if(str[i] == '\n') {
-			print_newline();
-		} else if(str[i] == '\t') {
-			print_tab();
-		} else {
-			//print normal char
-			terminal_put_char(make_vga_char(str[i], terminal.default_color));
-		}
-	}
+	struct format_buffer out = {
+		.data = printf_buffers[this_cpu_id()],
+		.size = TERMINAL_PRINTF_BUFFER_SIZE,
+		.used = 0,
+		.total = 0,
+		.flush = printf_flush,
+		.context = NULL
+	};
+
+	kvformat(&out, str, args);
+	printf_flush(&out);
+
+	irq_restore(flags);
 
 	va_end(args);
-}
\ No newline at end of file
+}
+
+// A full line into the shadow buffer, once the cursor is on the bottom line
+// each one scrolls the screen and pushes a line into the scrollback. Drawing
+// happens later in the flush, whichever backends are selected.
+static void scroll_benchmark(void *context) {
+	(void) context;
+	static const char line[] = "scroll benchmark 0123456789 abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTU\n";
+
+	uint64_t flags = ticket_lock_irqsave(&terminal_lock);
+	write_locked(line, sizeof(line) - 1);
+	ticket_unlock_irqrestore(&terminal_lock, flags);
+}
+BENCHMARK("terminal_scroll", scroll_benchmark);
@@ -3,10 +3,23 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include "assert.h"
 
-static const size_t COL_MAX = 25;
-static const size_t ROW_MAX = 80;
+// Text mode is TERMINAL_WIDTH cells by TERMINAL_HEIGHT lines
+#define TERMINAL_WIDTH 80
+#define TERMINAL_HEIGHT 25
+
+// Lines kept after they scroll off the screen, and the run length encoded
+// cells shared between them. Lines are dropped early if the runs fill up.
+#define TERMINAL_SCROLLBACK_LINES 10000
+#define TERMINAL_SCROLLBACK_RUNS (16 * TERMINAL_SCROLLBACK_LINES)
+
+// terminal_printf output is written out in chunks of this size
+#define TERMINAL_PRINTF_BUFFER_SIZE 256
+
+static const size_t COL_MAX = TERMINAL_HEIGHT;
+static const size_t ROW_MAX = TERMINAL_WIDTH;
 
 typedef enum {
 	VGA_COLOR_BLACK = 0,
@@ -27,6 +40,16 @@ typedef enum {
 	VGA_COLOR_WHITE = 15,
 } vga_color_code;
 
+// Where terminal output goes, any combination of these
+enum terminal_backend {
+	TERMINAL_BACKEND_VGA = 0x1,
+	TERMINAL_BACKEND_SERIAL = 0x2,
+	TERMINAL_BACKEND_FRAMEBUFFER = 0x4
+};
+
+// Backends drawn from the screen contents, the others take the text as it is written
+#define TERMINAL_SCREEN_BACKENDS (TERMINAL_BACKEND_VGA | TERMINAL_BACKEND_FRAMEBUFFER)
+
 typedef uint8_t vga_color;
 typedef uint16_t vga_char;
 
@@ -41,10 +64,50 @@ typedef struct {
 
 	size_t col_max;
 	size_t row_max;
+
+	// Characters are drawn into a RAM copy of the screen whose lines form a
+	// ring, top is the line shown first. Screen lines that differ from VGA
+	// memory have their bit set in dirty.
+	vga_char shadow[TERMINAL_HEIGHT][TERMINAL_WIDTH];
+	size_t top;
+	uint32_t dirty;
+
+	uint8_t backends;
 } Terminal;
 
 void clear_terminal(void);
 void init_terminal(void);
 void set_foreground_color(vga_color_code new_color);
 void set_background_color(vga_color_code new_color);
-void terminal_printf(const char* str, ...);
\ No newline at end of file
+void terminal_printf(const char* str, ...);
+
+// Writes length characters with a single lock acquisition
+void terminal_write(const char* text, size_t length);
+void print_text(const char* text);
+void terminal_print_char(char c);
+
+// The screen contents are kept up to date only while a screen backend is selected
+void terminal_set_backends(uint8_t backends);
+uint8_t terminal_get_backends(void);
+
+// Draws the dirty lines on the screen backends and waits for queued serial output
+void terminal_flush(void);
+
+/* Called from the timer interrupt, skips the flush if the terminal is busy.
+ * The framebuffer is flushed from a worker thread instead, it takes SSE.
+ */
+void terminal_timer_flush(void);
+
+/* For reporting a fault, which may have hit while this cpu held the terminal
+ * lock. Until terminal_panic_end the cpu's output skips the lock, and goes
+ * to the shadow buffer and to the uart by polling. Returns true if the lock
+ * was free, it is then held so other cpus wait. Interrupts must be disabled.
+ */
+bool terminal_panic_begin(void);
+void terminal_panic_end(bool locked);
+
+// Moves the view back into the scrollback history (positive) or forward (negative)
+void terminal_view_scroll(int lines);
+
+// Returns the view to the live screen
+void terminal_view_reset(void);
\ No newline at end of file
@@ -0,0 +1,214 @@
+#include "thread.h"
+#include "scheduler.h"
+#include "paging.h"
+#include "terminal.h"
+#include "cpu.h"
+
+// Stacks get their own area above the heap. Each slot has an unmapped
+// guard page below the stack so an overflow faults instead of corrupting
+// the neighbouring thread.
+static const uintptr_t thread_stack_area_start = 2UL * 4096 * 512 * 512;
+static const size_t thread_stack_slot_size = THREAD_STACK_SIZE + PAGE_SIZE;
+
+static struct thread threads[MAX_THREADS];
+static size_t next_thread_id = 0;
+
+extern void thread_entry_trampoline(void);
+
+const char *thread_state_strings[] = {
+    "unused",
+    "ready",
+    "running",
+    "blocked",
+    "zombie",
+    "dead"
+};
+
+static bool try_reserve(struct thread *thread, enum thread_state expected) {
+    return __atomic_compare_exchange_n(&thread->state, &expected, thread_blocked, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static struct thread* reserve_thread(void) {
+    for(size_t i=0; i<MAX_THREADS; ++i) {
+        struct thread *thread = &threads[i];
+
+        if(try_reserve(thread, thread_unused) || try_reserve(thread, thread_dead)) {
+            thread->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns 0 on success. Non-zero if frames ran out.
+ * Stacks stay mapped once a slot has been used, dead threads hand theirs on.
+ */
+static int map_thread_stack(struct thread *thread) {
+    if(thread->stack_top != 0) {
+        return 0;
+    }
+
+    size_t slot = thread - threads;
+    uintptr_t bottom = thread_stack_area_start + slot * thread_stack_slot_size + PAGE_SIZE;
+
+    for(uintptr_t addr = bottom; addr < bottom + THREAD_STACK_SIZE; addr += PAGE_SIZE) {
+        struct page page;
+        struct frame frame;
+
+        if(allocate_frame(&frame) != 0) {
+            return -1;
+        }
+
+        get_page_for_vaddr(addr, &page);
+        map_page_to_frame(&page, &frame, present_bit | writeable_bit | no_exec_bit, memory_type_write_back);
+    }
+
+    thread->stack_bottom = bottom;
+    thread->stack_top = bottom + THREAD_STACK_SIZE;
+
+    return 0;
+}
+
+static void reset_thread(struct thread *thread, const char *name) {
+    thread->name = name;
+    thread->cpu = this_cpu_id();
+    thread->fpu_saved = false;
+    thread->next = NULL;
+    thread->stats = (struct thread_stats){ 0 };
+    thread->pmu.counting = false;
+}
+
+struct thread* thread_create(const char *name, thread_function function, void *arg) {
+    return thread_create_on(this_cpu_id(), name, function, arg);
+}
+
+struct thread* thread_create_on(size_t cpu, const char *name, thread_function function, void *arg) {
+    struct thread *thread = reserve_thread();
+
+    if(thread == NULL) {
+        return NULL;
+    }
+
+    if(map_thread_stack(thread) != 0) {
+        thread->state = thread_unused;
+        return NULL;
+    }
+
+    reset_thread(thread, name);
+    thread->cpu = cpu;
+
+    // Initial frame popped by context_switch, which then returns into
+    // thread_entry_trampoline with the entry point in r12 and its argument in r13
+    uintptr_t *sp = (uintptr_t*) thread->stack_top;
+    *--sp = 0;
+    *--sp = (uintptr_t) thread_entry_trampoline;
+    *--sp = 0;                   // rbp, terminates frame pointer chains
+    *--sp = 0;                   // rbx
+    *--sp = (uintptr_t) function; // r12
+    *--sp = (uintptr_t) arg;      // r13
+    *--sp = 0;                   // r14
+    *--sp = 0;                   // r15
+    thread->saved_sp = (uintptr_t) sp;
+
+    scheduler_enqueue(thread);
+
+    return thread;
+}
+
+struct thread* thread_create_from_current(const char *name) {
+    struct thread *thread = reserve_thread();
+    assert(thread != NULL);
+
+    reset_thread(thread, name);
+    thread->state = thread_running;
+
+    return thread;
+}
+
+struct thread* thread_create_idle(size_t cpu) {
+    struct thread *thread = reserve_thread();
+
+    if(thread == NULL) {
+        return NULL;
+    }
+
+    if(map_thread_stack(thread) != 0) {
+        thread->state = thread_unused;
+        return NULL;
+    }
+
+    reset_thread(thread, "idle");
+    thread->cpu = cpu;
+    thread->state = thread_running;
+
+    return thread;
+}
+
+// Entered from thread_entry_trampoline on the new thread's stack
+void thread_start(thread_function function, void *arg) {
+    scheduler_switched_in();
+    asm volatile("sti");
+
+    function(arg);
+
+    thread_exit();
+}
+
+void thread_exit(void) {
+    irq_save();
+
+    // becomes dead once the next thread is running and the stack is free
+    scheduler_current()->state = thread_zombie;
+    schedule(true);
+
+    // a zombie thread is never switched back to
+    while(1) {
+        asm volatile("hlt");
+    }
+}
+
+void thread_yield(void) {
+    uint64_t flags = irq_save();
+    schedule(true);
+    irq_restore(flags);
+}
+
+void thread_block(void) {
+    uint64_t flags = irq_save();
+
+    scheduler_current()->state = thread_blocked;
+    schedule(true);
+
+    irq_restore(flags);
+}
+
+void thread_wake(struct thread *thread) {
+    enum thread_state expected = thread_blocked;
+
+    // only one waker may queue the thread, it could be woken from several cpus at once
+    if(__atomic_compare_exchange_n(&thread->state, &expected, thread_ready, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        scheduler_enqueue(thread);
+    }
+}
+
+struct thread* thread_current(void) {
+    return scheduler_current();
+}
+
+void thread_print_stats(void) {
+    for(size_t i=0; i<MAX_THREADS; ++i) {
+        struct thread *thread = &threads[i];
+        if(thread->state == thread_unused) {
+            continue;
+        }
+
+        struct thread_stats *stats = &thread->stats;
+        uint64_t average = stats->switched_in ? stats->switch_latency_total / stats->switched_in : 0;
+
+        terminal_printf("%s id: %#zx %s\tvol: %#zx\tinvol: %#zx\tlat avg: %#zx max: %#zx\n",
+            thread->name, thread->id, thread_state_strings[thread->state],
+            stats->voluntary_switches, stats->involuntary_switches,
+            average, stats->switch_latency_max);
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "frame_allocator.h"
+#include "pmu.h"
+
+#define MAX_THREADS 64
+#define THREAD_STACK_SIZE (4 * PAGE_SIZE)
+
+enum thread_state {
+    thread_unused = 0,
+    thread_ready,
+    thread_running,
+    thread_blocked,
+    thread_zombie,
+    thread_dead
+};
+
+// All latencies are in TSC cycles
+struct thread_stats {
+    uint64_t voluntary_switches;
+    uint64_t involuntary_switches;
+    uint64_t switched_in;
+    uint64_t switch_latency_total;
+    uint64_t switch_latency_max;
+};
+
+typedef void (*thread_function)(void *arg);
+
+struct thread {
+    // fxsave area, only filled when the thread is preempted
+    uint8_t fpu_state[512];
+    bool fpu_saved;
+
+    // stack pointer holding the callee saved registers, see context_switch.s
+    uintptr_t saved_sp;
+
+    size_t id;
+    const char *name;
+    enum thread_state state;
+    size_t cpu;
+
+    uintptr_t stack_bottom;
+    uintptr_t stack_top;
+
+    struct thread *next;
+
+    struct thread_stats stats;
+
+    struct pmu_thread_state pmu;
+} __attribute__ ((aligned (16)));
+
+/* Returns the new thread, already queued on the current cpu.
+ * Returns NULL if there are no free thread slots or stack memory.
+ */
+struct thread* thread_create(const char *name, thread_function function, void *arg);
+
+// As thread_create but the thread is queued on, and stays on, the given cpu
+struct thread* thread_create_on(size_t cpu, const char *name, thread_function function, void *arg);
+
+/* Wraps the context that is already running on this cpu (the boot stack)
+ * so that it can be switched away from.
+ */
+struct thread* thread_create_from_current(const char *name);
+
+// Idle thread for another cpu, its stack is where that cpu starts running
+struct thread* thread_create_idle(size_t cpu);
+
+void thread_exit(void);
+void thread_yield(void);
+
+// Blocks the current thread until thread_wake is called on it
+void thread_block(void);
+void thread_wake(struct thread *thread);
+
+struct thread* thread_current(void);
+
+void thread_print_stats(void);
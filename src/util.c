@@ -1 +1,50 @@
-#include "util.h"
\ No newline at end of file
+#include "util.h"
+
+void* memcpy(void *dest, const void *src, size_t bytes) {
+    void *ret = dest;
+    asm volatile("rep movsb"
+                 : "+D"(dest), "+S"(src), "+c"(bytes)
+                 :
+                 : "memory");
+    return ret;
+}
+
+void* memmove(void *dest, const void *src, size_t bytes) {
+    if(dest <= src || (const uint8_t*)src + bytes <= (uint8_t*)dest) {
+        return memcpy(dest, src, bytes);
+    }
+
+    // overlapping with dest above src, copy backwards
+    void *ret = dest;
+    dest = (uint8_t*)dest + bytes - 1;
+    src = (const uint8_t*)src + bytes - 1;
+    asm volatile("std\n"
+                 "rep movsb\n"
+                 "cld"
+                 : "+D"(dest), "+S"(src), "+c"(bytes)
+                 :
+                 : "memory");
+    return ret;
+}
+
+void* memset(void *dest, int value, size_t bytes) {
+    void *ret = dest;
+    asm volatile("rep stosb"
+                 : "+D"(dest), "+c"(bytes)
+                 : "a"(value)
+                 : "memory");
+    return ret;
+}
+
+int memcmp(const void *a, const void *b, size_t bytes) {
+    const uint8_t *pa = a;
+    const uint8_t *pb = b;
+
+    for(size_t i=0; i<bytes; ++i) {
+        if(pa[i] != pb[i]) {
+            return pa[i] - pb[i];
+        }
+    }
+
+    return 0;
+}
@@ -1,5 +1,12 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+
+// gcc may emit calls to these even in freestanding code
+void* memcpy(void *dest, const void *src, size_t bytes);
+void* memmove(void *dest, const void *src, size_t bytes);
+void* memset(void *dest, int value, size_t bytes);
+int memcmp(const void *a, const void *b, size_t bytes);
 
 static inline uint8_t inb(uint16_t port) {
     uint8_t ret;
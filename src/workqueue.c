@@ -0,0 +1,284 @@
+#include "workqueue.h"
+#include "thread.h"
+#include "terminal.h"
+#include "cpu.h"
+#include "benchmark.h"
+
+// Chase-Lev work stealing deque with a fixed size ring.
+// The owning cpu pushes and takes at the bottom, other cpus steal from the top.
+// Interrupt handlers push too, so the owner side runs with interrupts disabled.
+struct work_deque {
+    volatile int64_t top;
+    uint8_t top_padding[64 - sizeof(int64_t)];
+
+    volatile int64_t bottom;
+    uint8_t bottom_padding[64 - sizeof(int64_t)];
+
+    struct work_item *volatile items[WORK_DEQUE_SIZE];
+} __attribute__ ((aligned (64)));
+
+struct work_cpu {
+    struct work_deque deque;
+
+    struct thread *worker;
+    volatile bool sleeping;
+    uint64_t steal_seed;
+
+    struct work_stats stats;
+} __attribute__ ((aligned (64)));
+
+static struct work_cpu work_cpus[MAX_CPUS];
+static volatile size_t work_cpu_count;
+
+static const int64_t deque_mask = WORK_DEQUE_SIZE - 1;
+
+static int deque_push(struct work_deque *deque, struct work_item *item) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if(bottom - top >= WORK_DEQUE_SIZE) {
+        return -1;
+    }
+
+    deque->items[bottom & deque_mask] = item;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static struct work_item* deque_take(struct work_deque *deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if(top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    struct work_item *item = deque->items[bottom & deque_mask];
+
+    if(top == bottom) {
+        // last item, race the stealers for it
+        if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return item;
+}
+
+static struct work_item* deque_steal(struct work_deque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if(top >= bottom) {
+        return NULL;
+    }
+
+    struct work_item *item = deque->items[top & deque_mask];
+
+    if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return item;
+}
+
+static inline bool deque_empty(struct work_deque *deque) {
+    return __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE) <= __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t next_victim_seed(struct work_cpu *cpu) {
+    // xorshift64
+    uint64_t x = cpu->steal_seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cpu->steal_seed = x;
+
+    return x;
+}
+
+static struct work_item* find_work(void) {
+    struct work_cpu *cpu = &work_cpus[this_cpu_id()];
+
+    uint64_t flags = irq_save();
+    struct work_item *item = deque_take(&cpu->deque);
+    irq_restore(flags);
+
+    if(item != NULL) {
+        return item;
+    }
+
+    size_t count = work_cpu_count;
+    if(count <= 1) {
+        return NULL;
+    }
+
+    size_t start = next_victim_seed(cpu) % count;
+    for(size_t i=0; i<count; ++i) {
+        size_t victim = (start + i) % count;
+        if(victim == this_cpu_id()) {
+            continue;
+        }
+
+        item = deque_steal(&work_cpus[victim].deque);
+        if(item != NULL) {
+            ++cpu->stats.stolen;
+            return item;
+        }
+    }
+
+    ++cpu->stats.failed_steals;
+    return NULL;
+}
+
+static void run_work_item(struct work_item *item) {
+    struct work_group *group = item->group;
+
+    item->function(item);
+    ++work_cpus[this_cpu_id()].stats.executed;
+
+    if(group != NULL) {
+        __atomic_sub_fetch(&group->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void wake_worker(struct work_cpu *cpu) {
+    if(cpu->worker != NULL && cpu->sleeping) {
+        thread_wake(cpu->worker);
+    }
+}
+
+static void worker_main(void *arg) {
+    struct work_cpu *cpu = arg;
+
+    while(1) {
+        struct work_item *item = find_work();
+        if(item != NULL) {
+            run_work_item(item);
+            continue;
+        }
+
+        uint64_t flags = irq_save();
+        if(deque_empty(&cpu->deque)) {
+            cpu->sleeping = true;
+            thread_block();
+            cpu->sleeping = false;
+        }
+        irq_restore(flags);
+    }
+}
+
+void workqueue_init(void) {
+    size_t id = this_cpu_id();
+    struct work_cpu *cpu = &work_cpus[id];
+
+    cpu->steal_seed = read_tsc() | 1;
+    cpu->worker = thread_create("worker", worker_main, cpu);
+    assert(cpu->worker != NULL);
+
+    __atomic_add_fetch(&work_cpu_count, 1, __ATOMIC_RELEASE);
+}
+
+int work_submit(struct work_item *item) {
+    struct work_cpu *cpu = &work_cpus[this_cpu_id()];
+
+    uint64_t flags = irq_save();
+    int ret = deque_push(&cpu->deque, item);
+    irq_restore(flags);
+
+    if(ret != 0) {
+        return ret;
+    }
+
+    if(cpu->sleeping) {
+        wake_worker(cpu);
+        return 0;
+    }
+
+    // the local worker is busy, hand the chance to steal to a sleeping cpu
+    size_t count = work_cpu_count;
+    for(size_t i=0; i<count; ++i) {
+        if(work_cpus[i].sleeping) {
+            wake_worker(&work_cpus[i]);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+void work_group_init(struct work_group *group) {
+    group->pending = 0;
+}
+
+void work_group_submit(struct work_group *group, struct work_item *item) {
+    item->group = group;
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    if(work_submit(item) != 0) {
+        run_work_item(item);
+    }
+}
+
+void work_group_join(struct work_group *group) {
+    while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0) {
+        struct work_item *item = find_work();
+
+        if(item != NULL) {
+            run_work_item(item);
+        } else {
+            // the remaining items are running on other cpus
+            cpu_relax();
+        }
+    }
+}
+
+void workqueue_print_stats(void) {
+    for(size_t i=0; i<work_cpu_count; ++i) {
+        struct work_stats *stats = &work_cpus[i].stats;
+        terminal_printf("cpu %#zx executed: %#zx\tstolen: %#zx\tfailed steals: %#zx\n",
+            i, stats->executed, stats->stolen, stats->failed_steals);
+    }
+}
+
+#define BENCHMARK_BATCH 128
+
+static volatile uint64_t benchmark_sink;
+
+static void benchmark_item(struct work_item *item) {
+    uint64_t x = (uintptr_t) item->arg;
+    for(int i=0; i<64; ++i) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    }
+    __atomic_add_fetch(&benchmark_sink, x, __ATOMIC_RELAXED);
+}
+
+// One batch forked across the workers and joined, run with make bench SMP=n to see it scale
+static void fork_join_benchmark(void *context) {
+    (void) context;
+    static struct work_item batch[BENCHMARK_BATCH];
+    struct work_group group;
+
+    work_group_init(&group);
+
+    for(size_t i=0; i<BENCHMARK_BATCH; ++i) {
+        batch[i].function = benchmark_item;
+        batch[i].arg = (void*) i;
+        work_group_submit(&group, &batch[i]);
+    }
+
+    work_group_join(&group);
+}
+
+// How the items were spread and stolen across the cpus
+static void fork_join_teardown(void *context) {
+    (void) context;
+    workqueue_print_stats();
+}
+BENCHMARK_WITH_SETUP("workqueue_fork_join", fork_join_benchmark, NULL, fork_join_teardown);
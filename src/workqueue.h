@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Must be a power of two
+#define WORK_DEQUE_SIZE 256
+
+struct work_item;
+typedef void (*work_function)(struct work_item *item);
+
+struct work_group;
+
+struct work_item {
+    work_function function;
+    void *arg;
+    struct work_group *group;
+};
+
+// Fork/join counter, see work_group_join
+struct work_group {
+    volatile size_t pending;
+};
+
+struct work_stats {
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t failed_steals;
+};
+
+// Starts the worker thread for the current cpu
+void workqueue_init(void);
+
+/* Queues the item on the current cpu. Safe to call from interrupt handlers.
+ * Returns 0 on success. Non-zero if the cpu's deque is full.
+ */
+int work_submit(struct work_item *item);
+
+void work_group_init(struct work_group *group);
+
+// Runs the item inline if the deque is full
+void work_group_submit(struct work_group *group, struct work_item *item);
+
+// Executes queued work until every item in the group has completed
+void work_group_join(struct work_group *group);
+
+void workqueue_print_stats(void);